@@ -0,0 +1,101 @@
+//
+// agg.c - rolling window aggregates (mean, min, max, count, slope) per field
+//
+// $Id$
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ems.h"
+
+// window lengths in s, see enum aggWindow
+static const int32_t AggWindow[AGGWINDOWS] = { 60, 300, 600, 900 };
+
+// add a sample to the current bucket of every window, O(1).
+// Called by the field writer inside the field's sequence lock.
+void aggUpdate(int id, int32_t value, int64_t stamp) {
+    struct aggBucket *b;
+    int64_t ms, sec, start, t;
+    int32_t width;
+    int w;
+
+    ms = stamp / 1000000;
+    sec = ms / 1000;
+    for (w = 0; w < AGGWINDOWS; w++) {
+	width = AggWindow[w] / AGGBUCKETS;
+	start = sec - sec % width;
+	b = &emsPtr->agg[id].b[w][(start / width) % AGGBUCKETS];
+	if (b->start != start) {
+	    // bucket is from an older round, recycle it
+	    memset(b, 0, sizeof(*b));
+	    b->start = start;
+	    b->min = value;
+	    b->max = value;
+	}
+	t = ms - start * 1000;
+	b->sum += value;
+	b->sumT += t;
+	b->sumTT += t * t;
+	b->sumTV += t * value;
+	b->count++;
+	if (value < b->min)
+	    b->min = value;
+	if (value > b->max)
+	    b->max = value;
+    }
+}
+
+// combine the buckets of window for field id, as seen at time now (s).
+// Returns the number of samples, 0 if the window is empty, -1 on error.
+int aggRead(int id, int window, int64_t now, struct aggResult *res) {
+    struct aggBucket b[AGGBUCKETS];
+    struct emsField *f;
+    double n = 0, sumV = 0, sumT = 0, sumTT = 0, sumTV = 0, d, den;
+    int64_t oldest;
+    int32_t width;
+    uint32_t seq;
+    int i;
+
+    if (id < 0 || (uint32_t)id >= emsPtr->reg.nFields || window < 0 || window >= AGGWINDOWS)
+	return (-1);
+
+    // consistent copy of the buckets, guarded by the field's sequence counter
+    f = &emsPtr->field[id];
+    do {
+	while ((seq = __atomic_load_n(&f->seq, __ATOMIC_ACQUIRE)) & 1)
+	    ;
+	memcpy(b, emsPtr->agg[id].b[window], sizeof(b));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (seq != __atomic_load_n(&f->seq, __ATOMIC_RELAXED));
+
+    width = AggWindow[window] / AGGBUCKETS;
+    oldest = now - now % width - (AGGBUCKETS - 1) * width;
+
+    memset(res, 0, sizeof(*res));
+    res->window = AggWindow[window];
+    for (i = 0; i < AGGBUCKETS; i++) {
+	if (b[i].count == 0 || b[i].start < oldest || b[i].start > now)
+	    continue;
+	if (n == 0 || b[i].min < res->min)
+	    res->min = b[i].min;
+	if (n == 0 || b[i].max > res->max)
+	    res->max = b[i].max;
+	// shift bucket relative times to the start of the window (ms)
+	d = (double)(b[i].start - oldest) * 1000.0;
+	n += b[i].count;
+	sumV += b[i].sum;
+	sumT += b[i].count * d + b[i].sumT;
+	sumTT += b[i].count * d * d + 2.0 * d * b[i].sumT + b[i].sumTT;
+	sumTV += d * b[i].sum + b[i].sumTV;
+    }
+    if (n == 0)
+	return (0);
+
+    res->count = (int32_t)n;
+    res->mean = (int32_t)(sumV / n + (sumV >= 0 ? 0.5 : -0.5));
+    den = n * sumTT - sumT * sumT;
+    if (n > 1 && den > 0)
+	res->slope = (int32_t)((n * sumTV - sumT * sumV) / den * 3600000.0);
+
+    return (res->count);
+}
@@ -0,0 +1,231 @@
+//
+// cmd.c - commands from mqtt into the transmit queue of emsSerio
+//
+// $Id$
+//
+// emsMqtt subscribes to <topicprefix>/cmd/<source>/<command>, <source> names
+// the sender (e.g. homeassistant), the payload holds numbers (decimal or 0x):
+//
+//   read   <dest> <type> <offset> <length>   read length bytes
+//   write  <dest> <type> <offset> <byte>...  write the bytes
+//
+// e.g. "ems/cmd/ha/write" with "0x10 0x3d 7 44" or "ems/cmd/ha/read" with
+// "0x10 0x3d 0 42". A command is checked (destination in [EMS] cmddest,
+// EMS 1.0 type, size) and rate limited per source by a token bucket
+// ([EMS] cmdrate commands/s, cmdburst), then queued as telegram for
+// emsSerio, which fills in our bus id and the CRC. The result goes to
+// <topicprefix>/reply/<source>/<command> as
+// {"result":"queued","telegram":"0b 90 3d 00 2a"} or
+// {"result":"rejected","reason":"..."}.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdbool.h>
+
+#include "ems.h"
+
+#define CMDSOURCES 16    // sources with their own bucket, the oldest is reused
+                         // with its tokens, so all together get at most
+                         // CMDSOURCES times the rate
+#define CMDMAXDATA 27    // bytes of a write, MAX_PACKET_SIZE of emsSerio - 5
+
+int mqttPublish(ems *emsPtr, const char *topic, const void *val, int len, int qos, bool retain);
+
+struct bucket {
+    char source[MAXNAME];
+    double tokens;
+    double last;        // s, CLOCK_MONOTONIC
+};
+
+static struct bucket Buckets[CMDSOURCES];
+static char Prefix[MAXNAME];
+static uint8_t Dest[256];     // allowed destinations
+static double Rate, Burst;
+static mqd_t Queue = (mqd_t)-1;
+
+static double monoNow(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+// read the settings, commands are taken from <prefix>/cmd/...
+int cmdInit(const char *prefix) {
+    char message[2 * MAXPATH], *end;
+    const char *p;
+    long d;
+
+    snprintf(Prefix, sizeof(Prefix), "%s", prefix);
+    memset(Dest, 0, sizeof(Dest));
+    for (p = Conf->ems.cmddest; (d = strtol(p, &end, 0)), end != p; p = end) {
+	if (d > 0 && d < 0x80)
+	    Dest[d] = true;
+	while (*end == ',' || *end == ' ')
+	    end++;
+    }
+    Rate = Conf->ems.cmdrate;
+    Burst = Conf->ems.cmdburst;
+    if (strlen(emsPtr->cfg.txqueue) == 0)
+	snprintf(emsPtr->cfg.txqueue, sizeof(emsPtr->cfg.txqueue), "%s", Conf->ems.txqueue);
+
+    sprintf(message, "%s: commands on %s/cmd/<source>/{read,write} to %s, destinations %s, %.1f/s, burst %.0f",
+	    DaemonName, Prefix, emsPtr->cfg.txqueue, Conf->ems.cmddest, Rate, Burst);
+    LOGIT(message);
+    return (0);
+}
+
+// take a token of source, false if it has none left. A new source takes
+// over the bucket of the oldest one as it is: starting it full would let a
+// sender rotate through source names for a fresh burst each time.
+static int cmdAllow(const char *source) {
+    struct bucket *b = NULL;
+    double now = monoNow();
+    int i, oldest = 0;
+
+    for (i = 0; i < CMDSOURCES; i++) {
+	if (strcmp(Buckets[i].source, source) == 0) {
+	    b = &Buckets[i];
+	    break;
+	}
+	if (Buckets[i].last < Buckets[oldest].last)
+	    oldest = i;
+    }
+    if (b == NULL) {
+	b = &Buckets[oldest];
+	snprintf(b->source, sizeof(b->source), "%s", source);
+    }
+    b->tokens += (now - b->last) * Rate;
+    if (b->tokens > Burst)
+	b->tokens = Burst;
+    b->last = now;
+    if (b->tokens < 1.0)
+	return (false);
+    b->tokens -= 1.0;
+    return (true);
+}
+
+// numbers of payload into v (at most max), returns their count or -1
+static int cmdNumbers(const char *payload, int len, long *v, int max) {
+    char buff[256], *p, *end;
+    int n = 0;
+
+    if (len <= 0 || len >= (int)sizeof(buff))
+	return (-1);
+    memcpy(buff, payload, len);
+    buff[len] = '\0';
+    for (p = buff; n < max; p = end) {
+	while (*p == ' ' || *p == ',' || *p == '\t' || *p == '\n' || *p == '\r')
+	    p++;
+	if (*p == '\0')
+	    return (n);
+	v[n++] = strtol(p, &end, 0);
+	if (end == p)
+	    return (-1);
+    }
+    return (-1);
+}
+
+// build the telegram of command from the payload, returns its length or -1
+// with the reason in why
+static int cmdTelegram(const char *command, const char *payload, int len, uint8_t *tg, const char **why) {
+    long v[4 + CMDMAXDATA];
+    int i, n, read;
+
+    read = (strcmp(command, "read") == 0);
+    if (!read && strcmp(command, "write") != 0) {
+	*why = "unknown command, use read or write";
+	return (-1);
+    }
+    if ((n = cmdNumbers(payload, len, v, 4 + CMDMAXDATA)) < 4) {
+	*why = "expected <dest> <type> <offset> and length or data bytes";
+	return (-1);
+    }
+    if (v[0] < 0 || v[0] > 0x7f || !Dest[v[0]]) {
+	*why = "destination not allowed";
+	return (-1);
+    }
+    if (v[1] < 1 || v[1] > 0xfe || v[2] < 0 || v[2] > 0xff) {
+	*why = "type or offset out of range";
+	return (-1);
+    }
+    if (read && (n != 4 || v[3] < 1 || v[3] > 0xff)) {
+	*why = "read length out of range";
+	return (-1);
+    }
+
+    // src (set by emsSerio), dest, type, offset, data or length, crc
+    tg[0] = CLIENT_ID;
+    tg[1] = v[0] | (read ? 0x80 : 0);
+    tg[2] = v[1];
+    tg[3] = v[2];
+    for (i = 3; i < n; i++) {
+	if (v[i] < 0 || v[i] > 0xff) {
+	    *why = "data byte out of range";
+	    return (-1);
+	}
+	tg[i + 1] = v[i];
+    }
+    tg[n + 1] = 0;
+    return (n + 2);
+}
+
+static void cmdReply(const char *source, const char *command, const char *result, const char *detail) {
+    char topic[4 * MAXNAME], buff[300];
+    int len;
+
+    snprintf(topic, sizeof(topic), "%s/reply/%s/%s", Prefix, source, command);
+    len = snprintf(buff, sizeof(buff), "{\"result\":\"%s\",\"%s\":\"%s\"}", result,
+		   strcmp(result, "queued") ? "reason" : "telegram", detail);
+    mqttPublish(emsPtr, topic, buff, len, 1, false);
+}
+
+// a message on <prefix>/cmd/#, called from the mqtt connection thread
+void cmdMessage(const char *topic, const void *payload, int len) {
+    struct cmdStats *s = &emsPtr->stat.cmd;
+    char source[MAXNAME], command[MAXNAME], hex[3 * 32], message[MAXPATH], *h;
+    const char *p, *why;
+    uint8_t tg[32];
+    size_t plen = strlen(Prefix);
+    int i, n, err;
+
+    s->received++;
+    // <prefix>/cmd/<source>/<command>
+    if (strncmp(topic, Prefix, plen) != 0 || strncmp(topic + plen, "/cmd/", 5) != 0)
+	return;
+    p = topic + plen + 5;
+    if (sscanf(p, "%99[^/]/%99[^/]%n", source, command, &n) != 2 || p[n] != '\0') {
+	s->rejected++;
+	return;
+    }
+
+    if (!cmdAllow(source)) {
+	s->limited++;
+	cmdReply(source, command, "rejected", "rate limit");
+	return;
+    }
+    if ((n = cmdTelegram(command, payload, len, tg, &why)) < 0) {
+	s->rejected++;
+	cmdReply(source, command, "rejected", why);
+	return;
+    }
+
+    if (Queue == (mqd_t)-1)
+	Queue = mq_open(emsPtr->cfg.txqueue, O_WRONLY | O_NONBLOCK);
+    if (Queue == (mqd_t)-1 || mq_send(Queue, (char *)tg, n, 0) < 0) {
+	err = errno;
+	s->rejected++;
+	sprintf(message, "%s: command %s from %s not queued, %s", DaemonName, command, source, strerror(err));
+	LOGERR(message);
+	cmdReply(source, command, "rejected", err == EAGAIN ? "transmit queue full" : "no transmit queue");
+	return;
+    }
+
+    for (i = 0, h = hex; i < n - 1; i++)
+	h += sprintf(h, "%s%02x", i ? " " : "", tg[i]);
+    s->queued++;
+    cmdReply(source, command, "queued", hex);
+    sprintf(message, "%s: command %s from %s queued: %s", DaemonName, command, source, hex);
+    LOGIT(message);
+}
@@ -0,0 +1,389 @@
+//
+// col.c - columnar, append-only history store with a per-segment index
+//
+// $Id$
+//
+// Every field has two files under <datapath>/hist, both starting with a
+// struct colHeader (magic, version, segment and index entry size):
+//
+//   <name>.col  fixed size segments of COLSEG bytes. A segment holds
+//               samples as pairs of varints: time delta (unsigned) and
+//               value delta (zigzag), both relative to the previous sample
+//               of the same segment, the first one relative to 0. So every
+//               segment can be decoded on its own.
+//   <name>.idx  one struct colIndex per segment: time range, min, max, first
+//               and last value, count, sum and the bytes used.
+//
+// A range query searches the (small) index and decodes only the segments
+// overlapping the range, both files are read through mmap. The writer keeps
+// the open segment in memory; colSync() writes it and then its index entry,
+// with a flush in between, so the index never points to data that is not on
+// disk. Samples must come in time order, older ones are dropped and counted.
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ems.h"
+#include "col.h"
+
+#define VARMAX 5  // bytes of a 32 bit varint
+
+// file offsets of segment seg and of its index entry
+#define COLOFF(seg) ((off_t)sizeof(struct colHeader) + (off_t)(seg) * COLSEG)
+#define IDXOFF(seg) ((off_t)sizeof(struct colHeader) + (off_t)(seg) * sizeof(struct colIndex))
+
+static uint8_t *putVar(uint8_t *p, uint32_t v) {
+    while (v >= 0x80) {
+	*p++ = v | 0x80;
+	v >>= 7;
+    }
+    *p++ = v;
+    return (p);
+}
+
+static const uint8_t *getVar(const uint8_t *p, const uint8_t *end, uint32_t *v) {
+    int shift = 0;
+
+    *v = 0;
+    while (p < end && shift < 35) {
+	*v |= (uint32_t)(*p & 0x7f) << shift;
+	if ((*p++ & 0x80) == 0)
+	    return (p);
+	shift += 7;
+    }
+    return (NULL);
+}
+
+static uint32_t zigzag(int32_t v) {
+    return (((uint32_t)v << 1) ^ (uint32_t)(v >> 31));
+}
+
+static int32_t unzigzag(uint32_t v) {
+    return ((int32_t)(v >> 1) ^ -(int32_t)(v & 1));
+}
+
+// names of the files of field name, with create the directory is made
+static int colFiles(char *col, char *idx, const char *path, const char *name, int create) {
+    char dir[MAXPATH];
+
+    if (snprintf(dir, MAXPATH, "%s/%s", path, COLDIR) >= MAXPATH
+	|| snprintf(col, MAXPATH, "%s/%s.col", dir, name) >= MAXPATH
+	|| snprintf(idx, MAXPATH, "%s/%s.idx", dir, name) >= MAXPATH) {
+	errno = ENAMETOOLONG;
+	return (-1);
+    }
+    if (create && mkdir(dir, 0755) < 0 && errno != EEXIST)
+	return (-1);
+    return (0);
+}
+
+static int colValid(const struct colHeader *h) {
+    return (h->magic == COLMAGIC && h->version == COLVERSION && h->segSize == COLSEG
+	    && h->entrySize == sizeof(struct colIndex));
+}
+
+// check the header of a column file, an empty one gets it written
+static int colHead(int fd, off_t size) {
+    struct colHeader h = { COLMAGIC, COLVERSION, COLSEG, sizeof(struct colIndex) };
+
+    if (size == 0)
+	return (pwrite(fd, &h, sizeof(h), 0) == sizeof(h) ? 0 : -1);
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || !colValid(&h)) {
+	errno = EPROTO;
+	return (-1);
+    }
+    return (0);
+}
+
+// decode up to max samples of segment seg, returns their number or -1
+static int colDecodeBuf(const uint8_t *p, const struct colIndex *x, uint32_t *t, int32_t *v, int max) {
+    const uint8_t *end = p + x->used;
+    uint32_t dt, dv, lt = 0;
+    int32_t lv = 0;
+    uint32_t i;
+
+    for (i = 0; i < x->count && (int)i < max; i++) {
+	if ((p = getVar(p, end, &dt)) == NULL || (p = getVar(p, end, &dv)) == NULL)
+	    return (-1);
+	lt += dt;
+	lv += unzigzag(dv);
+	t[i] = lt;
+	v[i] = lv;
+    }
+    return (i);
+}
+
+// open the column of field name for appending, continues the last segment
+int colOpenWrite(struct colWriter *w, const char *path, const char *name) {
+    char message[3 * MAXPATH], col[MAXPATH], idx[MAXPATH];
+    static uint32_t t[COLSEG / 2];
+    static int32_t v[COLSEG / 2];
+    struct stat sc, si;
+    int n;
+
+    memset(w, 0, sizeof(*w));
+    w->fdCol = w->fdIdx = -1;
+    col[0] = '\0';
+    if (colFiles(col, idx, path, name, true) < 0
+	|| (w->fdCol = open(col, O_RDWR | O_CREAT, 0644)) < 0
+	|| (w->fdIdx = open(idx, O_RDWR | O_CREAT, 0644)) < 0
+	|| fstat(w->fdCol, &sc) < 0 || fstat(w->fdIdx, &si) < 0
+	|| colHead(w->fdCol, sc.st_size) < 0 || colHead(w->fdIdx, si.st_size) < 0) {
+	sprintf(message, "%s: could not open column %s of %s, error %s", DaemonName, col, name, strerror(errno));
+	LOGERR(message);
+	colCloseWrite(w);
+	return (-1);
+    }
+
+    w->seg = (si.st_size > (off_t)sizeof(struct colHeader))
+	? (si.st_size - sizeof(struct colHeader)) / sizeof(struct colIndex) : 0;
+    if (w->seg == 0)
+	return (0);
+
+    // reload the last segment, it is continued if there is room left
+    w->seg--;
+    if (pread(w->fdIdx, &w->cur, sizeof(w->cur), IDXOFF(w->seg)) != sizeof(w->cur)
+	|| w->cur.used > COLSEG
+	|| pread(w->fdCol, w->buf, w->cur.used, COLOFF(w->seg)) != (ssize_t)w->cur.used
+	|| (n = colDecodeBuf(w->buf, &w->cur, t, v, COLSEG / 2)) != (int)w->cur.count) {
+	sprintf(message, "%s: column %s: last segment %u is damaged, starting a new one",
+		DaemonName, col, w->seg);
+	LOGERR(message);
+	memset(&w->cur, 0, sizeof(w->cur));
+	w->seg++;
+	return (0);
+    }
+    if (n > 0) {
+	w->lastT = t[n - 1];
+	w->lastV = v[n - 1];
+    }
+    if (w->cur.used + 2 * VARMAX > COLSEG) {
+	w->seg++;
+	memset(&w->cur, 0, sizeof(w->cur));
+    }
+    return (0);
+}
+
+// append a sample, one older than the last is dropped: the index and the
+// queries need the samples of a column in time order
+int colAppend(struct colWriter *w, uint32_t t, int32_t v) {
+    char message[MAXPATH];
+    uint32_t baseT = 0;
+    int32_t baseV = 0;
+    uint8_t *p;
+
+    if (w->fdCol < 0)
+	return (-1);
+    if (t < w->lastT) {
+	if (w->dropped++ == 0) {
+	    sprintf(message, "%s: column segment %u: dropping samples older than %u",
+		    DaemonName, w->seg, w->lastT);
+	    LOGERR(message);
+	}
+	return (0);
+    }
+    if (w->cur.used + 2 * VARMAX > COLSEG) {
+	// segment full, make it durable and start the next one
+	if (colSync(&w, 1) < 0)
+	    return (-1);
+	w->seg++;
+	memset(&w->cur, 0, sizeof(w->cur));
+    }
+    if (w->cur.count == 0) {
+	w->cur.tFirst = t;
+	w->cur.vFirst = v;
+	w->cur.vMin = v;
+	w->cur.vMax = v;
+    }
+    else {
+	// deltas to the previous sample of the segment
+	baseT = w->lastT;
+	baseV = w->lastV;
+    }
+
+    p = w->buf + w->cur.used;
+    p = putVar(p, t - baseT);
+    p = putVar(p, zigzag((int32_t)((uint32_t)v - (uint32_t)baseV)));
+    w->cur.used = p - w->buf;
+    w->cur.count++;
+    w->cur.tLast = t;
+    w->cur.vLast = v;
+    w->cur.sum += v;
+    if (v < w->cur.vMin)
+	w->cur.vMin = v;
+    if (v > w->cur.vMax)
+	w->cur.vMax = v;
+    w->lastT = t;
+    w->lastV = v;
+    w->dirty = true;
+    return (0);
+}
+
+// flush after writing to n columns, fd is one of them: with one that is
+// its file, with more all columns are on one file system and syncfs()
+// flushes them at once
+static int colFlush(int fd, int n) {
+    return (n > 1 ? syncfs(fd) : fdatasync(fd));
+}
+
+// group commit of n columns: the open segments of all of them, one flush,
+// then their index entries and another flush. So a commit costs two flushes
+// however many columns changed. A column that fails is logged and stays
+// dirty for the next commit.
+int colSync(struct colWriter **w, int n) {
+    char message[MAXPATH];
+    int i, nData = 0, nIdx = 0, fd = -1, result = 0, flushed;
+
+    for (i = 0; i < n; i++) {
+	if (w[i]->dirty != true || w[i]->fdCol < 0)
+	    continue;
+	if (pwrite(w[i]->fdCol, w[i]->buf, w[i]->cur.used, COLOFF(w[i]->seg)) != (ssize_t)w[i]->cur.used) {
+	    sprintf(message, "%s: could not write column segment %u, error %s", DaemonName, w[i]->seg, strerror(errno));
+	    LOGERR(message);
+	    result = -1;
+	    continue;
+	}
+	w[i]->dirty = 2; // data written, index entry pending
+	fd = w[i]->fdCol;
+	nData++;
+    }
+    if (nData == 0)
+	return (result);
+    if (colFlush(fd, nData) < 0) {
+	sprintf(message, "%s: could not flush %d column segments, error %s", DaemonName, nData, strerror(errno));
+	LOGERR(message);
+	for (i = 0; i < n; i++)
+	    if (w[i]->dirty == 2)
+		w[i]->dirty = true;
+	return (-1);
+    }
+
+    for (i = 0; i < n; i++) {
+	if (w[i]->dirty != 2)
+	    continue;
+	w[i]->dirty = true;
+	if (pwrite(w[i]->fdIdx, &w[i]->cur, sizeof(w[i]->cur), IDXOFF(w[i]->seg)) != sizeof(w[i]->cur)) {
+	    sprintf(message, "%s: could not write column index %u, error %s", DaemonName, w[i]->seg, strerror(errno));
+	    LOGERR(message);
+	    result = -1;
+	    continue;
+	}
+	w[i]->dirty = 3; // index entry written
+	fd = w[i]->fdIdx;
+	nIdx++;
+    }
+    if (nIdx == 0)
+	return (result);
+    if ((flushed = colFlush(fd, nIdx)) < 0) {
+	sprintf(message, "%s: could not flush %d column indexes, error %s", DaemonName, nIdx, strerror(errno));
+	LOGERR(message);
+	result = -1;
+    }
+    for (i = 0; i < n; i++)
+	if (w[i]->dirty == 3)
+	    w[i]->dirty = (flushed < 0);
+    return (result);
+}
+
+void colCloseWrite(struct colWriter *w) {
+    char message[MAXPATH];
+
+    colSync(&w, 1);
+    if (w->dropped > 0) {
+	sprintf(message, "%s: column closed, %u samples out of time order dropped", DaemonName, w->dropped);
+	LOGIT(message);
+    }
+    if (w->fdCol >= 0)
+	close(w->fdCol);
+    if (w->fdIdx >= 0)
+	close(w->fdIdx);
+    w->fdCol = w->fdIdx = -1;
+}
+
+// map the column of field name, returns -1 if there is none
+int colOpenRead(struct colReader *r, const char *path, const char *name) {
+    char col[MAXPATH], idx[MAXPATH];
+    struct stat st;
+    int fd;
+    void *map;
+
+    memset(r, 0, sizeof(*r));
+    if (colFiles(col, idx, path, name, false) < 0 || (fd = open(idx, O_RDONLY)) < 0)
+	return (-1);
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)(sizeof(struct colHeader) + sizeof(struct colIndex))) {
+	close(fd);
+	return (-1);
+    }
+    r->nSeg = (st.st_size - sizeof(struct colHeader)) / sizeof(struct colIndex);
+    r->idxSize = sizeof(struct colHeader) + r->nSeg * sizeof(struct colIndex);
+    map = mmap(NULL, r->idxSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+	return (-1);
+    r->idxMap = map;
+    if (!colValid(map)) {
+	colCloseRead(r);
+	errno = EPROTO;
+	return (-1);
+    }
+    r->idx = (const void *)((const uint8_t *)map + sizeof(struct colHeader));
+
+    if ((fd = open(col, O_RDONLY)) < 0 || fstat(fd, &st) < 0
+	|| st.st_size <= (off_t)sizeof(struct colHeader)) {
+	if (fd >= 0)
+	    close(fd);
+	colCloseRead(r);
+	return (-1);
+    }
+    r->colSize = st.st_size;
+    map = mmap(NULL, r->colSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+	colCloseRead(r);
+	return (-1);
+    }
+    r->colMap = map;
+    if (!colValid(map)) {
+	colCloseRead(r);
+	errno = EPROTO;
+	return (-1);
+    }
+    r->col = (const uint8_t *)map + sizeof(struct colHeader);
+    // the kernel should read ahead only what we touch
+    madvise(map, r->colSize, MADV_RANDOM);
+    return (0);
+}
+
+void colCloseRead(struct colReader *r) {
+    if (r->idxMap != NULL)
+	munmap(r->idxMap, r->idxSize);
+    if (r->colMap != NULL)
+	munmap(r->colMap, r->colSize);
+    memset(r, 0, sizeof(*r));
+}
+
+// first segment that may hold samples at or after t (binary search)
+uint32_t colFind(const struct colReader *r, uint32_t t) {
+    uint32_t lo = 0, hi = r->nSeg, mid;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (r->idx[mid].tLast < t)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return (lo);
+}
+
+// decode segment seg into t[] and v[] (COLSEG / 2 entries are always
+// enough), returns the number of samples or -1
+int colDecode(const struct colReader *r, uint32_t seg, uint32_t *t, int32_t *v, int max) {
+    if (seg >= r->nSeg || r->idx[seg].used > COLSEG
+	|| (size_t)seg * COLSEG + r->idx[seg].used > r->colSize - sizeof(struct colHeader))
+	return (-1);
+    return (colDecodeBuf(r->col + (size_t)seg * COLSEG, &r->idx[seg], t, v, max));
+}
@@ -0,0 +1,82 @@
+// col.h - columnar history store, one column per field (see col.c), queries
+//
+// $Id$
+
+#define COLSEG 4096        // segment size in <name>.col
+#define COLDIR "hist"      // subdirectory of datapath
+#define COLMAGIC 0x434f4c31 // "COL1"
+#define COLVERSION 1       // bump when the encoding or struct colIndex changes
+
+// first bytes of <name>.col and <name>.idx, host byte order
+struct colHeader {
+    uint32_t magic;    // COLMAGIC
+    uint32_t version;  // COLVERSION
+    uint32_t segSize;  // COLSEG
+    uint32_t entrySize; // sizeof(struct colIndex)
+};
+
+// one entry per segment in <name>.idx behind the header, host byte order
+struct colIndex {
+    uint32_t tFirst;   // time of first and last sample, s since epoch
+    uint32_t tLast;
+    int32_t vMin;
+    int32_t vMax;
+    int32_t vFirst;
+    int32_t vLast;
+    uint32_t count;    // samples in segment
+    uint32_t used;     // bytes used in segment
+    int64_t sum;       // sum of values, for averages without decoding
+};
+
+struct colWriter {
+    int fdCol;
+    int fdIdx;
+    uint32_t seg;      // number of the open segment
+    uint32_t lastT;
+    int32_t lastV;
+    uint32_t dropped;  // samples older than the last one, not stored
+    int dirty;         // segment changed since colSync() (2, 3: within it)
+    struct colIndex cur;
+    uint8_t buf[COLSEG];
+};
+
+struct colReader {
+    const struct colIndex *idx; // behind the headers of the mappings
+    uint32_t nSeg;
+    const uint8_t *col;
+    void *idxMap;
+    void *colMap;
+    size_t idxSize;
+    size_t colSize;
+};
+
+int colOpenWrite(struct colWriter *w, const char *path, const char *name);
+int colAppend(struct colWriter *w, uint32_t t, int32_t v);
+int colSync(struct colWriter **w, int n);
+void colCloseWrite(struct colWriter *w);
+
+int colOpenRead(struct colReader *r, const char *path, const char *name);
+void colCloseRead(struct colReader *r);
+uint32_t colFind(const struct colReader *r, uint32_t t);
+int colDecode(const struct colReader *r, uint32_t seg, uint32_t *t, int32_t *v, int max);
+
+// result of a query for one time bucket, values are raw (see field scale)
+struct queryBucket {
+    uint32_t start;    // s since epoch
+    uint32_t count;
+    int32_t min;
+    int32_t max;
+    int32_t first;
+    int32_t last;
+    int32_t delta;     // last minus last value before the bucket, for counters
+    int64_t sum;
+};
+
+struct queryStats {
+    uint32_t segments;  // segments in the column
+    uint32_t indexed;   // segments answered from the index
+    uint32_t decoded;   // segments decoded
+};
+
+int queryRun(const char *path, const char *name, uint32_t from, uint32_t to, uint32_t step,
+	     struct queryBucket *b, int nb, struct queryStats *st);
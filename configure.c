@@ -2,8 +2,10 @@
 //
 // $Id: configure.c 154 2020-04-06 15:51:50Z juh $
 
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>     // for strcasecmp()
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>    // for mode constants
@@ -13,6 +15,7 @@
 #include <sys/shm.h>     // for shmat()
 #include <sys/prctl.h>   // for prctl()
 #include <stdlib.h>      // for exit()
+#include <stddef.h>      // for offsetof()
 #include <errno.h>       // for errno
 #include <unistd.h>      // for sleep()
 #ifdef USEPIG
@@ -20,6 +23,9 @@
 #endif
 #include <signal.h>
 #include <sys/ipc.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <pthread.h>
 
 #include <syslog.h>      // syslog messages
 #include <stdbool.h>     // to have definitions of true and false
@@ -28,216 +34,708 @@
 
 #include "ems.h"
 
-int getConfig(enum varType varType, void *var, char *defVal, char *cFile, char *group, char *key);
-char *readKeyVal(char *cFile, char *group, char *key);
-int readKeyInt(char *cFile, char *group, char *key);
-float readKeyFloat(char *cFile, char *group, char *key);
-
-int getConfig(enum varType varType, void *var, char *defVal, char *cFile, char *group, char *key) {
-    char *result = NULL;
-    int iResult, *i, j;
-    float fResult, *f;
-    int useDefault = false;
-
-    switch (varType)
-    {
-    case CHAR:
-	result = readKeyVal(cFile, group, key);
-	if (result == NULL) {
-	    strcpy((char *) var, defVal);
-	    useDefault = true;
-	}
-	else {
-	    strcpy((char *) var, result);
-	    useDefault = false;
+// The config file is parsed once by cfgLoad() into a hash table of
+// (group, key) -> value, all strings in one block. The values of the keys
+// in Schema[] are then checked and converted into the struct conf of the
+// index, Conf points to it. cfgGet() looks up the other keys (per field
+// keys of [TOPICS] and [DEADBAND]) by hashing the names, no file access and
+// no allocation.
+//
+// Hot reload: cfgWatch() starts a thread that waits for the file to be
+// written (inotify on its directory, editors replace the file) or for
+// SIGUSR2, parses it off the hot path and swaps the index pointer. Readers
+// only load that pointer; a replaced index is freed CFGKEEP reloads later,
+// so a lookup running during a swap still reads valid memory. The daemons
+// poll cfgReloaded() once per cycle with their own struct cfgApplied and
+// apply the keys of reload class live that cfgChanged() reports between
+// the index they applied last and the current one, changes of the others
+// are logged as needing a restart. The two indexes a daemon holds are
+// pinned and freed only when it lets go of them.
+
+struct cfgEntry {
+    uint32_t hash;      // 0: empty slot
+    const char *group;
+    const char *key;
+    const char *val;
+};
+
+struct cfgIndex {
+    char file[MAXPATH];
+    uint32_t size;      // slots, a power of 2
+    uint32_t n;         // keys
+    struct cfgEntry *tab;
+    char *strings;
+    uint32_t gen;       // reloads before this one
+    int pins;           // held by a struct cfgApplied, under CfgLock
+    int retired;        // replaced, freed with the last pin
+    struct conf conf;   // the keys of Schema[], checked
+};
+
+// the schema of the config file: type, default and range of every key and
+// whether a change applies while running (CR_LIVE) or after a restart
+enum cfgType {
+    CT_STRING = 0,
+    CT_INT,
+    CT_BOOL,            // 0/1, no/yes, off/on, false/true
+    CT_FLOAT,
+    CT_CHOICE,          // one of str, "a|b|c", its position from 1
+    CT_ANY,             // key NULL: the other keys of group, see cfgGet()
+    CT_UNUSED           // accepted but not read by any daemon
+};
+
+enum cfgReload { CR_RESTART = 0, CR_LIVE };
+
+struct cfgSchema {
+    const char *group;
+    const char *key;
+    enum cfgType type;
+    size_t off;         // of the value in struct conf
+    size_t size;
+    const char *str;    // default of CT_STRING, choices of CT_CHOICE
+    double def;         // default of the numbers
+    double min;
+    double max;
+    enum cfgReload reload;
+};
+
+#define CFGAT(M) offsetof(struct conf, M), sizeof(((struct conf *)0)->M)
+#define CFGSTR(G, K, M, DEF, R) { G, K, CT_STRING, CFGAT(M), DEF, 0, 0, 0, R }
+#define CFGINT(G, K, M, DEF, MIN, MAX, R) { G, K, CT_INT, CFGAT(M), NULL, DEF, MIN, MAX, R }
+#define CFGBOOL(G, K, M, DEF, R) { G, K, CT_BOOL, CFGAT(M), NULL, DEF, 0, 1, R }
+#define CFGFLOAT(G, K, M, DEF, MIN, MAX, R) { G, K, CT_FLOAT, CFGAT(M), NULL, DEF, MIN, MAX, R }
+#define CFGCHOICE(G, K, M, LIST, DEF, R) { G, K, CT_CHOICE, CFGAT(M), LIST, DEF, 0, 0, R }
+#define CFGANY(G, R) { G, NULL, CT_ANY, 0, 0, NULL, 0, 0, 0, R }
+#define CFGUNUSED(G, K) { G, K, CT_UNUSED, 0, 0, NULL, 0, 0, 0, CR_LIVE }
+#define DAY 86400000    // ms
+
+static const struct cfgSchema Schema[] = {
+    CFGBOOL("EMS", "debug", ems.debug, 0, CR_LIVE),
+    CFGSTR("EMS", "broker", ems.broker, BROKER, CR_LIVE),
+    CFGINT("EMS", "port", ems.port, 1883, 1, 65535, CR_LIVE),
+    CFGSTR("EMS", "cert", ems.cert, "", CR_RESTART),
+    CFGCHOICE("EMS", "mqttmode", ems.mqttmode, "topics|json|both", MQTT_TOPICS, CR_RESTART),
+    CFGSTR("EMS", "topicprefix", ems.topicprefix, "ems", CR_RESTART),
+    CFGSTR("EMS", "jsontopic", ems.jsontopic, "", CR_RESTART),
+    CFGINT("EMS", "spoolsize", ems.spoolsize, 4096, 0, 1048576, CR_RESTART),
+    CFGINT("EMS", "spoolrate", ems.spoolrate, 200, 1, 100000, CR_LIVE),
+    CFGSTR("EMS", "datapath", ems.datapath, DATAPATH, CR_RESTART),
+    CFGBOOL("EMS", "commands", ems.commands, 0, CR_RESTART),
+    CFGSTR("EMS", "cmddest", ems.cmddest, "0x08,0x10", CR_RESTART),
+    CFGFLOAT("EMS", "cmdrate", ems.cmdrate, 2, 0.001, 1000, CR_RESTART),
+    CFGFLOAT("EMS", "cmdburst", ems.cmdburst, 5, 1, 1000, CR_RESTART),
+    CFGINT("EMS", "period", ems.period, 1000, 10, DAY, CR_LIVE),
+    CFGINT("EMS", "phase", ems.phase, 0, -1, DAY, CR_LIVE),
+    CFGCHOICE("EMS", "mqttversion", ems.mqttversion, "5|311", MQTT_V5, CR_RESTART),
+    CFGINT("EMS", "reconnectmin", ems.reconnectmin, 1, 1, 3600, CR_RESTART),
+    CFGINT("EMS", "reconnectmax", ems.reconnectmax, 120, 1, 86400, CR_RESTART),
+    CFGSTR("EMS", "emstty", ems.emstty, EMSTTY, CR_RESTART),
+    CFGSTR("EMS", "rxqueue", ems.rxqueue, RX_QUEUE_NAME, CR_RESTART),
+    CFGSTR("EMS", "txqueue", ems.txqueue, TX_QUEUE_NAME, CR_RESTART),
+    CFGUNUSED("EMS", "interval"),
+    CFGUNUSED("EMS", "client_id"),
+
+    CFGINT("TOPICS", "qos", topics.qos, 1, 0, 2, CR_RESTART),
+    CFGINT("TOPICS", "expiry", topics.expiry, 0, 0, INT32_MAX, CR_RESTART),
+    CFGANY("TOPICS", CR_RESTART),
+
+    CFGINT("DEADBAND", "silence", deadband.silence, 300, 1, INT32_MAX, CR_LIVE),
+    CFGANY("DEADBAND", CR_LIVE),
+
+    CFGSTR("V4K", "url", v4k.url, "192.168.17.1", CR_RESTART),
+    CFGSTR("V4K", "port", v4k.port, "", CR_RESTART),
+    CFGSTR("V4K", "cert", v4k.cert, "", CR_RESTART),
+    CFGSTR("V4K", "uuid", v4k.uuid, UUID, CR_RESTART),
+    CFGSTR("V4K", "token", v4k.token, TOKEN, CR_RESTART),
+    CFGSTR("V4K", "class", v4k.class, CLASS, CR_RESTART),
+    CFGSTR("V4K", "name", v4k.name, NAME, CR_RESTART),
+    CFGSTR("V4K", "description", v4k.description, "n.n.", CR_RESTART),
+    CFGINT("V4K", "interval", v4k.interval, 1000000, 1000, INT32_MAX, CR_LIVE),
+    CFGINT("V4K", "phase", v4k.phase, 0, -1, INT32_MAX, CR_LIVE),
+    CFGINT("V4K", "batch", v4k.batch, 1, 1, 256, CR_RESTART),
+    CFGINT("V4K", "batchtime", v4k.batchtime, 10000, 1, DAY, CR_RESTART),
+    CFGUNUSED("V4K", "secret"),
+
+    CFGSTR("PUB", "sinks", pub.sinks, "mqtt", CR_RESTART),
+    CFGSTR("PUB", "file", pub.file, "", CR_RESTART),
+    CFGINT("PUB", "period", pub.period, 1000, 10, DAY, CR_LIVE),
+    CFGINT("PUB", "phase", pub.phase, 0, -1, DAY, CR_LIVE),
+
+    CFGINT("DB", "commit", db.commit, 30, 1, 86400, CR_LIVE),
+    CFGBOOL("DB", "telegrams", db.telegrams, 1, CR_LIVE),
+    CFGBOOL("DB", "columns", db.columns, 1, CR_RESTART),
+
+    CFGSTR("INFLUX", "url", influx.url, "udp://127.0.0.1:8089", CR_RESTART),
+    CFGSTR("INFLUX", "measurement", influx.measurement, "ems", CR_RESTART),
+    CFGSTR("INFLUX", "token", influx.token, "", CR_RESTART),
+    CFGINT("INFLUX", "batchsize", influx.batchsize, 0, 0, 16777216, CR_RESTART),
+    CFGINT("INFLUX", "batchage", influx.batchage, 5000, 0, DAY, CR_RESTART),
+    CFGINT("INFLUX", "retrykb", influx.retrykb, 1024, 1, 1048576, CR_RESTART),
+
+    CFGUNUSED("HARDWARE", NULL),        // emsSerio reads [EMS] emstty
+};
+
+#define NSCHEMA (sizeof(Schema) / sizeof(Schema[0]))
+
+#define CFGKEEP 4
+#define CFGSETTLE 200   // ms to let an editor finish writing
+
+static struct cfgIndex *Cfg = NULL;
+static struct cfgIndex *Loaded = NULL;          // of cfgLoad(), pinned until the first cfgReloaded()
+static struct cfgIndex *Retired[CFGKEEP];        // to be freed
+static pthread_mutex_t CfgLock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t NRetired = 0;
+static uint32_t Generation = 0;                 // reloads so far
+static int WakeFd[2] = { -1, -1 };              // SIGUSR2 -> watcher
+static volatile sig_atomic_t Pending = 0;       // SIGUSR2 before cfgWatch()
+static int WatchFd = -1;
+static char Base[MAXPATH];                      // name of the file in its directory
+
+static uint32_t cfgHash(const char *group, const char *key) {
+    uint32_t h = 2166136261u;
+
+    while (*group)
+	h = (h ^ (unsigned char)*group++) * 16777619u;
+    h = (h ^ '[') * 16777619u;
+    while (*key)
+	h = (h ^ (unsigned char)*key++) * 16777619u;
+    return (h ? h : 1);
+}
+
+static struct cfgEntry *cfgSlot(const struct cfgIndex *c, uint32_t h, const char *group, const char *key) {
+    struct cfgEntry *e;
+    uint32_t i;
+
+    for (i = h & (c->size - 1);; i = (i + 1) & (c->size - 1)) {
+	e = &c->tab[i];
+	if (e->hash == 0 || (e->hash == h && strcmp(e->key, key) == 0 && strcmp(e->group, group) == 0))
+	    return (e);
+    }
+}
+
+static char *cfgCopy(char **p, const char *s) {
+    char *r = *p;
+    size_t len = strlen(s) + 1;
+
+    memcpy(r, s, len);
+    *p += len;
+    return (r);
+}
+
+// walk the key=value pairs of the parsed file, with c == NULL only count
+// them and the bytes of their strings
+static void cfgWalk(struct parsefile *file, struct cfgIndex *c, uint32_t *n, size_t *bytes) {
+    struct entry *g, *l, *v;
+    struct cfgEntry *e;
+    char *p = c ? c->strings : NULL;
+    const char *group;
+    uint32_t h;
+
+    for (g = file->root; g; g = g->next) {
+	group = NULL;
+	for (l = g->sub; l; l = l->next) {
+	    for (v = l->sub; v; v = v->next) {
+		if (v->sub == NULL || type(v) != ENTRY_KEY || type(v->sub) != ENTRY_VALUE)
+		    continue;
+		if (c == NULL) {
+		    (*n)++;
+		    *bytes += strlen(name(g)) + strlen(name(v)) + strlen(name(v->sub)) + 3;
+		    continue;
+		}
+		// the first one wins, as with the former linear search
+		h = cfgHash(name(g), name(v));
+		e = cfgSlot(c, h, name(g), name(v));
+		if (e->hash != 0)
+		    continue;
+		if (group == NULL)
+		    group = cfgCopy(&p, name(g));
+		e->hash = h;
+		e->group = group;
+		e->key = cfgCopy(&p, name(v));
+		e->val = cfgCopy(&p, name(v->sub));
+		c->n++;
+	    }
 	}
+    }
+}
+
+static void cfgFree(struct cfgIndex *c) {
+    if (c == NULL)
+	return;
+    free(c->tab);
+    free(c->strings);
+    free(c);
+}
+
+// parse cFile into a new index, NULL if it can not be read; with empty
+// an unreadable file gives an index without keys
+static struct cfgIndex *cfgParse(const char *cFile, int empty) {
+    struct parsefile *file;
+    struct cfgIndex *c;
+    uint32_t n = 0;
+    size_t bytes = 0;
+
+    // read-only: one read, tokens in place, one arena for all entries
+    if ((file = parsemap(cFile)) == NULL && !empty)
+	return (NULL);
+    if (file != NULL)
+	cfgWalk(file, NULL, &n, &bytes);
+    if ((c = calloc(1, sizeof(*c))) == NULL) {
+	if (file != NULL)
+	    parseclose(file);
+	return (NULL);
+    }
+    snprintf(c->file, sizeof(c->file), "%s", cFile);
+    for (c->size = 16; c->size < 2 * n; c->size *= 2)
+	;
+    c->tab = calloc(c->size, sizeof(*c->tab));
+    c->strings = malloc(bytes + 1);
+    if (c->tab == NULL || c->strings == NULL) {
+	cfgFree(c);
+	if (file != NULL)
+	    parseclose(file);
+	return (NULL);
+    }
+    if (file != NULL) {
+	cfgWalk(file, c, &n, &bytes);
+	parseclose(file);
+    }
+    return (c);
+}
+
+// value of key in group of index c, NULL if not set
+static const char *cfgIn(const struct cfgIndex *c, const char *group, const char *key) {
+    struct cfgEntry *e;
+
+    if (c == NULL)
+	return (NULL);
+    e = cfgSlot(c, cfgHash(group, key), group, key);
+    return (e->hash ? e->val : NULL);
+}
+
+// schema of key in group, the CT_ANY or group wide CT_UNUSED entry of
+// group if key is not listed, NULL for an unknown key
+static const struct cfgSchema *cfgSchemaOf(const char *group, const char *key) {
+    const struct cfgSchema *s, *any = NULL;
+
+    for (s = Schema; s < Schema + NSCHEMA; s++) {
+	if (strcmp(s->group, group) != 0)
+	    continue;
+	if (s->key == NULL)
+	    any = s;
+	else if (strcmp(s->key, key) == 0)
+	    return (s);
+    }
+    return (any);
+}
+
+// the number in v, NULL or why it is not valid for s
+static const char *cfgNumber(const struct cfgSchema *s, const char *v, double *d) {
+    static const char *no[] = { "0", "no", "off", "false" }, *yes[] = { "1", "yes", "on", "true" };
+    const char *p;
+    char *end;
+    size_t len;
+    int i;
+
+    switch (s->type) {
+    case CT_INT:
+	*d = strtol(v, &end, 0);
+	if (end == v || *end != '\0')
+	    return ("is not an integer");
 	break;
-	    
-    case INT:
-	i = var;
-	iResult = readKeyInt(cFile, group, key);
-	if (iResult == -1) {
-	    iResult = atoi(defVal);
-	    *i = iResult;
-	    useDefault = true;
-	}
-	else {
-	    *i = iResult;
-	    useDefault = false;
-	}
+
+    case CT_FLOAT:
+	*d = strtod(v, &end);
+	if (end == v || *end != '\0')
+	    return ("is not a number");
 	break;
 
-    case FLOAT:
-	f = var;
-	fResult = readKeyFloat(cFile, group, key);
-	if (fResult == -1.0) {
-	    fResult = atof(defVal);
-	    *f = fResult;
-	    useDefault = true;
-	}
-	else {
-	    *f = fResult;
-	    useDefault = false;
+    case CT_BOOL:
+	for (i = 0; i < 4; i++)
+	    if (strcasecmp(v, no[i]) == 0 || strcasecmp(v, yes[i]) == 0) {
+		*d = (strcasecmp(v, yes[i]) == 0);
+		return (NULL);
+	    }
+	return ("is not one of 0, 1, no, yes, off, on, false, true");
+
+    case CT_CHOICE:
+	len = strlen(v);
+	for (p = s->str, i = 1; p != NULL; i++) {
+	    if (strncmp(p, v, len) == 0 && (p[len] == '|' || p[len] == '\0')) {
+		*d = i;
+		return (NULL);
+	    }
+	    if ((p = strchr(p, '|')) != NULL)
+		p++;
 	}
-	break;
+	return ("is not one of the choices");
 
     default:
-	useDefault = true;
-	break;
+	return ("has no number");
     }
+    if (*d < s->min || *d > s->max)
+	return ("is out of range");
+    return (NULL);
+}
 
-    return (useDefault);
+// set the value of s in conf from v, the default if v is NULL; NULL or why
+// v is not valid
+static const char *cfgValue(const struct cfgSchema *s, const char *v, struct conf *conf) {
+    char *p = (char *)conf + s->off;
+    const char *err = NULL;
+    double d = s->def;
+
+    if (s->type == CT_STRING) {
+	if (v == NULL)
+	    v = s->str;
+	if (strlen(v) >= s->size)
+	    return ("is too long");
+	strcpy(p, v);
+	return (NULL);
+    }
+    if (v != NULL && (err = cfgNumber(s, v, &d)) != NULL)
+	d = s->def;
+    if (s->type == CT_FLOAT)
+	*(double *)p = d;
+    else
+	*(int *)p = (int)d;
+    return (err);
 }
-	    
 
-char Result[1000];
+// check all keys of c against the schema and fill c->conf, returns the
+// number of invalid values; unknown keys are logged, they may be typos
+static int cfgCheck(struct cfgIndex *c) {
+    char message[4 * MAXPATH], range[64];
+    const struct cfgSchema *s;
+    const struct cfgEntry *e;
+    const char *v, *err;
+    int errors = 0;
+    uint32_t i;
 
-char *readKeyVal(char *cFile, char *group, char *key) {
-    char *val;
-    struct parsefile *file;
-    struct entry *g;
-
-    /* pass 2nd argument as 0 to parseopen to prevent automatic 
-       processing of the entries in the configuration file. */
-    file = parseopen(cFile, 0, 0);
-    if (file == NULL)
-	return(NULL);
-    
-    g = file->root;
-    // parse groups
-    while (g) {
-	struct entry *l;
-	    
-	l = g->sub;
-
-	// lines in group
-	while (l) {
-	    struct entry *v;
-		
-	    v = l->sub;
-
-	    // objects in line
-	    while (v) {
-		struct entry *kv;
-
-		kv = v->sub;
-		if (kv) {
-		    if ((strcmp(group, name(g)) == 0) && (strcmp(key, name(v)) == 0)
-			&& type(v) == 2 && type(kv) == 3) {
-			strcpy(Result, name(kv));
-			printf("readKeyVal: read key %s from group %s as >%s<\n", key, group, Result);
-			parseclose(file);
-			return (Result);
-		    }
-		}
-		v = v->next;
-	    }
-	    l = l->next;
+    for (s = Schema; s < Schema + NSCHEMA; s++) {
+	if (s->key == NULL || s->type == CT_UNUSED)
+	    continue;
+	v = cfgIn(c, s->group, s->key);
+	if ((err = cfgValue(s, v, &c->conf)) == NULL)
+	    continue;
+	if (s->type == CT_CHOICE)
+	    snprintf(range, sizeof(range), ", use %s", s->str);
+	else if (s->type == CT_INT || s->type == CT_FLOAT)
+	    snprintf(range, sizeof(range), ", %g .. %g", s->min, s->max);
+	else if (s->type == CT_STRING)
+	    snprintf(range, sizeof(range), ", at most %zu characters", s->size - 1);
+	else
+	    range[0] = '\0';
+	snprintf(message, sizeof(message), "%s: %s: [%s] %s = >%s< %s%s", DaemonName, c->file,
+		 s->group, s->key, v ? v : "(default)", err, range);
+	LOGERR(message);
+	errors++;
+    }
+    for (i = 0; i < c->size; i++) {
+	e = &c->tab[i];
+	if (e->hash && cfgSchemaOf(e->group, e->key) == NULL) {
+	    snprintf(message, sizeof(message), "%s: %s: [%s] %s is not a known key, ignored", DaemonName,
+		     c->file, e->group, e->key);
+	    LOGIT(message);
 	}
-	g = g->next;
     }
-    
-    parseclose(file);
-    return (NULL);
+    return (errors);
 }
 
-int readKeyInt(char *cFile, char *group, char *key) {
-    int val, res;
+// drop a pin of c, under CfgLock
+static void cfgUnpin(struct cfgIndex *c) {
+    if (c != NULL && --c->pins == 0 && c->retired)
+	cfgFree(c);
+}
 
-    struct parsefile *file;
-    struct entry *g;
-
-    /* pass 2nd argument as 0 to parseopen to prevent automatic 
-       processing of the entries in the configuration file. */
-    file = parseopen(cFile, 0, 0);
-    if (file == NULL)
-	return(-1);
-    
-    g = file->root;
-    // parse groups
-    while (g) {
-	struct entry *l;
-	    
-	l = g->sub;
-
-	// lines in group
-	while (l) {
-	    struct entry *v;
-		
-	    v = l->sub;
-
-	    // objects in line
-	    while (v) {
-		struct entry *kv;
-
-		kv = v->sub;
-		if (kv) {
-		    if ((strcmp(group, name(g)) == 0) && (strcmp(key, name(v)) == 0)
-			&& type(v) == 2 && type(kv) == 3) {
-			// try to be clever about hex values
-			res = sscanf(name(kv), "%i", &val);
-			printf("readKeyInt: read key %s from group %s as >%s<, val %d, sscanf res = %d\n",
-			       key, group, name(kv), val, res);
-			    
-			return (val);
-		    }
-		}
-		v = v->next;
-	    }
-	    l = l->next;
+// make c the current index, readers see either the old or the new one.
+// The old one is freed CFGKEEP swaps later, or after that when the last
+// daemon that applied it lets go of it.
+static void cfgSwap(struct cfgIndex *c) {
+    struct cfgIndex *old;
+
+    pthread_mutex_lock(&CfgLock);
+    if ((old = Retired[NRetired % CFGKEEP]) != NULL) {
+	old->retired = true;
+	if (old->pins == 0)
+	    cfgFree(old);
+    }
+    Retired[NRetired++ % CFGKEEP] = Cfg;
+    __atomic_store_n(&Cfg, c, __ATOMIC_RELEASE);
+    __atomic_store_n(&Conf, &c->conf, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&CfgLock);
+}
+
+// SIGUSR2, installed by cfgLoad() so that it never kills a daemon; one
+// that arrives before cfgWatch() is remembered and handled by the watcher
+static void cfgSignal(int sig) {
+    char b = (char)sig;
+
+    Pending = 1;
+    if (WakeFd[1] >= 0 && write(WakeFd[1], &b, 1) < 0)
+	return;   // a reload is pending already
+}
+
+// parse and check the config file once, returns the number of keys or -1
+// if a value is invalid. A missing file gives the defaults.
+int cfgLoad(const char *cFile) {
+    char message[2 * MAXPATH];
+    struct cfgIndex *c;
+    struct timespec t0, t1;
+    int errors;
+
+    signal(SIGUSR2, cfgSignal);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (access(cFile, R_OK) < 0) {
+	sprintf(message, "%s: could not read config file %s, using the defaults", DaemonName, cFile);
+	LOGERR(message);
+    }
+    if ((c = cfgParse(cFile, true)) == NULL) {
+	sprintf(message, "%s: out of memory reading config file %s", DaemonName, cFile);
+	LOGERR(message);
+	return (-1);
+    }
+    if ((errors = cfgCheck(c)) > 0) {
+	sprintf(message, "%s: %d invalid values in config file %s", DaemonName, errors, cFile);
+	LOGERR(message);
+	cfgFree(c);
+	return (-1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    c->pins = 1;
+    cfgSwap(c);
+    pthread_mutex_lock(&CfgLock);
+    cfgUnpin(Loaded);
+    Loaded = c;
+    pthread_mutex_unlock(&CfgLock);
+    sprintf(message, "%s: %u keys of %s checked in %ld µs", DaemonName, c->n, cFile,
+	    (long)((t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000));
+    LOGIT(message);
+    return (c->n);
+}
+
+// value of key in group, NULL if not set
+const char *cfgGet(const char *group, const char *key) {
+    struct cfgIndex *c = __atomic_load_n(&Cfg, __ATOMIC_ACQUIRE);
+    struct cfgEntry *e;
+
+    if (c == NULL) {
+	if (cfgLoad(CONFIGFILE) < 0)
+	    return (NULL);
+	c = Cfg;
+    }
+    e = cfgSlot(c, cfgHash(group, key), group, key);
+    return (e->hash ? e->val : NULL);
+}
+
+// do a and b differ in key of group, with key NULL in any key of group?
+static int cfgDiffers(const struct cfgIndex *a, const struct cfgIndex *b, const char *group, const char *key) {
+    const struct cfgEntry *e;
+    const char *va, *vb;
+    uint32_t i;
+
+    if (key != NULL) {
+	va = cfgIn(a, group, key);
+	vb = cfgIn(b, group, key);
+	return (va == NULL || vb == NULL ? va != vb : strcmp(va, vb) != 0);
+    }
+    for (i = 0; a != NULL && i < a->size; i++) {
+	e = &a->tab[i];
+	if (e->hash && strcmp(e->group, group) == 0 && cfgDiffers(a, b, group, e->key))
+	    return (true);
+    }
+    for (i = 0; b != NULL && i < b->size; i++) {
+	e = &b->tab[i];
+	if (e->hash && strcmp(e->group, group) == 0 && cfgIn(a, group, e->key) == NULL)
+	    return (true);
+    }
+    return (false);
+}
+
+// did key of group (key NULL: any key of group) change between the index
+// a applied before its last cfgReloaded() and the one it applies now?
+int cfgChanged(const struct cfgApplied *a, const char *group, const char *key) {
+    return (a->prev != NULL && a->cur != NULL && cfgDiffers(a->prev, a->cur, group, key));
+}
+
+// true when the config was reloaded since the last call with a (which
+// starts zeroed): a then holds the index it applied so far and the current
+// one for cfgChanged(), however many reloads there were in between. One
+// load of a counter when nothing changed, for the loops of the daemons.
+int cfgReloaded(struct cfgApplied *a) {
+    uint32_t g = __atomic_load_n(&Generation, __ATOMIC_ACQUIRE);
+
+    if (a->cur != NULL && g == a->gen)
+	return (false);
+    pthread_mutex_lock(&CfgLock);
+    if (a->cur == NULL) {
+	// the first call: the daemon started with the settings of cfgLoad()
+	if (Loaded != NULL)
+	    a->cur = Loaded;    // its pin is ours now
+	else if ((a->cur = Cfg) != NULL)
+	    a->cur->pins++;
+	Loaded = NULL;
+    }
+    cfgUnpin(a->prev);
+    a->prev = a->cur;
+    a->cur = Cfg;
+    if (a->cur != NULL) {
+	a->cur->pins++;
+	a->gen = a->cur->gen;
+    }
+    pthread_mutex_unlock(&CfgLock);
+    return (a->prev != a->cur);
+}
+
+// does a change of key in group take effect after a restart only?
+static int cfgStartup(const char *group, const char *key) {
+    const struct cfgSchema *s = cfgSchemaOf(group, key);
+
+    return (s != NULL && s->reload == CR_RESTART);
+}
+
+static void cfgReport(const char *group, const char *key, const char *from, const char *to, int *changes, int *restart) {
+    char message[4 * MAXPATH];
+    int startup = cfgStartup(group, key);
+
+    snprintf(message, sizeof(message), "%s: [%s] %s changed from >%s< to >%s<%s", DaemonName, group, key,
+	     from ? from : "(not set)", to ? to : "(not set)", startup ? ", takes effect after a restart" : "");
+    LOGIT(message);
+    (*changes)++;
+    *restart += startup;
+}
+
+// parse the file again and swap it in if anything changed, on the watcher
+// thread
+static void cfgReload(void) {
+    char message[2 * MAXPATH];
+    struct cfgIndex *c, *old = Cfg;
+    const struct cfgEntry *e;
+    const char *v;
+    int changes = 0, restart = 0;
+    uint32_t i;
+
+    if ((c = cfgParse(old->file, false)) == NULL) {
+	sprintf(message, "%s: could not read config file %s, keeping the current settings", DaemonName, old->file);
+	LOGERR(message);
+	return;
+    }
+    if (cfgCheck(c) > 0) {
+	sprintf(message, "%s: invalid values in config file %s, keeping the current settings", DaemonName, old->file);
+	LOGERR(message);
+	cfgFree(c);
+	return;
+    }
+    for (i = 0; i < c->size; i++) {
+	e = &c->tab[i];
+	if (e->hash && ((v = cfgIn(old, e->group, e->key)) == NULL || strcmp(v, e->val) != 0))
+	    cfgReport(e->group, e->key, v, e->val, &changes, &restart);
+    }
+    for (i = 0; i < old->size; i++) {
+	e = &old->tab[i];
+	if (e->hash && cfgIn(c, e->group, e->key) == NULL)
+	    cfgReport(e->group, e->key, e->val, NULL, &changes, &restart);
+    }
+    if (changes == 0) {
+	cfgFree(c);
+	if (Debug) {
+	    sprintf(message, "%s: config file %s unchanged", DaemonName, old->file);
+	    LOGIT(message);
 	}
-	g = g->next;
+	return;
     }
-    
-    parseclose(file);
-    return (-1);
+
+    c->gen = Generation + 1;
+    cfgSwap(c);
+    // every daemon has its debug switch
+    if (c->conf.ems.debug != old->conf.ems.debug)
+	Debug = c->conf.ems.debug;
+    __atomic_add_fetch(&Generation, 1, __ATOMIC_RELEASE);
+    sprintf(message, "%s: config file %s reloaded, %d changes, %d of them need a restart", DaemonName,
+	    c->file, changes, restart);
+    LOGIT(message);
 }
 
-float readKeyFloat(char *cFile, char *group, char *key) {
-    float val;
+static void *cfgRun(void *arg) {
+    char buff[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    struct pollfd pfd[2];
+    ssize_t n;
+    char *p;
+    int hit;
 
-    struct parsefile *file;
-    struct entry *g;
-
-    /* pass 2nd argument as 0 to parseopen to prevent automatic 
-       processing of the entries in the configuration file. */
-    file = parseopen(cFile, 0, 0);
-    if (file == NULL)
-	return(-1);
-    
-    g = file->root;
-    // parse groups
-    while (g) {
-	struct entry *l;
-	    
-	l = g->sub;
-
-	// lines in group
-	while (l) {
-	    struct entry *v;
-		
-	    v = l->sub;
-
-	    // objects in line
-	    while (v) {
-		struct entry *kv;
-
-		kv = v->sub;
-		if (kv) {
-		    if ((strcmp(group, name(g)) == 0) && (strcmp(key, name(v)) == 0)
-			&& type(v) == 2 && type(kv) == 3) {
-			printf("readKeyFloat: read key %s from group %s as >%s<, val %f\n",
-			       key, group, name(kv), atof(name(kv)));
-			return (atof(name(kv)));
-		    }
-		}
-		v = v->next;
+    pfd[0].fd = WakeFd[0];
+    pfd[1].fd = WatchFd;   // -1 without inotify, ignored by poll()
+    pfd[0].events = pfd[1].events = POLLIN;
+    for (;;) {
+	if (poll(pfd, 2, -1) <= 0)
+	    continue;
+	hit = false;
+	while (read(WakeFd[0], buff, sizeof(buff)) > 0)
+	    hit = true;
+	while ((n = read(WatchFd, buff, sizeof(buff))) > 0)
+	    for (p = buff; p < buff + n; p += sizeof(*ev) + ev->len) {
+		ev = (const struct inotify_event *)p;
+		if (ev->len > 0 && strcmp(ev->name, Base) == 0)
+		    hit = true;
 	    }
-	    l = l->next;
-	}
-	g = g->next;
+	if (!hit)
+	    continue;
+	// editors write and rename in several steps, let them finish
+	nanosleep(&(struct timespec){ 0, CFGSETTLE * 1000000L }, NULL);
+	while (read(WatchFd, buff, sizeof(buff)) > 0)
+	    ;
+	cfgReload();
+    }
+    return (NULL);
+}
+
+// reload the config file when it is written or on SIGUSR2. Call after
+// fork(), the watcher is a thread.
+int cfgWatch(void) {
+    char dir[MAXPATH], message[2 * MAXPATH], *p;
+    pthread_t thread;
+    int result;
+
+    if (Cfg == NULL && cfgLoad(CONFIGFILE) < 0)
+	return (-1);
+    snprintf(dir, sizeof(dir), "%s", Cfg->file);
+    if ((p = strrchr(dir, '/')) == NULL) {
+	snprintf(Base, sizeof(Base), "%s", dir);
+	strcpy(dir, ".");
+    }
+    else {
+	snprintf(Base, sizeof(Base), "%s", p + 1);
+	*p = '\0';
+	if (dir[0] == '\0')
+	    strcpy(dir, "/");
+    }
+
+    if ((WatchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0
+	|| inotify_add_watch(WatchFd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+	sprintf(message, "%s: could not watch %s, error %s, reload with SIGUSR2 only", DaemonName, dir, strerror(errno));
+	LOGERR(message);
+	if (WatchFd >= 0)
+	    close(WatchFd);
+	WatchFd = -1;
+    }
+    if (pipe(WakeFd) < 0) {
+	sprintf(message, "%s: could not create pipe, error %s", DaemonName, strerror(errno));
+	LOGERR(message);
+	return (-1);
+    }
+    fcntl(WakeFd[0], F_SETFL, O_NONBLOCK);
+    fcntl(WakeFd[1], F_SETFL, O_NONBLOCK);
+    if ((result = pthread_create(&thread, NULL, cfgRun, NULL)) != 0) {
+	sprintf(message, "%s: could not start config watcher, %s", DaemonName, strerror(result));
+	LOGERR(message);
+	return (-1);
+    }
+    pthread_detach(thread);
+    if (Pending && write(WakeFd[1], "", 1) < 0) {
+	sprintf(message, "%s: could not wake config watcher, error %s", DaemonName, strerror(errno));
+	LOGERR(message);
     }
-    
-    parseclose(file);
-    return (-1.0);
+    sprintf(message, "%s: watching %s, SIGUSR2 reloads it, too", DaemonName, Cfg->file);
+    LOGIT(message);
+    return (0);
 }
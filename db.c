@@ -0,0 +1,293 @@
+//
+// db.c - append-only value and telegram log with group commit, used by emsDb
+//
+// $Id$
+//
+// One file per day, <datapath>/ems-YYYYMMDD.db. After an 8 byte file header
+// ("EMSDB1\n\0") the file is a sequence of records: type (1 byte), length of
+// the payload (1 byte), payload. Numbers are little endian.
+//
+//   'F' field:    id (u16), type (u8), scale (i8), name (rest)
+//   'V' value:    time in s (u32), id (u16), value (i32)
+//   'T' telegram: stamp in ns (i64), telegram bytes (rest)
+//
+// Every file starts with the field records of the registry, so it can be read
+// without the shared memory. Records are collected in a buffer and written
+// with a single write() and fdatasync() per commit. A record cut off by a
+// crash is removed when the file is opened again.
+
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ems.h"
+
+#define DBMAGIC "EMSDB1\n"
+#define DBHEADER 8
+#define DBBUF 65536
+
+#define DB_FIELD 'F'
+#define DB_VALUE 'V'
+#define DB_TELEGRAM 'T'
+
+static uint8_t DbBuf[DBBUF];
+static size_t DbLen = 0;       // bytes in DbBuf
+static off_t DbSize = 0;       // committed size of the file
+static int DbFd = -1;
+static char DbName[MAXPATH];
+
+// last value and time per field and last telegram found in the file
+static uint32_t DbLastTime[MAXFIELDS];
+static int32_t DbLastValue[MAXFIELDS];
+static int64_t DbLastStamp = 0;
+
+static uint8_t *put16(uint8_t *p, uint16_t v) {
+    *p++ = v;
+    *p++ = v >> 8;
+    return (p);
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t v) {
+    p = put16(p, v);
+    return (put16(p, v >> 16));
+}
+
+static uint8_t *put64(uint8_t *p, uint64_t v) {
+    p = put32(p, v);
+    return (put32(p, v >> 32));
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+static int64_t get64(const uint8_t *p) {
+    return ((int64_t)((uint64_t)get32(p) | (uint64_t)get32(p + 4) << 32));
+}
+
+// room for a record with a payload of len bytes, commits early if the
+// buffer is full
+static uint8_t *dbRecord(int type, int len) {
+    uint8_t *p;
+
+    if (DbLen + 2 + len > DBBUF && dbCommit() < 0)
+	return (NULL);
+    p = DbBuf + DbLen;
+    *p++ = type;
+    *p++ = len;
+    DbLen += 2 + len;
+    if (emsPtr != NULL)
+	emsPtr->stat.db.records++;
+    return (p);
+}
+
+// walk the records of the mapped file, remember the last values and return
+// the length of the valid part
+static off_t dbScan(const uint8_t *map, off_t size) {
+    off_t pos = DBHEADER;
+    const uint8_t *p;
+    int id;
+
+    while (pos + 2 <= size && pos + 2 + map[pos + 1] <= size) {
+	p = map + pos + 2;
+	switch (map[pos]) {
+	case DB_VALUE:
+	    id = p[4] | p[5] << 8;
+	    if (map[pos + 1] == 10 && id < MAXFIELDS) {
+		DbLastTime[id] = get32(p);
+		DbLastValue[id] = (int32_t)get32(p + 6);
+	    }
+	    break;
+	case DB_TELEGRAM:
+	    if (map[pos + 1] >= 8)
+		DbLastStamp = get64(p);
+	    break;
+	case DB_FIELD:
+	    break;
+	default:
+	    return (pos); // garbage, treat as end of file
+	}
+	pos += 2 + map[pos + 1];
+    }
+    return (pos);
+}
+
+// open (or create) the file for day t under path, returns 0 or -1
+int dbOpen(const char *path, time_t t) {
+    char message[2 * MAXPATH];
+    struct emsField field;
+    struct stat st;
+    struct tm tm;
+    uint8_t *map, *p;
+    off_t valid;
+    uint32_t i;
+    int len;
+
+    localtime_r(&t, &tm);
+    snprintf(DbName, MAXPATH, "%s/ems-%04d%02d%02d.db", path, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+    DbFd = open(DbName, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (DbFd < 0 || fstat(DbFd, &st) < 0) {
+	sprintf(message, "%s: could not open %s, error %s", DaemonName, DbName, strerror(errno));
+	LOGERR(message);
+	DbFd = -1;
+	return (-1);
+    }
+
+    memset(DbLastTime, 0, sizeof(DbLastTime));
+    DbLastStamp = 0;
+    DbLen = 0;
+    DbSize = st.st_size;
+
+    if (DbSize >= DBHEADER) {
+	map = mmap(NULL, DbSize, PROT_READ, MAP_SHARED, DbFd, 0);
+	if (map == MAP_FAILED || memcmp(map, DBMAGIC, DBHEADER) != 0) {
+	    sprintf(message, "%s: %s is no ems database file", DaemonName, DbName);
+	    LOGERR(message);
+	    if (map != MAP_FAILED)
+		munmap(map, DbSize);
+	    close(DbFd);
+	    DbFd = -1;
+	    return (-1);
+	}
+	valid = dbScan(map, DbSize);
+	munmap(map, DbSize);
+	if (valid < DbSize) {
+	    sprintf(message, "%s: %s: removing %ld bytes of an incomplete record", DaemonName, DbName,
+		    (long)(DbSize - valid));
+	    LOGERR(message);
+	    if (ftruncate(DbFd, valid) < 0)
+		return (-1);
+	    DbSize = valid;
+	}
+    }
+    else {
+	// new (or empty) file: header and the field table
+	if (DbSize > 0 && ftruncate(DbFd, 0) < 0)
+	    return (-1);
+	DbSize = 0;
+	memcpy(DbBuf, DBMAGIC, DBHEADER);
+	DbLen = DBHEADER;
+	for (i = 0; emsPtr != NULL && i < emsPtr->reg.nFields; i++) {
+	    if (fieldRead(i, &field) < 0)
+		continue;
+	    len = strlen(field.name);
+	    p = dbRecord(DB_FIELD, 4 + len);
+	    p = put16(p, field.id);
+	    *p++ = field.type;
+	    *p++ = (uint8_t)field.scale;
+	    memcpy(p, field.name, len);
+	}
+    }
+
+    sprintf(message, "%s: writing to %s, %ld bytes", DaemonName, DbName, (long)DbSize);
+    LOGIT(message);
+    return (0);
+}
+
+void dbClose(void) {
+    if (DbFd < 0)
+	return;
+    dbCommit();
+    close(DbFd);
+    DbFd = -1;
+}
+
+// time and value last written for field id (found in the file or added
+// since), 0 if there is none
+int dbLastValue(int id, uint32_t *time, int32_t *value) {
+    if (id < 0 || id >= MAXFIELDS || DbLastTime[id] == 0)
+	return (0);
+    *time = DbLastTime[id];
+    *value = DbLastValue[id];
+    return (1);
+}
+
+int64_t dbLastTelegram(void) {
+    return (DbLastStamp);
+}
+
+int dbAddValue(uint32_t time, int id, int32_t value) {
+    uint8_t *p;
+
+    if ((p = dbRecord(DB_VALUE, 10)) == NULL)
+	return (-1);
+    p = put32(p, time);
+    p = put16(p, id);
+    put32(p, value);
+    if (id >= 0 && id < MAXFIELDS) {
+	DbLastTime[id] = time;
+	DbLastValue[id] = value;
+    }
+    return (0);
+}
+
+int dbAddTelegram(int64_t stamp, const uint8_t *data, int len) {
+    uint8_t *p;
+
+    if (len > 255 - 8)
+	len = 255 - 8;
+    if ((p = dbRecord(DB_TELEGRAM, 8 + len)) == NULL)
+	return (-1);
+    p = put64(p, stamp);
+    memcpy(p, data, len);
+    DbLastStamp = stamp;
+    return (0);
+}
+
+size_t dbPending(void) {
+    return (DbLen);
+}
+
+// write the buffer with one write() and make it durable. On error the file
+// is cut back to the last commit and the buffer is dropped, so the file
+// never ends with a partial record and memory stays bounded.
+int dbCommit(void) {
+    char message[2 * MAXPATH];
+    struct timespec t0, t1;
+    uint32_t us;
+    size_t done = 0;
+    ssize_t res;
+
+    if (DbLen == 0)
+	return (0);
+    if (DbFd < 0) {
+	DbLen = 0;
+	return (-1);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while (done < DbLen) {
+	res = write(DbFd, DbBuf + done, DbLen - done);
+	if (res < 0 && errno == EINTR)
+	    continue;
+	if (res < 0)
+	    break;
+	done += res;
+    }
+    if (done < DbLen || fdatasync(DbFd) < 0) {
+	sprintf(message, "%s: commit of %zu bytes to %s failed, error %s", DaemonName, DbLen, DbName,
+		strerror(errno));
+	LOGERR(message);
+	if (ftruncate(DbFd, DbSize) < 0) {
+	    sprintf(message, "%s: could not truncate %s, error %s", DaemonName, DbName, strerror(errno));
+	    LOGERR(message);
+	}
+	DbLen = 0;
+	return (-1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    us = (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
+    if (emsPtr != NULL) {
+	emsPtr->stat.db.bytes += DbLen;
+	emsPtr->stat.db.commits++;
+	emsPtr->stat.db.lastCommit = us;
+	if (us > emsPtr->stat.db.maxCommit)
+	    emsPtr->stat.db.maxCommit = us;
+    }
+    DbSize += DbLen;
+    DbLen = 0;
+    return (0);
+}
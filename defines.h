@@ -17,17 +17,5 @@
 #define LOG_MAC 0x10     // Output sync (token) information
 #define LOG_CHAR 0x20    // Output single characters
 
-struct STATS {
-    unsigned int rx_mac_errors;
-    unsigned int rx_total;
-    unsigned int rx_success;
-    unsigned int rx_short;
-    unsigned int rx_sender; // Bad senders
-    unsigned int rx_format; // Bad format
-    unsigned int rx_crc;
-    unsigned int tx_total;
-    unsigned int tx_fail;
-};
-
 enum STATE { RELEASED, ASSIGNED, WROTE, READ };
 
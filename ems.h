@@ -15,8 +15,8 @@
 #include <time.h>
 #include <getopt.h>
 #include <string.h>
-#include <mosquitto.h>
-#include <libMsbClientC.h>  // in /usr/local/include
+#include <stdint.h>
+#include <stdbool.h>
 
 #define DATAPATH "/usr/local/var"
 #define RCVQUEUE "/ems_bus_rx"
@@ -40,57 +40,322 @@
 #define CLASS "SmartObject"
 #define NAME "emsval"
 
-enum varType { CHAR = 0, INT = 1, FLOAT = 2 };
+// layout of the shared memory segment
+//
+// The segment is split into regions, each starting on its own cache line, so
+// that the daemons do not write into the same lines: the header is written once
+// by the creator, each process owns its slot in proc[], emsDecode is the only
+// writer of the field registry, emsMonitor writes ctl. Only plain data lives here - process
+// local pointers (mosquitto handle, msb client) are kept by the owning process.
+// Bump SHMVERSION whenever the layout changes, binaries with a different
+// layout refuse to attach.
 
-struct _ems_ {
-    int heartbeatDecode;
-    int heartbeatSerio;
-    int heartbeatDb;
-    int heartbeatMqtt;
-    int heartbeatMsb;
-    int status;
-    int code1;
-    int code2;
-    int model;
-    int error1;
-    int error2;
-    int error3;
-    int errorCode;
-    int ubaCode;
-    int burnerCode;
+#define SHMMAGIC 0x454d5331 // "EMS1"
+#define SHMVERSION 18
+#define CACHELINE 64
+#define CACHEALIGN __attribute__((aligned(CACHELINE)))
+
+// return values of shmAttach()
+#define SHM_OK 0
+#define SHM_NOSEG -1  // segment does not exist (yet)
+#define SHM_NOATT -2  // shmat() failed
+#define SHM_LAYOUT -3 // segment was created with a different layout
+
+enum procId { PROC_SERIO = 0, PROC_DECODE, PROC_DB, PROC_MQTT, PROC_MSB, PROC_PUB, PROC_MAX };
+
+struct emsHeader {
+    uint32_t magic;   // SHMMAGIC, written last by the creator
+    uint32_t version; // SHMVERSION
+    uint32_t size;    // sizeof(ems) of the creator
+    uint32_t procMax; // PROC_MAX of the creator
+    time_t created;
+} CACHEALIGN;
+
+// per process heartbeat and pid, one cache line each
+struct emsProc {
+    time_t heartbeat;
+    pid_t pid;
+    int avail; // sink (mqtt broker, msb) is reachable
+} CACHEALIGN;
+
+// set from emsMonitor
+struct emsControl {
+    int debug;
     int ecoMode;
     int summerMode;
-    int debug;
-    int pid;
-    int serioPid;
-    int decodePid;
-    int dbPid;
-    int mqttPid;
-    int mqttAvail;
-    int msbPid;
-    int msbAvail;
+} CACHEALIGN;
+
+// field registry, written by emsDecode
+//
+// Every decoded value is a field with a compact id that is also its index
+// into field[], so lookup by id is O(1). Name, type, unit and scale are stored
+// in shared memory as well, publishers just iterate over the first nFields
+// entries and need no knowledge of the single values. Each field is guarded
+// by a sequence counter (odd while being written), use fieldRead() for a
+// consistent copy.
+
+#define MAXFIELDS 64
+#define FIELDNAME 24
+#define FIELDUNIT 8
+
+// FT_FIXED values are integers in units of 10^-scale, exactly as sent by the
+// boiler (e.g. 453 with scale 1 is 45.3 °C), no floating point is involved
+enum fieldType { FT_INT = 0, FT_FIXED = 1, FT_BOOL = 2 };
+
+// field flags
+#define FF_RETAIN 0x01 // publish with retain flag
+#define FF_MSB 0x02    // part of the msb event
+
+enum fieldId {
+    F_STATUS = 0,
+    F_BOILERSTATE,
+    F_WATERSTATE,
+    F_PUMP,
+    F_CIRCPUMP,
+    F_CIRCSTATE1,
+    F_CIRCSTATE2,
+    F_CODE1,
+    F_CODE2,
+    F_MODEL,
+    F_ERROR1,
+    F_ERROR2,
+    F_ERROR3,
+    F_ERRORCODE,
+    F_UBACODE,
+    F_BURNERCODE,
+    F_LOADINGPUMP,
+    F_POWER,
+    F_STARTS,
+    F_OPTIME,
+    F_SETWATERTEMP,
+    F_SETTEMPERATURE,
+    F_TEMPBOILER,
+    F_TEMPEXHAUST,
+    F_TEMPWATER,
+    F_TEMPOUTSIDE,
+    F_TEMPINSIDE,
+    F_CURRENT,
+    F_BURNER,
+    F_BLOWER,
+    F_MAX
+};
+
+struct emsField {
+    uint32_t seq;      // sequence counter, odd while the writer is updating
+    uint16_t id;
+    uint8_t type;      // enum fieldType
+    uint8_t flags;     // FF_*
+    int8_t scale;      // decimal places of FT_FIXED values
+    char name[FIELDNAME];
+    char unit[FIELDUNIT];
+    int32_t value;     // raw value, see scale
+    int64_t stamp;     // receive time of the telegram, ns since epoch
+    uint32_t updates;
+} CACHEALIGN;
+
+// rolling window aggregates per field, updated with every fieldSetInt().
+// Each window is a ring of AGGBUCKETS buckets, an update only touches the
+// current bucket, a read combines the (constant number of) buckets.
+// Times inside a bucket are ms relative to the bucket start.
+
+#define AGGWINDOWS 4
+#define AGGBUCKETS 12
+
+enum aggWindow { W1MIN = 0, W5MIN, W10MIN, W15MIN };
+
+struct aggBucket {
+    int64_t start;     // bucket start, s since epoch
+    int64_t sum;       // sum of values
+    int64_t sumT;      // sum of t
+    int64_t sumTT;     // sum of t^2
+    int64_t sumTV;     // sum of t * value
+    int32_t count;
+    int32_t min;
+    int32_t max;
+};
+
+struct emsAggregate {
+    struct aggBucket b[AGGWINDOWS][AGGBUCKETS];
+} CACHEALIGN;
+
+struct aggResult {
+    int32_t window;    // length of window in s
+    int32_t count;     // number of samples in window
+    int32_t min;
+    int32_t max;
+    int32_t mean;      // all values in units of the field (raw, see scale)
+    int32_t slope;     // change per hour
+};
+
+// history of every field: a ring of raw samples and two downsampled tiers
+// (1 and 15 minutes, mean/min/max). There is only one writer (emsDecode);
+// head[] counts the entries ever written to a tier and is published after
+// the entry, readers copy without locking and drop what got overwritten.
+
+#define HISTRAW 512        // raw samples, about 1.5 h with a telegram every 10 s
+#define HIST1MIN 240       // 4 h
+#define HIST15MIN 192      // 2 days
+
+enum histTier { HT_RAW = 0, HT_1MIN, HT_15MIN, HT_MAX };
+
+struct histPoint {
+    uint32_t time;     // s since epoch
+    int32_t value;
+};
+
+struct histSample {
+    uint32_t time;     // start of the interval, s since epoch
+    int32_t mean;
+    int32_t min;
+    int32_t max;
+};
+
+struct histAccu {      // interval in progress, writer only
+    uint32_t start;
+    int32_t count;
+    int64_t sum;
+    int32_t min;
+    int32_t max;
+};
+
+struct emsHistory {
+    uint32_t head[HT_MAX];
+    struct histAccu acc[HT_MAX]; // acc[HT_RAW] is unused
+    struct histPoint raw[HISTRAW];
+    struct histSample min1[HIST1MIN];
+    struct histSample min15[HIST15MIN];
+} CACHEALIGN;
+
+// the last raw telegrams as received by emsDecode, for emsDb and other
+// consumers. Same scheme as the history: one writer, head counts the
+// telegrams ever pushed, readers keep their own position.
+
+#define TGMAXLEN 54        // longer telegrams are truncated
+#define TGRING 1024
+
+struct emsTelegram {
+    int64_t stamp;     // ns since epoch
+    uint16_t len;
+    uint8_t data[TGMAXLEN];
+} CACHEALIGN;
+
+struct emsTelegramRing {
+    uint32_t head;
+    struct emsTelegram t[TGRING];
+} CACHEALIGN;
+
+struct emsRegistry {
+    uint32_t nFields;  // number of valid entries in field[]
+    uint32_t seq;      // +2 on every field update, odd while emsDecode
+                       // decodes a telegram (fieldTelegramBegin/End)
+} CACHEALIGN;
+
+// statistics, one block per writing process
+struct STATS {
+    unsigned int rx_mac_errors;
+    unsigned int rx_total;
+    unsigned int rx_success;
+    unsigned int rx_short;
+    unsigned int rx_sender; // Bad senders
+    unsigned int rx_format; // Bad format
+    unsigned int rx_crc;
+    unsigned int tx_total;
+    unsigned int tx_fail;
+} CACHEALIGN;
+
+struct decodeStats {
+    unsigned int telegrams;
+    unsigned int undecoded;
+} CACHEALIGN;
+
+struct pubStats {
+    time_t lastData;
+    unsigned int published;
+    unsigned int errors;
+    unsigned int suppressed; // not sent, within deadband
+    uint32_t cycles;         // publish cycles
+    uint32_t cycleCpu;       // CPU time of the last cycle in µs
+    uint32_t maxCpu;         // longest cycle in µs
+    uint64_t totalCpu;       // all cycles in µs
+    uint32_t spooled;        // kept in the spool while the broker was away
+    uint32_t replayed;       // sent from the spool
+    uint32_t dropped;        // overwritten in the full spool
+    uint32_t pending;        // waiting in the spool
+    uint32_t connects;       // successful connects to the broker
+    uint32_t disconnects;    // connections lost
+    uint32_t lastReconnect;  // ms from losing the connection to the next connect
+    uint32_t maxReconnect;   // ms
+    uint32_t maxPending;     // most samples waiting to be sent
+    uint32_t latency;        // ms from taking a sample until it was sent
+    uint32_t maxLatency;     // ms
+    uint32_t ticks;          // scheduled wakeups
+    uint32_t overruns;       // deadlines missed by a period or more
+    uint32_t jitter;         // µs the last wakeup was late
+    uint32_t maxJitter;      // µs
+    uint64_t totalJitter;    // µs of all wakeups
+} CACHEALIGN;
+
+struct dbStats {
+    uint64_t records;     // records written
+    uint64_t bytes;       // bytes written
+    uint32_t commits;     // write() + fdatasync() cycles
+    uint32_t lost;        // values/telegrams overwritten before we read them
+    uint32_t lastCommit;  // duration of last commit in µs
+    uint32_t maxCommit;   // longest commit in µs
+    time_t lastData;
+} CACHEALIGN;
+
+// commands received by emsMqtt for the transmit queue
+struct cmdStats {
+    uint32_t received;
+    uint32_t queued;
+    uint32_t rejected;    // invalid, not allowed or queue full
+    uint32_t limited;     // over the rate of its source
+} CACHEALIGN;
+
+// sinks of emsPub, each on its own thread behind a bounded queue
+#define SINKMAX 4
+struct sinkStats {
+    char name[16];        // empty: not used
+    uint32_t queued;      // snapshots put into the queue
+    uint32_t sent;        // snapshots the sink handled successfully
+    uint32_t errors;      // snapshots the sink failed on
+    uint32_t dropped;     // oldest snapshot overwritten in the full queue
+    uint32_t pending;     // waiting in the queue
+    uint32_t maxPending;
+    uint32_t lastSend;    // µs the sink took for the last snapshot
+    uint32_t maxSend;     // µs
     time_t lastData;
-    struct mosquitto *mosq;
-    int power;
-    float current;
-    long int starts;
-    long int opTime;
-    int pump;
-    int burner;
-    int blower;
-    int boilerState;
-    int waterState;
-    int loadingPump;
-    int circPump;
-    int circState1;
-    int circState2;
-    float setTemperature; // target temperature for boiler out
-    float setWaterTemp;
-    float tempOutside;
-    float tempInside;
-    float tempBoiler;
-    float tempWater;
-    float tempExhaust;
+} CACHEALIGN;
+
+// influx sink of emsPub
+struct influxStats {
+    uint64_t points;      // field values written
+    uint64_t bytes;       // sent
+    uint32_t lines;       // one per telegram
+    uint32_t batches;     // sent
+    uint32_t retries;     // batches that failed and are kept
+    uint32_t dropped;     // lines lost (buffer full or refused)
+    uint32_t pending;     // bytes waiting in the buffer
+    uint32_t lastBatch;   // µs to send the last batch
+    uint32_t maxBatch;    // µs
+} CACHEALIGN;
+
+struct emsStats {
+    struct STATS serio;
+    struct decodeStats decode;
+    struct dbStats db;
+    struct pubStats mqtt;
+    struct pubStats msb;
+    struct cmdStats cmd;
+    struct pubStats pub;      // cycles of emsPub
+    struct pubStats pubMqtt;  // mqtt sink of emsPub
+    struct sinkStats sink[SINKMAX];
+    struct influxStats influx;
+};
+
+// configuration, written at startup of the daemons
+struct emsConfig {
     char configFile[MAXNAME];
     char broker[MAXNAME];
     char cert[MAXNAME];
@@ -108,7 +373,22 @@ struct _ems_ {
     char msbClass[MAXNAME];
     char msbName[MAXNAME];
     char msbDescription[MAXNAME];
-    msbClient *client;
+    int32_t dbCommit;     // s between group commits of emsDb
+    int32_t dbTelegrams;  // emsDb stores raw telegrams, too
+    int32_t dbColumns;    // emsDb keeps the columnar history (col.c)
+} CACHEALIGN;
+
+struct _ems_ {
+    struct emsHeader hdr;
+    struct emsProc proc[PROC_MAX];
+    struct emsControl ctl;
+    struct emsRegistry reg;
+    struct emsField field[MAXFIELDS];
+    struct emsAggregate agg[MAXFIELDS];
+    struct emsHistory hist[MAXFIELDS];
+    struct emsTelegramRing tg;
+    struct emsStats stat;
+    struct emsConfig cfg;
 };
 
 typedef struct _ems_ ems;
@@ -121,3 +401,181 @@ int Debug;
 char DaemonName[MAXNAME]; // use this for daemon name
 int Daemon;
 int Line;
+
+// shm.c
+int shmAttach(key_t key, int create);
+
+// configure.c, the settings of the config file. Every key is described by
+// the schema in configure.c (group, type, default, range, reload class);
+// cfgLoad() checks the file against it once and fills a struct conf, so the
+// daemons just read Conf->group.key. A file with an invalid value fails
+// cfgLoad() (the daemons terminate) and is not applied on reload.
+// Per field keys of [TOPICS] and [DEADBAND] are looked up with cfgGet().
+
+struct conf {
+    struct {
+	int debug;
+	char broker[MAXNAME];
+	int port;
+	char cert[MAXNAME];
+	int mqttmode;             // MQTT_TOPICS, MQTT_JSON or both
+	char topicprefix[MAXNAME];
+	char jsontopic[MAXNAME];  // empty: <topicprefix>/json
+	int spoolsize;            // kB, 0: no spool
+	int spoolrate;            // messages/s
+	char datapath[MAXPATH];
+	int commands;
+	char cmddest[MAXNAME];
+	double cmdrate;           // commands/s per source
+	double cmdburst;
+	int period;               // ms
+	int phase;                // ms, -1: not aligned
+	int mqttversion;          // MQTT_V5, MQTT_V311
+	int reconnectmin;         // s
+	int reconnectmax;         // s
+	char emstty[MAXPATH];
+	char rxqueue[MAXNAME];
+	char txqueue[MAXNAME];
+    } ems;
+    struct {
+	int qos;
+	int expiry;               // s, 0: none
+    } topics;
+    struct {
+	int silence;              // s
+    } deadband;
+    struct {
+	char url[MAXNAME];
+	char port[MAXNAME];
+	char cert[MAXNAME];
+	char uuid[MAXNAME];
+	char token[MAXNAME];
+	char class[MAXNAME];
+	char name[MAXNAME];
+	char description[MAXNAME];
+	int interval;             // µs
+	int phase;                // µs, -1: not aligned
+	int batch;                // samples per event
+	int batchtime;            // ms
+    } v4k;
+    struct {
+	char sinks[MAXNAME];
+	char file[MAXPATH];       // empty: <datapath>/ems.jsonl
+	int period;               // ms
+	int phase;                // ms, -1: not aligned
+    } pub;
+    struct {
+	int commit;               // s
+	int telegrams;
+	int columns;
+    } db;
+    struct {
+	char url[MAXPATH];
+	char measurement[MAXNAME];
+	char token[MAXNAME];
+	int batchsize;            // bytes, 0: by transport
+	int batchage;             // ms
+	int retrykb;
+    } influx;
+};
+
+// [EMS] mqttmode
+#define MQTT_TOPICS 1
+#define MQTT_JSON 2
+
+// [EMS] mqttversion
+#define MQTT_V5 1
+#define MQTT_V311 2
+
+// the current settings, replaced as a whole on reload; the old ones stay
+// valid for some reloads, so a loop may keep the pointer for a cycle
+const struct conf *Conf;
+
+int cfgLoad(const char *cFile);
+const char *cfgGet(const char *group, const char *key);
+
+// hot reload, a changed key of the reload class restart is reported as
+// taking effect after a restart. Each daemon keeps what it applied.
+struct cfgIndex;
+struct cfgApplied {
+    uint32_t gen;
+    struct cfgIndex *prev;  // applied before the last cfgReloaded()
+    struct cfgIndex *cur;   // applied since
+};
+int cfgWatch(void);
+int cfgReloaded(struct cfgApplied *a);
+int cfgChanged(const struct cfgApplied *a, const char *group, const char *key);
+
+// itoa.c
+int fmtInt(int32_t value, char *str);
+int fmtFixed(int32_t value, int scale, char *str);
+
+// fields.c
+void fieldInit(void);
+int fieldByName(const char *name);
+int fieldDef(const char *name, int *scale, const char **unit);
+void fieldSetInt(int id, int32_t val, int64_t stamp);
+void fieldTelegramBegin(void);
+void fieldTelegramEnd(void);
+int fieldRead(int id, struct emsField *copy);
+int fieldFormat(const struct emsField *f, char *buff);
+int32_t fieldInt(int id);
+double fieldDouble(const struct emsField *f);
+int64_t stampNow(void);
+
+// agg.c
+void aggUpdate(int id, int32_t value, int64_t stamp);
+int aggRead(int id, int window, int64_t now, struct aggResult *res);
+
+// hist.c
+void histUpdate(int id, int32_t value, int64_t stamp);
+int histRead(int id, int tier, struct histSample *buf, int max);
+int histReadFrom(int id, int tier, uint32_t *pos, struct histSample *buf, int max);
+
+// snap.c
+int snapTake(struct emsField *snap);
+int snapJson(const struct emsField *snap, int n, time_t t, char *buff, size_t size);
+void pubCpu(struct pubStats *s, const struct timespec *t0);
+
+// tick.c, periodic wakeups at absolute deadlines, local to a process
+struct tick {
+    int clock;                // CLOCK_REALTIME if aligned, else CLOCK_MONOTONIC
+    struct timespec next;     // next deadline
+    int64_t period;           // ns
+};
+void tickInit(struct tick *t, int64_t period, int64_t phase);
+time_t tickWait(struct tick *t, struct pubStats *s);
+
+// sink.c, snapshots fanned out to the sinks of emsPub
+int sinkStart(const char *name);
+void sinkPut(const struct emsField *snap, int n, time_t t);
+
+// influx.c
+int influxSetup(const char *url, int batchSize, int batchAge, int retryKb);
+int influxInit(void);
+int influxSend(const struct emsField *snap, int n, time_t t);
+int influxFlush(void);
+
+// tgring.c
+void tgPush(const uint8_t *data, int len, int64_t stamp);
+int tgReadFrom(uint32_t *pos, struct emsTelegram *buf, int max);
+
+// spool.c
+#define SPOOLMAX 8192  // largest record (header, topic and payload)
+int spoolOpen(const char *path, uint32_t kbytes);
+void spoolClose(void);
+uint32_t spoolPending(void);
+int spoolAdd(const char *topic, const void *payload, int plen, int64_t stamp);
+int spoolPeek(const char **topic, const void **payload, int64_t *stamp);
+void spoolDone(void);
+int spoolSync(void);
+
+// db.c
+int dbOpen(const char *path, time_t t);
+void dbClose(void);
+int dbAddValue(uint32_t time, int id, int32_t value);
+int dbAddTelegram(int64_t stamp, const uint8_t *data, int len);
+int dbCommit(void);
+size_t dbPending(void);
+int dbLastValue(int id, uint32_t *time, int32_t *value);
+int64_t dbLastTelegram(void);
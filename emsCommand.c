@@ -11,7 +11,6 @@
 #define LEN 8192
 
 // forward declarations
-int getConfig(enum varType, void *var, char *defVal, char *cFile, char *group, char *key);
 extern int usleep (__useconds_t __useconds);
 
 int main(int argc , char *argv[])
@@ -56,52 +55,29 @@ int main(int argc , char *argv[])
         }
     }
 
-    // try to get shared memory, if it already exists or create it
-    ShmId = shmget(key, sizeof(ems), 0);
-    if (ShmId < 0) {
-        sprintf(message,
-                "%s: could not get shared memory, shmid = %d, error %d, %s. Trying to create it...",
-                DaemonName, ShmId, errno, strerror(errno));
-        LOGERR(message);
-	// try to create it
-	ShmId = shmget(key, sizeof(ems), IPC_CREAT | 0666);
-	if (errno != 0 && ShmId < 0) {
-	    sprintf(message, "%s: could not create shared memory, error %s, errno = %d, shmid = %d",
-		    DaemonName, strerror(errno), errno, ShmId);
-	    LOGERR(message);
-	    exit (errno);
-	}
-    }
+    // check the config file, an invalid one is fatal
+    if (cfgLoad(CONFIGFILE) < 0)
+	exit(1);
 
-    emsPtr = shmat(ShmId, NULL, 0);
-    sprintf(message,
-	    "%s: attached shared memory, shmid = %d, ptr = %x",
-	    DaemonName, ShmId, (int)emsPtr);
-    LOGIT(message);
-
-    if (emsPtr != (void *) -1) {
-        currentTime = time(NULL);
-    } else {
-        sprintf(message,  "%s: could not attach shared memory at line %d, errno = %d (%s)",
-                DaemonName, __LINE__, errno, strerror(errno));
+    // try to get shared memory, if it already exists or create it
+    if (shmAttach(key, true) != SHM_OK) {
+        sprintf(message,  "%s: could not attach shared memory at line %d", DaemonName, __LINE__);
         LOGERR(message);
         _exit(1);
     }
+    currentTime = time(NULL);
 
     // check for name of send message queue
-    if (strlen(emsPtr->txqueue) > 0) {
-	sprintf(message, "%s: txqueue already set to >%s< ", DaemonName, emsPtr->txqueue);
+    if (strlen(emsPtr->cfg.txqueue) > 0) {
+	sprintf(message, "%s: txqueue already set to >%s< ", DaemonName, emsPtr->cfg.txqueue);
     } else {
-	result = getConfig(CHAR, &emsPtr->txqueue, TX_QUEUE_NAME, CONFIGFILE, "EMS", "txqueue");
-	if (result)
-	    sprintf(message, "%s: txqueue not defined, set to default >%s<", DaemonName, TX_QUEUE_NAME);
-	else
-	    sprintf(message, "%s: txqueue set to >%s< ", DaemonName, emsPtr->txqueue);
+	snprintf(emsPtr->cfg.txqueue, sizeof(emsPtr->cfg.txqueue), "%s", Conf->ems.txqueue);
+	sprintf(message, "%s: txqueue set to >%s< ", DaemonName, emsPtr->cfg.txqueue);
     }
     LOGIT(message);
 
     // open queue for packets to send
-    fd = mq_open(emsPtr->txqueue, O_RDWR | O_NONBLOCK);
+    fd = mq_open(emsPtr->cfg.txqueue, O_RDWR | O_NONBLOCK);
     if (fd == -1) {
 	sterr = errno;
 	sprintf(message, "%s: couldn't open the message queue. Error : %s\n", DaemonName, strerror(sterr));
@@ -132,7 +108,7 @@ int main(int argc , char *argv[])
 	LOGERR(message);
     }
     else {
-        sprintf(message, "%s: added packet to queue: %s", DaemonName, emsPtr->txqueue);
+        sprintf(message, "%s: added packet to queue: %s", DaemonName, emsPtr->cfg.txqueue);
 	LOGIT(message);
     }
 
@@ -0,0 +1,326 @@
+//
+// emsDb.c - store decoded values and raw telegrams in an append-only file
+//
+// $Id$
+
+#define _DEFAULT_SOURCE
+#include <stdbool.h>
+#include <signal.h>
+#include <string.h>
+#include "ems.h"
+#include "col.h"
+
+// values are written when they change, unchanged ones every DBKEEPALIVE s
+#define DBKEEPALIVE 900
+#define BATCH 64
+
+// forward declarations
+void SIGgen_handler_db(int);
+int dbBench(char *path, long records);
+
+// (module-)global vars
+volatile sig_atomic_t Terminate = false;
+struct colWriter Col[MAXFIELDS]; // columnar history, opened on first value
+int ColState[MAXFIELDS];         // 0 not yet opened, 1 open, -1 failed
+
+#define SVN "$Id$"
+
+int main (int argc, char** argv) {
+    key_t key = SHMKEY;
+    pid_t daemonPid = 0;
+    pid_t sid;
+    time_t currentTime, lastCommit;
+    FILE *fp;
+    int tries = 0;
+    int i, j, c, n, result, day = -1;
+    long bench = 0;
+    char message[MAXPATH + 100], path[MAXPATH];
+    uint32_t tgPos = 0, histPos[MAXFIELDS], lastTime, advance;
+    int32_t lastValue;
+    struct histSample samples[BATCH];
+    struct emsTelegram telegrams[BATCH];
+    struct tm tm;
+    struct colWriter *cols[MAXFIELDS];
+    struct cfgApplied applied = { 0 };
+    int nCols;
+
+    // default: run as daemon
+    Daemon = 1;
+    path[0] = '\0';
+
+    while ((c = getopt(argc, argv, "vnhVb:d:")) != -1) {
+	switch (c) {
+	case 'v': // be verbose
+	    Debug = 1;
+	    break;
+
+	case 'V': // show version and exit
+#ifdef SVN_REV
+	    fprintf (stderr, "emsDb, svn rev: %s\n", SVN_REV);
+#else
+	    fprintf (stderr, "emsDb, svn info: %s\n", SVN);
+#endif
+	    exit (0);
+	    break;
+
+	case 'n': // run in foreground
+	    Daemon = 0;
+	    break;
+
+	case 'b': // write benchmark
+	    bench = atol(optarg);
+	    Daemon = 0;
+	    break;
+
+	case 'd': // data path
+	    snprintf(path, MAXPATH, "%s", optarg);
+	    break;
+
+	case 'h':
+	case '?':
+	    fprintf (stderr, "%s:\tOption -v activates debug mode,\n", argv[0]);
+	    fprintf (stderr, "\tOption -n disables daemon mode\n");
+	    fprintf (stderr, "\tOption -d <dir> stores the files in dir instead of datapath\n");
+	    fprintf (stderr, "\tOption -b # writes # records to a scratch file and shows the throughput\n");
+	    fprintf (stderr, "\tOption -?/-h show this information\n");
+	    fprintf (stderr, "\tOption -V shows the version information\n");
+	    fprintf (stderr, "signalling with SIGUSR1 will enable debug mode\n");
+	    fprintf (stderr, "signalling with SIGUSR2 or changing %s will reread it\n", CONFIGFILE);
+	    exit(0);
+	    break;
+
+	default:
+	    exit(0);
+	}
+    }
+
+#undef DAEMON_NAME
+#define DAEMON_NAME "emsDb"
+    sprintf(DaemonName, "%s", DAEMON_NAME);
+
+    // check the config file, an invalid one is fatal
+    if (cfgLoad(CONFIGFILE) < 0)
+	exit(1);
+    if (path[0] == '\0')
+	snprintf(path, sizeof(path), "%s", Conf->ems.datapath);
+
+    if (bench > 0)
+	exit(dbBench(path, bench));
+
+    if (Daemon) {
+	openlog(DaemonName, LOG_CONS | LOG_NDELAY | LOG_PERROR | LOG_PID, LOG_USER);
+	syslog(LOG_INFO, "emsDb running as daemon");
+    }
+    // try to get shared memory, if it already exists...
+ retry:
+    result = shmAttach(key, false);
+    if (result == SHM_NOSEG) {
+	sprintf(message,
+		"%s: could not get shared memory, error %d, %s. Try %d / 30",
+		DaemonName, errno, strerror(errno), tries);
+	LOGERR(message);
+	sleep(10);
+	if (tries++ < 30) // wait for about 5 minutes
+	    goto retry;
+	else
+	    _exit(errno);
+    }
+    else if (result != SHM_OK) {
+	sprintf(message,  "%s: could not attach shared memory at line %d", DaemonName, __LINE__);
+	LOGERR(message);
+	_exit(1);
+    }
+    emsPtr->proc[PROC_DB].heartbeat = time(NULL);
+    snprintf(emsPtr->cfg.datapath, MAXPATH, "%s", path);
+
+    emsPtr->cfg.dbCommit = Conf->db.commit;
+    emsPtr->cfg.dbTelegrams = Conf->db.telegrams;
+    emsPtr->cfg.dbColumns = Conf->db.columns;
+    snprintf(message, sizeof(message), "%s: datapath %.300s, commit every %d s, telegrams %s, columns %s", DaemonName,
+	    path, emsPtr->cfg.dbCommit, emsPtr->cfg.dbTelegrams ? "on" : "off",
+	    emsPtr->cfg.dbColumns ? "on" : "off");
+    LOGIT(message);
+
+    if (signal(SIGUSR1, SIGgen_handler_db) == SIG_ERR
+	|| signal(SIGTERM, SIGgen_handler_db) == SIG_ERR
+	|| signal(SIGINT, SIGgen_handler_db) == SIG_ERR) {
+	sprintf(message, "%s: signal install error", DaemonName);
+	LOGERR(message);
+	_exit(errno);
+    }
+
+    if (Daemon) {
+	// create process
+	daemonPid = fork();
+
+	if (daemonPid < 0) {
+	    syslog(LOG_ERR, "could not fork %s daemon process", DaemonName);
+	    _exit(errno);
+	}
+	else {
+	    // check if parent or son
+	    if (daemonPid == 0) {
+		// son, will continue
+		syslog(LOG_INFO, "%s daemon started", DaemonName);
+	    }
+	    else {
+		fp = fopen("/run/emsDb.pid", "w");
+		if (fp == NULL)
+		    _exit(errno);
+		else {
+		    fprintf(fp, "%d\n", daemonPid);
+		    fclose(fp);
+		}
+		// parent must die to be able to detach controlling tty
+		exit(0);
+	    }
+	}
+	sid = getpid();
+	emsPtr->proc[PROC_DB].pid = sid;
+	sprintf(message, "%s: running with pid %d", DaemonName, sid);
+	LOGIT(message);
+
+	//Close Standard File Descriptors
+	close(STDIN_FILENO);
+	close(STDOUT_FILENO);
+	close(STDERR_FILENO);
+    } // daemon mode
+    else {
+	fprintf(stderr, "%s: running in foreground\n", DaemonName);
+    }
+
+    // start with the oldest entries still in the rings, what is already
+    // in today's file gets skipped by time
+    memset(histPos, 0, sizeof(histPos));
+    lastCommit = time(NULL);
+    cfgWatch();
+
+    while (!Terminate) {
+	sleep(1);
+	currentTime = time(NULL);
+	emsPtr->proc[PROC_DB].heartbeat = currentTime;
+
+	// the config file was changed
+	if (cfgReloaded(&applied)) {
+	    emsPtr->cfg.dbCommit = Conf->db.commit;
+	    emsPtr->cfg.dbTelegrams = Conf->db.telegrams;
+	}
+
+	// new file every day
+	localtime_r(&currentTime, &tm);
+	if (tm.tm_yday != day) {
+	    dbClose();
+	    if (dbOpen(path, currentTime) < 0) {
+		sleep(60);
+		continue;
+	    }
+	    day = tm.tm_yday;
+	}
+
+	// raw telegrams
+	while (emsPtr->cfg.dbTelegrams) {
+	    advance = tgPos;
+	    n = tgReadFrom(&tgPos, telegrams, BATCH);
+	    emsPtr->stat.db.lost += tgPos - advance - n;
+	    for (j = 0; j < n; j++)
+		if (telegrams[j].stamp > dbLastTelegram())
+		    dbAddTelegram(telegrams[j].stamp, telegrams[j].data, telegrams[j].len);
+	    if (n < BATCH)
+		break;
+	}
+
+	// changed values of all fields
+	for (i = 0; i < (int)emsPtr->reg.nFields; i++) {
+	    do {
+		advance = histPos[i];
+		n = histReadFrom(i, HT_RAW, &histPos[i], samples, BATCH);
+		if (n < 0)
+		    break;
+		emsPtr->stat.db.lost += histPos[i] - advance - n;
+		for (j = 0; j < n; j++) {
+		    if (dbLastValue(i, &lastTime, &lastValue)
+			&& (samples[j].time < lastTime
+			    || (samples[j].mean == lastValue && samples[j].time < lastTime + DBKEEPALIVE)))
+			continue;
+		    dbAddValue(samples[j].time, i, samples[j].mean);
+		    emsPtr->stat.db.lastData = currentTime;
+		    if (emsPtr->cfg.dbColumns && ColState[i] == 0)
+			ColState[i] = colOpenWrite(&Col[i], path, emsPtr->field[i].name) < 0 ? -1 : 1;
+		    if (ColState[i] == 1)
+			colAppend(&Col[i], samples[j].time, samples[j].mean);
+		}
+	    } while (n == BATCH);
+	}
+
+	// group commit
+	if (currentTime - lastCommit >= emsPtr->cfg.dbCommit) {
+	    if (Debug) {
+		sprintf(message, "%s: committing %zu bytes", DaemonName, dbPending());
+		LOGIT(message);
+	    }
+	    dbCommit();
+	    for (i = 0, nCols = 0; i < MAXFIELDS; i++)
+		if (ColState[i] == 1)
+		    cols[nCols++] = &Col[i];
+	    colSync(cols, nCols);
+	    lastCommit = currentTime;
+	}
+    }
+
+    dbClose();
+    for (i = 0; i < MAXFIELDS; i++)
+	if (ColState[i] == 1)
+	    colCloseWrite(&Col[i]);
+    sprintf(message, "%s: terminating, %llu records, %llu bytes in %u commits", DaemonName,
+	    (unsigned long long)emsPtr->stat.db.records, (unsigned long long)emsPtr->stat.db.bytes,
+	    emsPtr->stat.db.commits);
+    LOGIT(message);
+    exit(0);
+}
+
+// write a number of value records to a scratch file in path, one commit per full
+// buffer, and print the sustained rate. The file is dated early in 1970.
+int dbBench(char *path, long records) {
+    char name[MAXPATH + 20];
+    struct timespec t0, t1;
+    time_t day = 2 * 86400;
+    struct tm tm;
+    double s;
+    long i;
+
+    if (dbOpen(path, day) < 0)
+	return (1);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < records; i++)
+	dbAddValue(1000000000 + i / F_MAX, i % F_MAX, i);
+    dbClose();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    s = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("%ld value records (%ld bytes) in %.3f s: %.0f records/s, %.2f MB/s\n",
+	   records, records * 12, s, records / s, records * 12 / s / 1e6);
+
+    localtime_r(&day, &tm);
+    snprintf(name, sizeof(name), "%s/ems-%04d%02d%02d.db", path, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+    unlink(name);
+    return (0);
+}
+
+void SIGgen_handler_db(int sig)
+{
+    switch (sig)
+	{
+	case SIGUSR1:
+	    Debug = !Debug;
+	    break;
+
+	case SIGINT:
+	case SIGTERM:
+	    // commit and leave the main loop
+	    Terminate = true;
+	    break;
+
+	default:
+	    break;
+	}
+}
@@ -10,8 +10,12 @@
 
 #define LEN 8192
 
+// signed 16 bit value from two telegram bytes, e.g. temperatures in 0.1 °C
+#define INT16(HI, LO) ((int16_t)(256 * (uint8_t)(HI) + (uint8_t)(LO)))
+// 0x8000: no sensor connected, not -3276.8 °C
+#define NOSENSOR INT16_MIN
+
 // forward declarations
-int getConfig(enum varType, void *var, char *defVal, char *cFile, char *group, char *key);
 extern int usleep (__useconds_t __useconds);
 
 // global vars to keep track of opTime and starts
@@ -22,10 +26,12 @@ int main(int argc , char *argv[])
 {
     mqd_t fd;
     char buff[LEN], message[MAXPATH], message2[MAXPATH], queueName[MAXNAME];
+    char t1[16], t2[16];
     int sterr, i, c, len, result;
-    float temp, temp2, current, nightTemp, dayTemp, holidayTemp;
+    float nightTemp, dayTemp, holidayTemp;
     int power, intval, setTemp, setWater, year, month, day, hour, minute, second, dst, dayOfWeek;
     long int starts, opTime;
+    int64_t stamp = 0;
     int status, hcMode, summerThreshold;
     key_t key = SHMKEY;
     pid_t daemonPid = 0;
@@ -74,53 +80,33 @@ int main(int argc , char *argv[])
         syslog(LOG_INFO, "%s running as daemon", DaemonName);
     }   
 
-    // try to get shared memory, if it already exists or create it
-    ShmId = shmget(key, sizeof(ems), 0);
-    if (ShmId < 0) {
-        sprintf(message,
-                "%s: could not get shared memory, shmid = %d, error %d, %s. Trying to create it...",
-                DaemonName, ShmId, errno, strerror(errno));
-        LOGERR(message);
-	// try to create it
-	ShmId = shmget(key, sizeof(ems), IPC_CREAT | 0666);
-	if (errno != 0 && ShmId < 0) {
-	    sprintf(message, "%s: could not create shared memory, error %s, errno = %d, shmid = %d",
-		    DaemonName, strerror(errno), errno, ShmId);
-	    LOGERR(message);
-	    exit (errno);
-	}
-    }
-
-    emsPtr = shmat(ShmId, NULL, 0);
-    sprintf(message,
-	    "%s: attached shared memory, shmid = %d, ptr = %x",
-	    DaemonName, ShmId, (int)emsPtr);
-    LOGIT(message);
+    // check the config file, an invalid one is fatal
+    if (cfgLoad(CONFIGFILE) < 0)
+        exit(1);
 
-    if (emsPtr != (void *) -1) {
-        // init status vars
-        emsPtr->heartbeatDecode = time(NULL);
-    } else {
-        sprintf(message,  "%s: could not attach shared memory at line %d, errno = %d (%s)",
-                DaemonName, __LINE__, errno, strerror(errno));
+    // try to get shared memory, if it already exists or create it
+    if (shmAttach(key, true) != SHM_OK) {
+        sprintf(message,  "%s: could not attach shared memory at line %d", DaemonName, __LINE__);
         LOGERR(message);
         _exit(1);
     }
+    // init status vars
+    emsPtr->proc[PROC_DECODE].heartbeat = time(NULL);
+
+    // we are the writer of the field registry
+    fieldInit();
 
     // check for name of receive message queue
-    if (strlen(emsPtr->rxqueue) > 0) {
-	sprintf(message, "%s: rxqueue already set to >%s< ", DaemonName, emsPtr->rxqueue);
+    if (strlen(emsPtr->cfg.rxqueue) > 0) {
+	sprintf(message, "%s: rxqueue already set to >%s< ", DaemonName, emsPtr->cfg.rxqueue);
     } else {
-	result = getConfig(CHAR, &emsPtr->rxqueue, RX_QUEUE_NAME, CONFIGFILE, "EMS", "rxqueue");
-	if (result)
-	    sprintf(message, "%s: rxqueue not defined, set to default >%s<", DaemonName, RX_QUEUE_NAME);
-	else
-	    sprintf(message, "%s: rxqueue set to >%s< ", DaemonName, emsPtr->rxqueue);
+	snprintf(emsPtr->cfg.rxqueue, sizeof(emsPtr->cfg.rxqueue), "%s", Conf->ems.rxqueue);
+	sprintf(message, "%s: rxqueue set to >%s< ", DaemonName, emsPtr->cfg.rxqueue);
     }
     LOGIT(message);
 
     // open queue for received packets
-    fd = mq_open(emsPtr->rxqueue, O_RDONLY);
+    fd = mq_open(emsPtr->cfg.rxqueue, O_RDONLY);
     if (fd == -1) {
 	sterr = errno;
 	sprintf(message, "%s: couldn't open the message queue. Error : %s\n", DaemonName, strerror(sterr));
@@ -128,45 +114,6 @@ int main(int argc , char *argv[])
 	exit(sterr);
     }
 
-    if (Daemon) {
-        //Set our Logging Mask and open the Log
-        //setlogmask(LOG_UPTO(LOG_NOTICE));
-        openlog(DaemonName, LOG_CONS | LOG_NDELAY | LOG_PERROR | LOG_PID, LOG_USER);
-        syslog(LOG_INFO, "%s running as daemon", DaemonName);
-    }   
-
-    // try to get shared memory, if it already exists or create it
-    ShmId = shmget(key, sizeof(ems), 0);
-    if (ShmId < 0) {
-        sprintf(message,
-                "%s: could not get shared memory, shmid = %d, error %d, %s. Try %d / 30",
-                DaemonName, ShmId, errno, strerror(errno), tries);
-        LOGERR(message);
-	// try to create it
-	ShmId = shmget(key, sizeof(ems), IPC_CREAT | 0666);
-	if (errno != 0 && ShmId < 0) {
-	    sprintf(message, "decodeEms: could not create shared memory, error %s, errno = %d, shmid = %d", strerror(errno), errno, ShmId);
-	    LOGERR(message);
-	    exit (errno);
-	}
-    }
-
-    emsPtr = shmat(ShmId, NULL, 0);
-    sprintf(message,
-	    "%s: attached shared memory, shmid = %d, ptr = %x",
-	    DaemonName, ShmId, (int)emsPtr);
-    LOGIT(message);
-
-    if (emsPtr != (void *) -1) {
-        // init status vars
-        emsPtr->heartbeatDecode = time(NULL);
-    } else {
-        sprintf(message,  "%s: could not attach shared memory at line %d, errno = %d (%s)",
-                DaemonName, __LINE__, errno, strerror(errno));
-        LOGERR(message);
-        _exit(1);
-    }
-
     // clear receive buffer    
     memset(buff, 0, LEN);
 
@@ -202,7 +149,7 @@ int main(int argc , char *argv[])
 	    _exit(errno);
 	}
 	else {
-	    emsPtr->decodePid = sid;
+	    emsPtr->proc[PROC_DECODE].pid = sid;
 	}
 	sprintf(message, "%s: running with pid %d", DaemonName, sid);
 	LOGIT(message);
@@ -222,6 +169,7 @@ int main(int argc , char *argv[])
     else {
 	fprintf(stderr, "%s: running in foreground\n", DaemonName);
     }
+    cfgWatch();
 
     for (;;) {
 	len = mq_receive(fd, buff, sizeof(buff), NULL);
@@ -241,7 +189,11 @@ int main(int argc , char *argv[])
 		}
 		LOGIT(message);
 	    }
-	    emsPtr->heartbeatDecode = time(NULL);
+	    emsPtr->proc[PROC_DECODE].heartbeat = time(NULL);
+	    emsPtr->stat.decode.telegrams++;
+	    stamp = stampNow();
+	    tgPush((uint8_t *)buff, len, stamp);
+	    fieldTelegramBegin();
 	    switch (buff[0]) { // from
 	    case 0x08:
 		// MC110
@@ -253,12 +205,12 @@ int main(int argc , char *argv[])
 		    case 0xbf:
 			// UBAErrorMessage
 			// model type byte 5, err1 byte 9, err2 byte 10, err3 byte 11, errdec byte 12/13
-			emsPtr->model = buff[5];
-			emsPtr->error1 = buff[9];
-			emsPtr->error2 = buff[10];
-			emsPtr->error3 = buff[11];
+			fieldSetInt(F_MODEL, buff[5], stamp);
+			fieldSetInt(F_ERROR1, buff[9], stamp);
+			fieldSetInt(F_ERROR2, buff[10], stamp);
+			fieldSetInt(F_ERROR3, buff[11], stamp);
 			intval = (int)(256 * buff[12] + buff[13]);
-			emsPtr->errorCode = intval;
+			fieldSetInt(F_ERRORCODE, intval, stamp);
 			sprintf(message2, " model %02x, errcode %02x %02x %02x, status %d",
 				buff[5], buff[9], buff[10], buff[11], intval);
 			snprintf(message, MAXPATH - strlen(message2),
@@ -268,10 +220,11 @@ int main(int argc , char *argv[])
 		    case 0xd1:
 			// UBAOutdoorTempMessage
 			// outdoor temp at byte 4/5 [0.1°C]
-			intval = (int)(256 * buff[4] + buff[5]);
-			temp = (float)intval / 10.0;
-			emsPtr->tempOutside = temp;
-			sprintf(message2, " outdoor %2.1f °C", temp);
+			intval = INT16(buff[4], buff[5]);
+			if (intval != NOSENSOR)
+			    fieldSetInt(F_TEMPOUTSIDE, intval, stamp);
+			fmtFixed(intval, 1, t1);
+			sprintf(message2, " outdoor %s °C", t1);
 			snprintf(message, MAXPATH - strlen(message2),
 				 " from MC110: UBAOutdoorTempMessage, %s", message2);
 			if (Debug)
@@ -280,11 +233,11 @@ int main(int argc , char *argv[])
 		    case 0xe3:
 			// unknown message
 			//Boiler temp at byte 15/16 [0.1°C], power byte 17 [%]
-			intval = (int)(256 * buff[15] + buff[16]);
-			temp = (float)intval / 10.0;
+			intval = INT16(buff[15], buff[16]);
+			fmtFixed(intval, 1, t1);
 			power = (int)buff[17];
-			sprintf(message2, " boiler %2.1f °C, power %d %%",
-				temp, power);
+			sprintf(message2, " boiler %s °C, power %d %%",
+				t1, power);
 			snprintf(message, MAXPATH - strlen(message2),
 				 " from MC110: unknown type e3, %s", message2);
 			if (Debug)
@@ -294,33 +247,33 @@ int main(int argc , char *argv[])
 			// UBAMonitorFast
 			if (buff[3] == 0x0) {
 			    // boiler temp at byte 11/12 [0.1°C], power byte 14 [%], code byte 15
-			    emsPtr->setTemperature = (float)buff[10];
-			    intval = (int)(256 * buff[11] + buff[12]);
-			    temp = (float)intval / 10.0;
-			    emsPtr->tempBoiler = temp;
+			    fieldSetInt(F_SETTEMPERATURE, (uint8_t)buff[10], stamp);
+			    intval = INT16(buff[11], buff[12]);
+			    if (intval != NOSENSOR)
+				fieldSetInt(F_TEMPBOILER, intval, stamp);
+			    fmtFixed(intval, 1, t1);
 			    power = (int)buff[14];
-			    emsPtr->power = power;
-			    emsPtr->loadingPump = (int)(buff[15] & 0x4); // bit 2
-			    emsPtr->ubaCode = buff[15];
-			    intval = (int)(256 * buff[23] + buff[24]);
-			    current = (float)intval / 10.0;
-			    emsPtr->current = current;
-			    sprintf(message2, " boiler %2.1f °C, power %d %%, current %2.1f µA", temp, power, current);
+			    fieldSetInt(F_POWER, power, stamp);
+			    fieldSetInt(F_LOADINGPUMP, (int)(buff[15] & 0x4), stamp); // bit 2
+			    fieldSetInt(F_UBACODE, buff[15], stamp);
+			    intval = INT16(buff[23], buff[24]);
+			    fieldSetInt(F_CURRENT, intval, stamp);
+			    fmtFixed(intval, 1, t2);
+			    sprintf(message2, " boiler %s °C, power %d %%, current %s µA", t1, power, t2);
 			    snprintf(message, MAXPATH - strlen(message2),
 				     " from MC110: UBAMonitorFast, %s", message2);
-			    liveSign = emsPtr->heartbeatDecode % 600; 
+			    liveSign = emsPtr->proc[PROC_DECODE].heartbeat % 600; 
 			    if (Debug || (liveSign == 0))
 				LOGIT(message);
 			} else if (buff[3] == 0x1b) {
 			    // exhaust temp at byte 8/9 [0.1°C], intake at byte 4/5 ?
-			    intval = (int)(256 * buff[8] + buff[9]);
-			    temp = (float)intval / 10.0;
-			    if (temp < 200.0)
-				emsPtr->tempExhaust = temp;
-			    intval = (int)(256 * buff[4] + buff[5]);
-			    temp = (float)intval / 10.0;
-			    sprintf(message2, " exhaust temp %2.1f °C, intake %2.1f °C",
-				    emsPtr->tempExhaust, temp);
+			    intval = INT16(buff[8], buff[9]);
+			    if (intval != NOSENSOR && intval < 2000)
+				fieldSetInt(F_TEMPEXHAUST, intval, stamp);
+			    fmtFixed(fieldInt(F_TEMPEXHAUST), 1, t1);
+			    intval = INT16(buff[4], buff[5]);
+			    fmtFixed(intval, 1, t2);
+			    sprintf(message2, " exhaust temp %s °C, intake %s °C", t1, t2);
 			    snprintf(message, MAXPATH - strlen(message2),
 				     " from MC110: UBAMonitorFast, %s", message2);
 			    if (Debug)
@@ -335,36 +288,36 @@ int main(int argc , char *argv[])
 			if (starts == 0 || starts > 1000000) {
 			    // do nothing
 			} else {
-			    emsPtr->starts = starts;
+			    fieldSetInt(F_STARTS, starts, stamp);
 			}
 			opTime = (long int)(256 * 256 * (unsigned char)buff[15] + 256 * (unsigned char)buff[16] + (unsigned char)buff[17]);
 			if (opTime == 0 || opTime == 15361 || opTime > 600000 || opTime < 10) {
 			    // do nothing
 			} else {
-			    emsPtr->opTime = opTime;
 			    if (OpTime == 0) {
 				// set it for first time
 				OpTime = opTime;
 			    }
 			    else {
-				// check plausibility
+				// check plausibility, keep the last value on jumps
 				if (opTime > OpTime + 100 || opTime + 100 < OpTime) {
-				    emsPtr->opTime = OpTime;
+				    // do nothing
 				}
 				else /* if (opTime < OpTime - 100)*/ {
 				    OpTime = opTime;
 				}
 			    }
+			    fieldSetInt(F_OPTIME, OpTime, stamp);
 			}
-			emsPtr->status = buff[4];
-			emsPtr->burner = buff[4] & 0x04;
-			emsPtr->blower = buff[4] & 0x02;
-			emsPtr->circPump = buff[4] & 0x80; // bit 7
-			emsPtr->pump = buff[4] & 0x20; // bit 5
+			fieldSetInt(F_STATUS, buff[4], stamp);
+			fieldSetInt(F_BURNER, buff[4] & 0x04, stamp);
+			fieldSetInt(F_BLOWER, buff[4] & 0x02, stamp);
+			fieldSetInt(F_CIRCPUMP, buff[4] & 0x80, stamp); // bit 7
+			fieldSetInt(F_PUMP, buff[4] & 0x20, stamp); // bit 5
 			sprintf(message2,
 				" starts %ld, op.time %ld h %ld m, status byte %02x, burner %d, circ %d, pump %d",
 				starts, opTime / 60, opTime % 60,
-				emsPtr->status, emsPtr->burner, emsPtr->circPump, emsPtr->pump);
+				buff[4], buff[4] & 0x04, buff[4] & 0x80, buff[4] & 0x20);
 			snprintf(message, MAXPATH - strlen(message2), " from MC110: UBAMonitorSlow, %s", message2);
 			if (Debug)
 			    LOGIT(message);
@@ -372,16 +325,17 @@ int main(int argc , char *argv[])
 		    case EMS_TYPE_UBAMonitorWater:
 			// UBA Monitor Hot Water
 			// water temp at byte 5/6 [0.1°C], set value water at byte 4 [°C], loading pump at byte 17.2
-			intval = (int)(256 * buff[5] + buff[6]);
-			temp = (float)intval / 10.0;
-			emsPtr->tempWater = temp;
-			setWater = (int)buff[4];
-			emsPtr->setWaterTemp = (float)setWater;
-			emsPtr->circPump = buff[17] & 0x4; // bit 2
-			emsPtr->circState1 = buff[16];
-			emsPtr->circState2 = buff[17];
-			sprintf(message2, " warm water temp %2.1f °C, set temp is %d °C, circ %s, %02x %02x",
-				temp, setWater, emsPtr->circPump ? "on" : "off", buff[16], buff[17]);
+			intval = INT16(buff[5], buff[6]);
+			if (intval != NOSENSOR)
+			    fieldSetInt(F_TEMPWATER, intval, stamp);
+			fmtFixed(intval, 1, t1);
+			setWater = (uint8_t)buff[4];
+			fieldSetInt(F_SETWATERTEMP, setWater, stamp);
+			fieldSetInt(F_CIRCPUMP, buff[17] & 0x4, stamp); // bit 2
+			fieldSetInt(F_CIRCSTATE1, buff[16], stamp);
+			fieldSetInt(F_CIRCSTATE2, buff[17], stamp);
+			sprintf(message2, " warm water temp %s °C, set temp is %d °C, circ %s, %02x %02x",
+				t1, setWater, (buff[17] & 0x4) ? "on" : "off", buff[16], buff[17]);
 			snprintf(message, MAXPATH - strlen(message2), " from MC110: UBA Monitor Hot Water, %s", message2);
 			if (Debug)
 			    LOGIT(message);
@@ -393,15 +347,15 @@ int main(int argc , char *argv[])
 			    case 0xe4:
 				sprintf(message, " from MC110: ?_UBA Status (%02x) ems+ (%d bytes): ",
 					buff[5], len);
-				emsPtr->code1 = buff[9];
-				emsPtr->code2 =	buff[10];
+				fieldSetInt(F_CODE1, buff[9], stamp);
+				fieldSetInt(F_CODE2, buff[10], stamp);
 				if (buff[13] > 0) {
-				    emsPtr->setTemperature = (float)buff[13];
-				    sprintf(message2, "set temp = %2.1f, ", emsPtr->setTemperature);
+				    fieldSetInt(F_SETTEMPERATURE, (uint8_t)buff[13], stamp);
+				    sprintf(message2, "set temp = %d, ", fieldInt(F_SETTEMPERATURE));
 				}
 				if (buff[15] > 0) {
-				    emsPtr->setTemperature = (float)buff[15];
-				    sprintf(message2, "set temp = %2.1f, ", emsPtr->setTemperature);
+				    fieldSetInt(F_SETTEMPERATURE, (uint8_t)buff[15], stamp);
+				    sprintf(message2, "set temp = %d, ", fieldInt(F_SETTEMPERATURE));
 				}
 				strcat(message, message2);
 				sprintf(message2, " %02x %02x", buff[9], buff[10]);
@@ -410,6 +364,7 @@ int main(int argc , char *argv[])
 				    LOGIT(message);
 				break;
 			    default:
+				emsPtr->stat.decode.undecoded++;
 				sprintf(message, " from MC110, undecoded message: (%02x) ems+ (%d bytes), ",
 					buff[5], len);
 				for (i = 0; i < len; i++) {
@@ -422,6 +377,7 @@ int main(int argc , char *argv[])
 			}
 			break;
 		    default:
+			emsPtr->stat.decode.undecoded++;
 			sprintf(message, " from MC110, undecoded message: (%02x) ems (%d bytes), ",
 				buff[2], len);
 			for (i = 0; i < len; i++) {
@@ -438,6 +394,7 @@ int main(int argc , char *argv[])
 		    switch (buff[2]) {
 		    default:
 			// wtf
+			emsPtr->stat.decode.undecoded++;
 			sprintf(message, " from MC110, to us (0x0b), undecoded message: (%02x) ems (%d bytes), ",
 				buff[2], len);
 			for (i = 0; i < len; i++) {
@@ -464,6 +421,7 @@ int main(int argc , char *argv[])
 			break;
 			
 		    default:
+			emsPtr->stat.decode.undecoded++;
 			sprintf(message, " from MC110 to RC310, undecoded message (%02x), %d bytes: ",
 				buff[2], len);
 			for (i = 0; i < len; i++) {
@@ -476,6 +434,7 @@ int main(int argc , char *argv[])
 		    break;
 			    
 		default:
+		    emsPtr->stat.decode.undecoded++;
 		    sprintf(message, " from MC110 to (%02x), undecoded message: (%02x), %d bytes: ",
 			    buff[1], buff[2], len);
 		    for (i = 0; i < len; i++) {
@@ -532,10 +491,11 @@ int main(int argc , char *argv[])
 			switch(buff[5]) {
 			case 0xa5:
 			    // indoor temp at byte 6/7 [0.1°C]
-			    intval = (int)(256 * buff[6] + buff[7]);
-			    temp = (float)intval / 10.0;
-			    emsPtr->tempInside = temp;
-			    sprintf(message2, "indoor temp %0.2f", temp);
+			    intval = INT16(buff[6], buff[7]);
+			    if (intval != NOSENSOR)
+				fieldSetInt(F_TEMPINSIDE, intval, stamp);
+			    fmtFixed(intval, 1, t1);
+			    sprintf(message2, "indoor temp %s", t1);
 			    snprintf(message, MAXPATH - strlen(message2),
 				     " from RC310: (ems+)RC310-Heizkreise (%02x): %s",
 				     buff[5], message2);
@@ -543,6 +503,7 @@ int main(int argc , char *argv[])
 				LOGIT(message);
 			    break;
 			default:
+			    emsPtr->stat.decode.undecoded++;
 			    sprintf(message, " from RC310: undecoded message (%02x) ems+ (%d bytes): ",
 				    buff[5], len);
 			    for (i = 0; i < len; i++) {
@@ -556,6 +517,7 @@ int main(int argc , char *argv[])
 		    break;
 		    
 		default:
+		    emsPtr->stat.decode.undecoded++;
 		    sprintf(message, " from RC310: undecoded message (%02x) %d bytes: ",
 			    buff[2], len);
 		    for (i = 0; i < len; i++) {
@@ -567,6 +529,7 @@ int main(int argc , char *argv[])
 		}
 		break;    
 	    default:
+		emsPtr->stat.decode.undecoded++;
 		sprintf(message, " from (%02x): undecoded message (%02x) %d bytes: ",
 			buff[0], buff[2], len);
 		for (i = 0; i < len; i++) {
@@ -576,6 +539,7 @@ int main(int argc , char *argv[])
 		LOGERR(message);
 		break;
 	    }  // sender
+	    fieldTelegramEnd();
 	}  // did receive message
 
     } // for (;;)
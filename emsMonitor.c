@@ -23,10 +23,18 @@ int main(int argc, char *argv[]) {
     key_t key = SHMKEY;
     int shmid, i, j, loopB = 0, loopC = 0, loopW = 0, *ivalue, length;
     char *data, message[MAXPATH], message2[MAXPATH], localTime[MAXPATH], buff[16], name[MAXNAME];
+    char value[MAXNAME];
+    struct emsField field;
     char *active[] = {"|", "/", "-", "\\", "|", "/", "-", "\\", "0"};
     time_t t, ct, delta, currentTime;
     struct tm *tm;
-    int tempSens, cycles, interval, config = 0;
+    int tempSens, cycles, interval, config = 0, aggView = 0, trendView = 0;
+    struct aggResult agg;
+    struct histSample hist[60];
+    int32_t lo, hi;
+    int k, n;
+    char *bar[] = {"▁", "▂", "▃", "▄", "▅", "▆", "▇", "█"};
+    char t1[16], t2[16], t3[16], t4[16];
     static struct termios oldt, newt;
     struct termios orig_term, raw_term;
 
@@ -60,15 +68,11 @@ int main(int argc, char *argv[]) {
     }
     
     // getting already existing shared memory...
-    shmid = shmget(key, sizeof(ems), 0);
-
-    if (shmid < 0) {
-        fprintf(stderr, "emsMonitor: shmget returned %d, could not get shared memory, error %s, errno = %d", shmid, strerror(errno), errno);
-        exit(errno);
-    }
-    else {
-        emsPtr = shmat(shmid, NULL, 0);  // <- this NULL is discussable - the size could be wrong...
-        printf("emsMonitor: attached shared memory, shmid = %d\n", shmid);
+    sprintf(DaemonName, "emsMonitor");
+    res = shmAttach(key, false);
+    if (res != SHM_OK) {
+        fprintf(stderr, "emsMonitor: could not attach shared memory (%d), is emsDecode running?\n", res);
+        exit(1);
     }
 
     // Get terminal settings and save a copy for later
@@ -96,7 +100,7 @@ int main(int argc, char *argv[]) {
 	printf("│ emsMonitor %s │\n", SVN);
 	printf("└────────────%.*s┘\n", length, hLine);
         printf("status of ems: %02x (%02x %02x), model: %d \n",
-               emsPtr->status, emsPtr->code1, emsPtr->code2, emsPtr->model);
+               fieldInt(F_STATUS), fieldInt(F_CODE1), fieldInt(F_CODE2), fieldInt(F_MODEL));
 
         // get current time
         ct = time(NULL);
@@ -106,23 +110,27 @@ int main(int argc, char *argv[]) {
         fputs(message, stdout);
 	
         // get time(s) of heartbeats of processes
-        t = (time_t)emsPtr->heartbeatDecode;
+        t = (time_t)emsPtr->proc[PROC_DECODE].heartbeat;
         printf("offsets: decode %ds, ", (int)(ct - t));
-        t = (time_t)emsPtr->heartbeatSerio;
+        t = (time_t)emsPtr->proc[PROC_SERIO].heartbeat;
         printf("serio %ds, ", (int)(ct - t));
-        t = (time_t)emsPtr->heartbeatMsb;
+        t = (time_t)emsPtr->proc[PROC_DB].heartbeat;
+        printf("db %ds, ", (int)(ct - t));
+        t = (time_t)emsPtr->proc[PROC_MSB].heartbeat;
         printf("msb %ds, ", (int)(ct - t));
-        t = (time_t)emsPtr->heartbeatMqtt;
-        printf("mqtt %ds \n", (int)(ct - t));
+        t = (time_t)emsPtr->proc[PROC_MQTT].heartbeat;
+        printf("mqtt %ds, ", (int)(ct - t));
+        t = (time_t)emsPtr->proc[PROC_PUB].heartbeat;
+        printf("pub %ds \n", (int)(ct - t));
 
 	//printf("───────────────────────────\n");
 	
         // show actual values or configuration
         if (!config) {
 	    // check for name of system
-	    sprintf(name, "unknown system %1$d (%1$#x)", emsPtr->model);
+	    sprintf(name, "unknown system %1$d (%1$#x)", fieldInt(F_MODEL));
 	    for (i = 0; i < (int)sizeof(emsDev); i++) {
-		if (emsDev[i].code == emsPtr->model) {
+		if (emsDev[i].code == fieldInt(F_MODEL)) {
 		    strcpy(name, emsDev[i].name);
 		    break;
 		}
@@ -131,22 +139,61 @@ int main(int argc, char *argv[]) {
 	    printf("┌%.*s┐\n", length, hLine);
 	    printf("│%s│\n", name);
 	    printf("└%.*s┘\n", length, hLine);
-            printf("nominal temps, boiler: %02.1f °C, water: %02.1f °C\n",
-                   emsPtr->setTemperature, emsPtr->setWaterTemp);
+	    // last hour of the fixed point fields from the 1 min history tier
+	    if (trendView) {
+		for (i = 0; i < (int)emsPtr->reg.nFields; i++) {
+		    if (fieldRead(i, &field) < 0 || field.type != FT_FIXED)
+			continue;
+		    if ((n = histRead(i, HT_1MIN, hist, 60)) <= 0)
+			continue;
+		    for (k = 0, lo = hist[0].min, hi = hist[0].max; k < n; k++) {
+			if (hist[k].min < lo)
+			    lo = hist[k].min;
+			if (hist[k].max > hi)
+			    hi = hist[k].max;
+		    }
+		    fmtFixed(lo, field.scale, t1);
+		    fmtFixed(hi, field.scale, t2);
+		    printf("%-16s %6s ", field.name, t1);
+		    for (k = 0; k < n; k++)
+			fputs(bar[hi > lo ? (int)((int64_t)(hist[k].mean - lo) * 7 / (hi - lo)) : 0], stdout);
+		    printf(" %s %s\n", t2, field.unit);
+		}
+	    }
+	    // rolling window aggregates of the fixed point fields
+	    else if (aggView) {
+		printf("%-16s %6s %8s %8s %8s %10s\n", "field", "window", "mean", "min", "max", "slope/h");
+		for (i = 0; i < (int)emsPtr->reg.nFields; i++) {
+		    if (fieldRead(i, &field) < 0 || field.type != FT_FIXED)
+			continue;
+		    for (j = W1MIN; j <= W15MIN; j++) {
+			if (j == W10MIN || aggRead(i, j, ct, &agg) <= 0)
+			    continue;
+			fmtFixed(agg.mean, field.scale, t1);
+			fmtFixed(agg.min, field.scale, t2);
+			fmtFixed(agg.max, field.scale, t3);
+			fmtFixed(agg.slope, field.scale, t4);
+			printf("%-16s %5ds %8s %8s %8s %10s\n",
+			       j == W1MIN ? field.name : "", agg.window, t1, t2, t3, t4);
+		    }
+		}
+	    }
+	    // all fields of the registry, three per line
+	    else for (i = 0, j = 0; i < (int)emsPtr->reg.nFields; i++) {
+		if (fieldRead(i, &field) < 0)
+		    continue;
+		fieldFormat(&field, value);
+		snprintf(message, MAXPATH, "%s: %s %s", field.name, value, field.unit);
+		printf("%-30s%s", message, (++j % 3 == 0) ? "\n" : "");
+	    }
+	    if (!aggView && !trendView && j % 3)
+		printf("\n");
 	    printf("───────────────────────────\n");
-	    printf("boiler: %2.1f °C, water: %2.1f °C, outside: %2.1f °C, inside: %2.1f °C\n",
-		   emsPtr->tempBoiler, emsPtr->tempWater, emsPtr->tempOutside, emsPtr->tempInside);
-	    printf("flame current: %2.1f µA, temp exhaust: %2.1f °C, power: %d %%\n",
-		   emsPtr->current, emsPtr->tempExhaust, emsPtr->power);
-	    printf("operation time %ld h %ld m, starts %ld, average op time %.1f\n",
-		   emsPtr->opTime / 60, emsPtr->opTime % 60, emsPtr->starts,
-		(double)emsPtr->opTime / (double)emsPtr->starts);
-	    printf("pump = %d, boilerState = %d, waterState = %d, loadingPump = %d\n",
-		   emsPtr->pump, emsPtr->boilerState, emsPtr->waterState, emsPtr->loadingPump);
-	    printf("circPump = %d, circState1 = %d, circState2 = %d\n",
-		   emsPtr->circPump, emsPtr->circState1, emsPtr->circState2);
+	    printf("operation time %d h %d m, starts %d, average op time %.1f\n",
+		   fieldInt(F_OPTIME) / 60, fieldInt(F_OPTIME) % 60, fieldInt(F_STARTS),
+		   (double)fieldInt(F_OPTIME) / (double)fieldInt(F_STARTS));
 	    
-            if (emsPtr->power > 0) {
+            if (fieldInt(F_POWER) > 0) {
                 printf("boiler %s ", active[loopB]);
                 loopB++;
                 if (loopB > 7)
@@ -155,7 +202,7 @@ int main(int argc, char *argv[]) {
             else
                 printf("boiler %s ", active[8]);
 	    
-	    if (emsPtr->circPump == 1) {
+	    if (fieldInt(F_CIRCPUMP) == 1) {
                 printf("circ pump %s ", active[loopC]);
                 loopC++;
                 if (loopC > 7)
@@ -164,9 +211,9 @@ int main(int argc, char *argv[]) {
             else
                 printf("circ pump %s ", active[8]);
 	    
-            printf("pump is %s, ", emsPtr->pump ? "on" : "off");
+            printf("pump is %s, ", fieldInt(F_PUMP) ? "on" : "off");
             
-            itoa(emsPtr->status, buff, 2);
+            itoa(fieldInt(F_STATUS), buff, 2);
             printf("\n%s\tR1: %s R2: %s, R3: %s, R4: %s\n",
 		   buff,
                    buff[7] == '1' ? "set" : "off",
@@ -175,21 +222,56 @@ int main(int argc, char *argv[]) {
                    buff[4] == '1' ? "set" : "off"
                    );
 	    printf("msb interval: %d µs\n",
-                   emsPtr->interval);
+                   emsPtr->cfg.interval);
+	    printf("mqtt published %u, suppressed %u, errors %u\n", emsPtr->stat.mqtt.published,
+		   emsPtr->stat.mqtt.suppressed, emsPtr->stat.mqtt.errors);
+	    printf("mqtt cycle cpu %u µs, max %u µs, avg %llu µs\n", emsPtr->stat.mqtt.cycleCpu,
+		   emsPtr->stat.mqtt.maxCpu, emsPtr->stat.mqtt.cycles ?
+		   (unsigned long long)(emsPtr->stat.mqtt.totalCpu / emsPtr->stat.mqtt.cycles) : 0ULL);
+	    printf("msb published %u, cpu per publish %u µs, max %u µs, avg %llu µs\n", emsPtr->stat.msb.published,
+		   emsPtr->stat.msb.cycleCpu, emsPtr->stat.msb.maxCpu, emsPtr->stat.msb.cycles ?
+		   (unsigned long long)(emsPtr->stat.msb.totalCpu / emsPtr->stat.msb.cycles) : 0ULL);
+	    printf("mqtt ticks %u, overruns %u, jitter %u µs, max %u µs, avg %llu µs\n", emsPtr->stat.mqtt.ticks,
+		   emsPtr->stat.mqtt.overruns, emsPtr->stat.mqtt.jitter, emsPtr->stat.mqtt.maxJitter, emsPtr->stat.mqtt.ticks ?
+		   (unsigned long long)(emsPtr->stat.mqtt.totalJitter / emsPtr->stat.mqtt.ticks) : 0ULL);
+	    printf("msb ticks %u, overruns %u, jitter %u µs, max %u µs, avg %llu µs\n", emsPtr->stat.msb.ticks,
+		   emsPtr->stat.msb.overruns, emsPtr->stat.msb.jitter, emsPtr->stat.msb.maxJitter, emsPtr->stat.msb.ticks ?
+		   (unsigned long long)(emsPtr->stat.msb.totalJitter / emsPtr->stat.msb.ticks) : 0ULL);
+	    printf("msb queue %u, max %u, dropped %u, latency %u ms, max %u ms\n", emsPtr->stat.msb.pending,
+		   emsPtr->stat.msb.maxPending, emsPtr->stat.msb.dropped, emsPtr->stat.msb.latency, emsPtr->stat.msb.maxLatency);
+	    for (i = 0; i < SINKMAX && emsPtr->stat.sink[i].name[0]; i++)
+		printf("pub sink %s: queued %u, sent %u, errors %u, dropped %u, waiting %u (max %u), send %u µs (max %u µs)\n",
+		       emsPtr->stat.sink[i].name, emsPtr->stat.sink[i].queued, emsPtr->stat.sink[i].sent,
+		       emsPtr->stat.sink[i].errors, emsPtr->stat.sink[i].dropped, emsPtr->stat.sink[i].pending,
+		       emsPtr->stat.sink[i].maxPending, emsPtr->stat.sink[i].lastSend, emsPtr->stat.sink[i].maxSend);
+	    printf("pub mqtt published %u, errors %u, connects %u, disconnects %u\n",
+		   emsPtr->stat.pubMqtt.published, emsPtr->stat.pubMqtt.errors,
+		   emsPtr->stat.pubMqtt.connects, emsPtr->stat.pubMqtt.disconnects);
+	    printf("influx points %llu, lines %u, batches %u, %llu bytes, retries %u, dropped %u, waiting %u bytes, batch %u µs (max %u µs)\n",
+		   (unsigned long long)emsPtr->stat.influx.points, emsPtr->stat.influx.lines, emsPtr->stat.influx.batches,
+		   (unsigned long long)emsPtr->stat.influx.bytes, emsPtr->stat.influx.retries, emsPtr->stat.influx.dropped,
+		   emsPtr->stat.influx.pending, emsPtr->stat.influx.lastBatch, emsPtr->stat.influx.maxBatch);
+	    printf("mqtt connects %u, disconnects %u, reconnect took %u ms (max %u ms)\n",
+		   emsPtr->stat.mqtt.connects, emsPtr->stat.mqtt.disconnects,
+		   emsPtr->stat.mqtt.lastReconnect, emsPtr->stat.mqtt.maxReconnect);
+	    printf("mqtt commands %u, queued %u, rejected %u, rate limited %u\n", emsPtr->stat.cmd.received,
+		   emsPtr->stat.cmd.queued, emsPtr->stat.cmd.rejected, emsPtr->stat.cmd.limited);
+	    printf("mqtt spool: pending %u, spooled %u, replayed %u, dropped %u\n", emsPtr->stat.mqtt.pending,
+		   emsPtr->stat.mqtt.spooled, emsPtr->stat.mqtt.replayed, emsPtr->stat.mqtt.dropped);
 	}
 	else { // if (!config) - show configuration values
-	    printf("configuration file: %s\n", emsPtr->configFile);
+	    printf("configuration file: %s\n", emsPtr->cfg.configFile);
             printf("mqtt broker: %s, port: %d, tls: %s\n",
-                   emsPtr->broker, emsPtr->port, strlen(emsPtr->cert) > 0 ? "yes" : "no");
-	    printf("receive queue: %s, transmit queue: %s\n", emsPtr->rxqueue, emsPtr->txqueue);
+                   emsPtr->cfg.broker, emsPtr->cfg.port, strlen(emsPtr->cfg.cert) > 0 ? "yes" : "no");
+	    printf("receive queue: %s, transmit queue: %s\n", emsPtr->cfg.rxqueue, emsPtr->cfg.txqueue);
 	    printf("msb url: %s, uuid: %s, token: %s\n",
-                   emsPtr->msbUrl, emsPtr->msbUuid, emsPtr->msbToken);
+                   emsPtr->cfg.msbUrl, emsPtr->cfg.msbUuid, emsPtr->cfg.msbToken);
 
 	}
 	printf("───────────────────────────\n");
 	printf(" press 'q' to quit, 'c' to switch data/configuration, 'd' to increase debug, 'x' to decrease debug level,\n");
 	printf(" 'w' water desinfect, 't' stop desinfect, 's' toggle summer mode\n");
-	printf(" 'p'/'r' to activate/stop circulation pump for warm water\n");
+	printf(" 'p'/'r' to activate/stop circulation pump for warm water, 'a'/'g' toggle aggregates/trends\n");
 	
 	int len = read(STDIN_FILENO, &ch, 1);
 	if (len == 1) {
@@ -217,33 +299,45 @@ int main(int argc, char *argv[]) {
                     config = true;
                 break;
 
+            case 'a':
+            case 'A':
+                aggView = !aggView;
+                trendView = false;
+                break;
+
+            case 'g':
+            case 'G':
+                trendView = !trendView;
+                aggView = false;
+                break;
+
             case 'p':
                 // set circulation pump on
-                emsPtr->circPump = 1;
+                fieldSetInt(F_CIRCPUMP, 1, stampNow());
                 break;
                  
             case 'r':
                 // set circulation pump off
-                emsPtr->circPump = 0;
+                fieldSetInt(F_CIRCPUMP, 0, stampNow());
                 break;
                 
             case 'd':
             case 'D':
-                emsPtr->debug++;
+                emsPtr->ctl.debug++;
                 break;
                 
             case 's':
             case 'S':
-                if (emsPtr->summerMode)
-                    emsPtr->summerMode = false;
+                if (emsPtr->ctl.summerMode)
+                    emsPtr->ctl.summerMode = false;
                 else
-                    emsPtr->summerMode = true;
+                    emsPtr->ctl.summerMode = true;
                 break;
                 
             case 'x':
             case 'X':
-                if (emsPtr->debug > 0)
-                    emsPtr->debug--;
+                if (emsPtr->ctl.debug > 0)
+                    emsPtr->ctl.debug--;
                 break;
 
             default:
@@ -13,14 +13,83 @@
 // forward declarations
 
 int initMosquitto(ems *emsPtr);
-void mqttPublish(ems *emsPtr, char *topic, void *val, int qos, bool retain);
-int getConfig(enum varType, void *var, char *defVal, char *cFile, char *group, char *key);
+int mqttPublish(ems *emsPtr, const char *topic, const void *val, int len, int qos, bool retain);
+int mqttConnected(void);
+void mqttBroker(const char *host, int port);
+int mqttTopic(const char *topic, int qos, bool retain, uint32_t expiry);
+int mqttSend(ems *emsPtr, int id, const void *val, int len);
+void mqttSubscribe(const char *topic, void (*handler)(const char *topic, const void *payload, int len));
+int cmdInit(const char *prefix);
+void cmdMessage(const char *topic, const void *payload, int len);
 void SIGgen_handler_mqtt(int);
+void pubConfig(int first, int n);
+int pubDue(int id, const struct emsField *f, time_t now);
+int topicsInit(int n);
+int topicPolicy(const char *key, const char *topic, int retain);
+void pubSend(int id, const char *val, int len, time_t now);
+void spoolReplay(void);
+void pubReload(struct tick *tick, const struct cfgApplied *applied);
 
 // (module-)global vars
 int LastboilerState;
 time_t LastBoilerOn, LastBoilerOff;
 
+// publish-on-change per topic, from group [DEADBAND] in the config file:
+//   <field>=<deadband>[%][,<max silence in s>]
+// e.g. tempBoiler=0.5 or tempOutside=2%,600. The value is sent when it moved
+// by at least the deadband (absolute in the unit of the field or relative to
+// the last sent value) or when it was not sent for max silence seconds
+// (default: key silence, 300 s). Fields not listed are sent every cycle.
+
+struct pubState {
+    int onChange;       // false: send every cycle
+    int32_t band;       // absolute deadband, raw units of the field
+    int32_t rel;        // relative deadband in 0.01 %
+    int32_t silence;    // s
+    int32_t lastValue;
+    time_t lastSent;    // 0: not sent yet
+};
+
+struct pubState Pub[MAXFIELDS];
+
+// what to publish each cycle, [EMS] mqttmode = topics, json or both:
+// one topic per field and/or one JSON document with all fields on jsontopic
+#define JSONSIZE 4096
+
+int Mode = MQTT_TOPICS;
+char JsonTopic[MAXNAME];
+char Json[JSONSIZE];             // preallocated payload of the JSON mode
+struct emsField Snap[MAXFIELDS];  // snapshot of all fields of this cycle
+
+// topics of the fields, <topicprefix>/<field name> from [EMS] topicprefix,
+// built once so that a cycle does not format any topic
+
+char Prefix[MAXNAME];
+struct topic {
+    char name[2 * MAXNAME];
+    char replay[2 * MAXNAME];  // <topicprefix>/replay/<field name>
+    int len;
+    int id;                    // mqttTopic() id
+} Topics[MAXFIELDS];
+int NTopics;
+int JsonId;
+
+// QoS, retain and message expiry per topic, from group [TOPICS]:
+//   <field>=<qos>[,retain|,noretain][,expiry=<s>]
+// e.g. tempOutside=0,expiry=120 or status=1,retain; the JSON document is
+// key json. Defaults: keys qos (1) and expiry (0, none) and retain as
+// flagged in the field registry.
+
+// store and forward, [EMS] spoolsize in kB (0: off) and spoolrate in
+// messages/s: while the broker is away messages go to <datapath>/mqtt.spool
+// and are replayed in order after reconnect, timestamped and on
+// <topicprefix>/replay/..., before live publishing continues
+#define JSON_ID -1    // pubSend() id of the JSON document
+
+int Spool = false;
+int SpoolRate;
+char JsonReplay[2 * MAXNAME];
+
 #define SVN "$Id: emsMqtt.c 64 2022-11-24 21:45:19Z juh $"
 
 int main (int argc, char** argv) {
@@ -31,12 +100,12 @@ int main (int argc, char** argv) {
     float consumption = 0.0;
     FILE *fp;
     int tries = 0;
-    int i, c, result, second = false;
-    char value[100], topic[500], message[500];
-    unsigned long timeSteps[] = {60, 300, 600, 900 };
-    int loop, j;
-    float average[4][4];
-    char filename[MAXPATH];
+    int i, n, c, len, result, second = false;
+    char value[100], message[500];
+    struct timespec t0;
+    struct tick tick;
+    struct cfgApplied applied = { 0 };
+    int period, phase;
 
     // default: run as daemon
     Daemon = 1;
@@ -87,13 +156,17 @@ int main (int argc, char** argv) {
 	openlog(DaemonName, LOG_CONS | LOG_NDELAY | LOG_PERROR | LOG_PID, LOG_USER);
 	syslog(LOG_INFO, "emsMqtt running as daemon");
     }	
+    // check the config file, an invalid one is fatal
+    if (cfgLoad(CONFIGFILE) < 0)
+	exit(1);
+
     // try to get shared memory, if it already exists...
  retry:
-    ShmId = shmget(key, sizeof(ems), 0);
-    if (ShmId < 0) {
+    result = shmAttach(key, false);
+    if (result == SHM_NOSEG) {
 	sprintf(message,
-		"%s: could not get shared memory, shmid = %d, error %d, %s. Try %d / 30",
-		DaemonName, ShmId, errno, strerror(errno), tries);
+		"%s: could not get shared memory, error %d, %s. Try %d / 30",
+		DaemonName, errno, strerror(errno), tries);
 	LOGERR(message);
 	sleep(10);
 	if (tries++ < 30) // wait for about 5 minutes
@@ -101,36 +174,18 @@ int main (int argc, char** argv) {
 	else
 	    _exit(errno);
     }
-    else {
-	emsPtr = shmat(ShmId, NULL, 0);
-	sprintf(message,
-		"%s: attached shared memory, shmid = %d, ptr = %x",
-		DaemonName, ShmId, (int)emsPtr);
-	LOGIT(message);
-    }
-
-    if (emsPtr != (void *) -1) {
-	// init status vars
-	emsPtr->heartbeatMqtt = time(NULL);
-    } else {
-	sprintf(message,  "%s: could not attach shared memory at line %d, errno = %d (%s)",
-		DaemonName, __LINE__, errno, strerror(errno));
+    else if (result != SHM_OK) {
+	sprintf(message,  "%s: could not attach shared memory at line %d", DaemonName, __LINE__);
 	LOGERR(message);
 	_exit(1);
     }
+    // init status vars
+    emsPtr->proc[PROC_MQTT].heartbeat = time(NULL);
 
     // get broker settings from config file
-    result = getConfig(CHAR, &emsPtr->broker, BROKER, CONFIGFILE, "EMS", "broker");
-    if (result)
-	sprintf(message, "%s: broker not defined, set to default >%s<", DaemonName, BROKER);
-    else
-	sprintf(message, "%s: broker set to >%s< ", DaemonName, emsPtr->broker);
-    LOGIT(message);
-    result = getConfig(INT, &emsPtr->port, "1883", CONFIGFILE, "EMS", "port");
-    if (result)
-	sprintf(message, "%s: port not defined, set to default >%d<", DaemonName, 1883);
-    else
-	sprintf(message, "%s: broker set to >%d< ", DaemonName, emsPtr->port);
+    snprintf(emsPtr->cfg.broker, sizeof(emsPtr->cfg.broker), "%s", Conf->ems.broker);
+    emsPtr->cfg.port = Conf->ems.port;
+    sprintf(message, "%s: broker set to >%s<, port %d", DaemonName, emsPtr->cfg.broker, emsPtr->cfg.port);
     LOGIT(message);
     
     // install signal handler for other signals (USR1, SEGV,...)
@@ -182,7 +237,7 @@ int main (int argc, char** argv) {
 	    _exit(errno);
 	}
 	else {
-	    emsPtr->mqttPid = sid;
+	    emsPtr->proc[PROC_MQTT].pid = sid;
 	}
 	sprintf(message, "%s: running with pid %d", DaemonName, sid);
 	LOGIT(message);
@@ -204,26 +259,64 @@ int main (int argc, char** argv) {
     }
 
     // init state check
-    LastboilerState = emsPtr->boilerState;
+    LastboilerState = fieldInt(F_BOILERSTATE);
+
+    Mode = Conf->ems.mqttmode;
+    snprintf(Prefix, sizeof(Prefix), "%s", Conf->ems.topicprefix);
+    if (Conf->ems.jsontopic[0] != '\0')
+	snprintf(JsonTopic, sizeof(JsonTopic), "%s", Conf->ems.jsontopic);
+    else
+	snprintf(JsonTopic, sizeof(JsonTopic), "%.*s/json", MAXNAME - 6, Prefix);
+    snprintf(JsonReplay, sizeof(JsonReplay), "%s/replay/json", Prefix);
+    topicsInit(emsPtr->reg.nFields);
+    JsonId = topicPolicy("json", JsonTopic, false);
+
+    SpoolRate = Conf->ems.spoolrate;
+    if (Conf->ems.spoolsize > 0) {
+	snprintf(emsPtr->cfg.datapath, sizeof(emsPtr->cfg.datapath), "%s", Conf->ems.datapath);
+	Spool = (spoolOpen(emsPtr->cfg.datapath, Conf->ems.spoolsize) == 0);
+    }
+    sprintf(message, "%s: publishing %s%s%s", DaemonName, (Mode & MQTT_TOPICS) ? "one topic per field" : "",
+	    (Mode == (MQTT_TOPICS | MQTT_JSON)) ? " and " : "", (Mode & MQTT_JSON) ? "JSON on " : "");
+    strcat(message, (Mode & MQTT_JSON) ? JsonTopic : "");
+    LOGIT(message);
+
+    // commands to the bus, [EMS] commands = 1 (see cmd.c)
+    if (Conf->ems.commands) {
+	cmdInit(Prefix);
+	snprintf(message, sizeof(message), "%s/cmd/+/+", Prefix);
+	mqttSubscribe(message, cmdMessage);
+    }
 
     // initialize mqtt
     result = mosquitto_lib_init();
     result = initMosquitto(emsPtr);
 
+    // cycles start at fixed deadlines, so the publishing time does not
+    // add up; aligned, they share their timestamps with emsMsb
+    period = Conf->ems.period;
+    phase = Conf->ems.phase;
+    sprintf(message, "%s: publishing every %d ms, %s %d ms", DaemonName, period,
+	    phase >= 0 ? "aligned to the wall clock +" : "not aligned,", phase);
+    LOGIT(message);
+
     sleep(20);  // let decode process decode something...
+    cfgWatch();
     
+    tickInit(&tick, (int64_t)period * 1000000, phase < 0 ? -1 : (int64_t)phase * 1000000);
     for (;;) {
-	// just to slow down a bit
-	sleep(1);
-
-	// get actual time
-	currentTime = time(NULL);
+	// wait for the next cycle, its deadline is the time of the sample
+	currentTime = tickWait(&tick, &emsPtr->stat.mqtt);
 
 	// tell we're alive
-	emsPtr->heartbeatMqtt = currentTime;
+	emsPtr->proc[PROC_MQTT].heartbeat = currentTime;
+
+	// the config file was changed
+	if (cfgReloaded(&applied))
+	    pubReload(&tick, &applied);
 	
 	// check if ems process is running
-	if (currentTime > emsPtr->heartbeatDecode + 60) {
+	if (currentTime > emsPtr->proc[PROC_DECODE].heartbeat + 60) {
 	    sprintf(message,
 		    "%s: ems decode process did not update his heatbeat for more than 60s, should (but will not) terminate", DaemonName);
 	    LOGERR(message);
@@ -231,9 +324,9 @@ int main (int argc, char** argv) {
 	}
 	
 	// check for boilerState change
-	if (LastboilerState != emsPtr->boilerState) {
+	if (LastboilerState != fieldInt(F_BOILERSTATE)) {
 	    // boilerstate changed
-	    if (emsPtr->boilerState == 1) {
+	    if (fieldInt(F_BOILERSTATE) == 1) {
 		// was off, switched on
 		LastBoilerOn = currentTime;
 	    }
@@ -251,120 +344,205 @@ int main (int argc, char** argv) {
 		    */
 		}
 	    }
-	    LastboilerState = emsPtr->boilerState;
+	    LastboilerState = fieldInt(F_BOILERSTATE);
 	}
 
 	lastTime = currentTime;
 
-	// check if mqtt is available
-	if (!emsPtr->mqttAvail) {
-	    // re-initialize mqtt
+	// mosquitto could not be created at start, try again. Connecting and
+	// reconnecting is done in the background by the mqtt thread.
+	if (!emsPtr->proc[PROC_MQTT].avail) {
 	    result = initMosquitto(emsPtr);
-	    sprintf(message, "%s: re-initialzed mosquitto, result %d", DaemonName, result);
+	    sprintf(message, "%s: re-initialized mosquitto, result %d", DaemonName, result);
 	    LOGERR(message);
 	}
 
-	// publish status to mqtt server
-	sprintf(value, "%d", emsPtr->status);
-	sprintf(topic, "ems/status");
-	mqttPublish(emsPtr, topic, value, 1, true);
-
 	/*
 	// if duration > 0, we should send a new operation interval
 	if (duration > 0) {
 	    sprintf(value, "%.2f", consumption);
 	    sprintf(topic, "ems/consumption");
-	    mqttPublish(emsPtr, topic, value, 1, false);
+	    mqttPublish(emsPtr, topic, value, strlen(value), 1, false);
 	    sprintf(value, "%d", duration);
 	    sprintf(topic, "ems/duration");
-	    mqttPublish(emsPtr, topic, value, 1, false);
+	    mqttPublish(emsPtr, topic, value, strlen(value), 1, false);
 	    // and clear duration again
 	    duration = 0;
 	    }*/
-	
-	sprintf(value, "%d", emsPtr->boilerState);
-	mqttPublish(emsPtr, "ems/boilerState", value, 1, false);
-
-	sprintf(value, "%d", emsPtr->waterState);
-	mqttPublish(emsPtr, "ems/waterState", value, 1, false);
-		
-	sprintf(value, "%d", emsPtr->pump);
-	mqttPublish(emsPtr, "ems/pump", value, 1, false);
-	
-	sprintf(value, "%d", emsPtr->circPump);
-	mqttPublish(emsPtr, "ems/circPump", value, 1, false);
-	
-	sprintf(value, "%d", emsPtr->circState1);
-	mqttPublish(emsPtr, "ems/circState1", value, 1, false);
-	
-	sprintf(value, "%d", emsPtr->circState2);
-	mqttPublish(emsPtr, "ems/circState2", value, 1, false);
-
-	sprintf(value, "%d", emsPtr->code1);
-	mqttPublish(emsPtr, "ems/code1", value, 1, false);
-		
-	sprintf(value, "%d", emsPtr->code2);
-	mqttPublish(emsPtr, "ems/code2", value, 1, false);
-		
-	sprintf(value, "%d", emsPtr->model);
-	mqttPublish(emsPtr, "ems/model", value, 1, false);
-		
-	sprintf(value, "%d", emsPtr->error1);
-	mqttPublish(emsPtr, "ems/error1", value, 1, false);
-		
-	sprintf(value, "%d", emsPtr->error2);
-	mqttPublish(emsPtr, "ems/error2", value, 1, false);
-		
-	sprintf(value, "%d", emsPtr->error3);
-	mqttPublish(emsPtr, "ems/error3", value, 1, false);
-		
-	sprintf(value, "%d", emsPtr->errorCode);
-	mqttPublish(emsPtr, "ems/errorCode", value, 1, false);
-		
-	sprintf(value, "%d", emsPtr->ubaCode);
-	mqttPublish(emsPtr, "ems/ubaCode", value, 1, false);
-		
-	sprintf(value, "%d", emsPtr->burnerCode);
-	mqttPublish(emsPtr, "ems/burnerCode", value, 1, false);
-		
-	sprintf(value, "%d", emsPtr->loadingPump);
-	mqttPublish(emsPtr, "ems/loadingPump", value, 1, false);
-	
-	sprintf(value, "%d", emsPtr->power);
-	mqttPublish(emsPtr, "ems/power", value, 1, false);
-	
-	sprintf(value, "%ld", emsPtr->starts);
-	mqttPublish(emsPtr, "ems/starts", value, 1, false);
-	
-	sprintf(value, "%ld", emsPtr->opTime);
-	mqttPublish(emsPtr, "ems/opTime", value, 1, false);
-	
-	sprintf(value, "%.2f", emsPtr->setWaterTemp);
-	mqttPublish(emsPtr, "ems/setWaterTemp", value, 1, false);
-	
-	sprintf(value, "%.2f", emsPtr->setTemperature);
-	mqttPublish(emsPtr, "ems/setTemperature", value, 1, false);
-	
-	sprintf(value, "%.2f", emsPtr->tempBoiler);
-	mqttPublish(emsPtr, "ems/tempBoiler", value, 1, false);
 
-	sprintf(value, "%.2f", emsPtr->tempExhaust);
-	mqttPublish(emsPtr, "ems/tempExhaust", value, 1, false);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
 
-    	sprintf(value, "%.2f", emsPtr->tempWater);
-	mqttPublish(emsPtr, "ems/tempWater", value, 1, false);
+	// the backlog of an outage first
+	if (Spool)
+	    spoolReplay();
 
-    	sprintf(value, "%.2f", emsPtr->tempOutside);
-	mqttPublish(emsPtr, "ems/tempOutside", value, 1, false);
-	
-    	sprintf(value, "%.2f", emsPtr->tempInside);
-	mqttPublish(emsPtr, "ems/tempInside", value, 1, false);
+	// one consistent copy of all fields for this cycle
+	n = snapTake(Snap);
+	if (n > NTopics)
+	    topicsInit(n);   // emsDecode registered new fields
+
+	// all fields in one message
+	if (Mode & MQTT_JSON) {
+	    if ((len = snapJson(Snap, n, currentTime, Json, JSONSIZE)) < 0) {
+		sprintf(message, "%s: JSON document larger than %d bytes, not sent", DaemonName, JSONSIZE);
+		LOGERR(message);
+	    }
+	    else
+		pubSend(JSON_ID, Json, len, currentTime);
+	}
+
+	// publish all fields of the registry to mqtt server
+	for (i = 0; (Mode & MQTT_TOPICS) && i < n; i++) {
+	    if (!pubDue(i, &Snap[i], currentTime)) {
+		emsPtr->stat.mqtt.suppressed++;
+		continue;
+	    }
+	    len = fieldFormat(&Snap[i], value);
+	    pubSend(i, value, len, currentTime);
+	}
+
+	if (Spool) {
+	    emsPtr->stat.mqtt.pending = spoolPending();
+	    spoolSync();
+	}
+	pubCpu(&emsPtr->stat.mqtt, &t0);
+    }
+}
+
+// <prefix>/<name> and the deadband for the first n fields of the registry,
+// only fields added since the last call are registered
+int topicsInit(int n) {
+    struct emsField field;
+    int i, first = NTopics;
+
+    for (i = NTopics; i < n && i < MAXFIELDS; i++) {
+	if (fieldRead(i, &field) < 0) {
+	    field.name[0] = '\0';
+	    field.flags = 0;
+	}
+	Topics[i].len = snprintf(Topics[i].name, sizeof(Topics[i].name), "%s/%s", Prefix, field.name);
+	snprintf(Topics[i].replay, sizeof(Topics[i].replay), "%s/replay/%s", Prefix, field.name);
+	Topics[i].id = topicPolicy(field.name, Topics[i].name, field.flags & FF_RETAIN);
+    }
+    NTopics = i;
+    if (i > first)
+	pubConfig(first, i);
+    return (i);
+}
+
+// publish field id (or the JSON document) live, or put it into the spool
+// while the broker is away or older messages still wait there
+void pubSend(int id, const char *val, int len, time_t now) {
+    char buff[200];
+
+    if (!Spool || (mqttConnected() && spoolPending() == 0)) {
+	if (mqttSend(emsPtr, (id == JSON_ID) ? JsonId : Topics[id].id, val, len) != MOSQ_ERR_NO_CONN || !Spool)
+	    return;
+    }
+    if (id == JSON_ID)
+	spoolAdd(JsonReplay, val, len, stampNow());
+    else {
+	len = snprintf(buff, sizeof(buff), "{\"time\":%lld,\"value\":%.*s}", (long long)now, len, val);
+	spoolAdd(Topics[id].replay, buff, len, stampNow());
+    }
+}
 
-    	sprintf(value, "%.2f", emsPtr->current);
-	mqttPublish(emsPtr, "ems/current", value, 1, false);
+// send the spooled messages of one cycle, SpoolRate per second of [EMS]
+// period but at least one
+void spoolReplay(void) {
+    const char *topic;
+    const void *payload;
+    int64_t stamp, n;
+    int i, len;
+
+    n = (int64_t)SpoolRate * Conf->ems.period / 1000;
+    if (n < 1)
+	n = 1;
+    for (i = 0; i < n && mqttConnected(); i++) {
+	if ((len = spoolPeek(&topic, &payload, &stamp)) < 0
+	    || mqttPublish(emsPtr, topic, payload, len, 1, false) != MOSQ_ERR_SUCCESS)
+	    break;
+	spoolDone();
     }
 }
 
+// read the deadbands of the fields first to n - 1 of the registry, with
+// topicsInit() for new fields and for all of them on reload
+void pubConfig(int first, int n) {
+    char message[MAXPATH], *p;
+    const char *v;
+    struct emsField field;
+    int32_t silence = Conf->deadband.silence, scale;
+    double band;
+    int i, changing = 0;
+
+    // keep the last values sent
+    for (i = first; i < n; i++) {
+	Pub[i].onChange = false;
+	Pub[i].band = Pub[i].rel = 0;
+	if (fieldRead(i, &field) < 0 || (v = cfgGet("DEADBAND", field.name)) == NULL)
+	    continue;
+	Pub[i].onChange = true;
+	Pub[i].silence = silence;
+	band = strtod(v, &p);
+	if (*p == '%') {
+	    Pub[i].rel = (int32_t)(band * 100.0 + 0.5);
+	    p++;
+	}
+	else {
+	    for (scale = (field.type == FT_FIXED) ? field.scale : 0; scale > 0; scale--)
+		band *= 10.0;
+	    Pub[i].band = (int32_t)(band + 0.5);
+	}
+	if (*p == ',' && atoi(p + 1) > 0)
+	    Pub[i].silence = atoi(p + 1);
+	changing++;
+	sprintf(message, "%s: %s on change, deadband %s, max silence %d s", DaemonName,
+		field.name, v, Pub[i].silence);
+	LOGIT(message);
+    }
+    sprintf(message, "%s: %d of %d topics on change, the others every cycle", DaemonName,
+	    changing, n - first);
+    LOGIT(message);
+}
+
+// apply the settings that can change while running
+void pubReload(struct tick *tick, const struct cfgApplied *applied) {
+    const struct conf *c = Conf;
+    char message[MAXPATH];
+    int period = c->ems.period, phase = c->ems.phase;
+
+    if (cfgChanged(applied, "EMS", "broker") || cfgChanged(applied, "EMS", "port"))
+	mqttBroker(c->ems.broker, c->ems.port);
+    if (cfgChanged(applied, "EMS", "period") || cfgChanged(applied, "EMS", "phase")) {
+	tickInit(tick, (int64_t)period * 1000000, phase < 0 ? -1 : (int64_t)phase * 1000000);
+	sprintf(message, "%s: publishing every %d ms from now on, %s %d ms", DaemonName, period,
+		phase >= 0 ? "aligned to the wall clock +" : "not aligned,", phase);
+	LOGIT(message);
+    }
+    SpoolRate = c->ems.spoolrate;
+    if (cfgChanged(applied, "DEADBAND", NULL))
+	pubConfig(0, NTopics);
+}
+
+// is field id to be sent now? Remembers the value if so.
+int pubDue(int id, const struct emsField *f, time_t now) {
+    struct pubState *p = &Pub[id];
+    int64_t d;
+
+    if (!p->onChange)
+	return (true);
+    d = (int64_t)f->value - p->lastValue;
+    if (d < 0)
+	d = -d;
+    if (p->lastSent != 0 && now - p->lastSent < p->silence
+	&& (d == 0 || d < p->band || d * 10000 < (int64_t)p->rel * llabs(p->lastValue)))
+	return (false);
+    p->lastValue = f->value;
+    p->lastSent = now;
+    return (true);
+}
+
 void  SIGgen_handler_mqtt(int sig)
 {
     //signal(sig, SIG_IGN);
@@ -12,9 +12,9 @@
 
 // forward declarations
 
+int msbConfig(ems *emsPtr);
 int initMsb(ems *emsPtr);
 int msb(ems *emsPtr);
-int getConfig(enum varType, void *var, char *defVal, char *cFile, char *group, char *key);
 void SIGgen_handler_msb(int);
 extern int usleep (__useconds_t __useconds);
 
@@ -34,10 +34,10 @@ int main (int argc, char** argv) {
     int tries = 0;
     int i, c, result, second = false;
     char value[100], topic[500], message[500];
-    unsigned long timeSteps[] = {60, 300, 600, 900 };
-    int loop, j;
-    float average[4][4];
     char filename[MAXPATH];
+    struct tick tick;
+    struct cfgApplied applied = { 0 };
+    int phase;
 
     // default: run as daemon
     Daemon = 1;
@@ -88,13 +88,17 @@ int main (int argc, char** argv) {
 	openlog(DaemonName, LOG_CONS | LOG_NDELAY | LOG_PERROR | LOG_PID, LOG_USER);
 	syslog(LOG_INFO, "emsMsb running as daemon");
     }	
+    // check the config file, an invalid one is fatal
+    if (cfgLoad(CONFIGFILE) < 0)
+	exit(1);
+
     // try to get shared memory, if it already exists...
  retry:
-    ShmId = shmget(key, sizeof(ems), 0);
-    if (ShmId < 0) {
+    result = shmAttach(key, false);
+    if (result == SHM_NOSEG) {
 	sprintf(message,
-		"%s: could not get shared memory, shmid = %d, error %d, %s. Try %d / 30",
-		DaemonName, ShmId, errno, strerror(errno), tries);
+		"%s: could not get shared memory, error %d, %s. Try %d / 30",
+		DaemonName, errno, strerror(errno), tries);
 	LOGERR(message);
 	sleep(10);
 	if (tries++ < 30) // wait for about 5 minutes
@@ -102,79 +106,18 @@ int main (int argc, char** argv) {
 	else
 	    _exit(errno);
     }
-    else {
-	emsPtr = shmat(ShmId, NULL, 0);
-	sprintf(message,
-		"%s: attached shared memory, shmid = %d, ptr = %x",
-		DaemonName, ShmId, (int)emsPtr);
-	LOGIT(message);
-    }
-
-    if (emsPtr != (void *) -1) {
-	// init status vars
-	emsPtr->heartbeatMsb = time(NULL);
-    } else {
-	sprintf(message,  "%s: could not attach shared memory at line %d, errno = %d (%s)",
-		DaemonName, __LINE__, errno, strerror(errno));
+    else if (result != SHM_OK) {
+	sprintf(message,  "%s: could not attach shared memory at line %d", DaemonName, __LINE__);
 	LOGERR(message);
 	_exit(1);
     }
+    // init status vars
+    emsPtr->proc[PROC_MSB].heartbeat = time(NULL);
 
     // get msb settings from config file
-    result = getConfig(CHAR, &emsPtr->msbUrl, "192.168.17.1", CONFIGFILE, "V4K", "url");
-    if (result)
-	sprintf(message, "%s: url not defined, set to default >%s<", DaemonName, "192.168.17.1");
-    else
-	sprintf(message, "%s: url set to >%s< ", DaemonName, emsPtr->msbUrl);
-    LOGIT(message);
-    result = getConfig(CHAR, &emsPtr->msbPort, "", CONFIGFILE, "V4K", "port");
-    if (result)
-	sprintf(message, "%s: port not defined, set to default >%s<", DaemonName, "");
-    else
-	sprintf(message, "%s: port set to >%s< ", DaemonName, emsPtr->msbPort);
-    LOGIT(message);
-    result = getConfig(CHAR, &emsPtr->msbCert, "", CONFIGFILE, "V4K", "cert");
-    if (result)
-	sprintf(message, "%s: cert not defined, set to default >%s<", DaemonName, "");
-    else
-	sprintf(message, "%s: cert set to >%s< ", DaemonName, emsPtr->msbCert);
-    LOGIT(message);
-    result = getConfig(CHAR, &emsPtr->msbUuid, UUID, CONFIGFILE, "V4K", "uuid");
-    if (result)
-	sprintf(message, "%s: uuid not defined, set to default >%s<", DaemonName, UUID);
-    else
-	sprintf(message, "%s: uuid set to >%s< ", DaemonName, emsPtr->msbUuid);
-    LOGIT(message);
-    result = getConfig(CHAR, &emsPtr->msbToken, TOKEN, CONFIGFILE, "V4K", "token");
-    if (result)
-	sprintf(message, "%s: token not defined, set to default >%s<", DaemonName, TOKEN);
-    else
-	sprintf(message, "%s: token set to >%s< ", DaemonName, emsPtr->msbToken);
-    LOGIT(message);
-    result = getConfig(CHAR, &emsPtr->msbClass, CLASS, CONFIGFILE, "V4K", "class");
-    if (result)
-	sprintf(message, "%s: class not defined, set to default >%s<", DaemonName, CLASS);
-    else
-	sprintf(message, "%s: class set to >%s< ", DaemonName, emsPtr->msbClass);
-    LOGIT(message);
-    result = getConfig(CHAR, &emsPtr->msbName, NAME, CONFIGFILE, "V4K", "name");
-    if (result)
-	sprintf(message, "%s: name not defined, set to default >%s<", DaemonName, NAME);
-    else
-	sprintf(message, "%s: name set to >%s< ", DaemonName, emsPtr->msbName);
-    LOGIT(message);
-    result = getConfig(CHAR, &emsPtr->msbDescription, "n.n.", CONFIGFILE, "V4K", "description");
-    if (result)
-	sprintf(message, "%s: description not defined, set to default >%s<", DaemonName, "n.n.");
-    else
-	sprintf(message, "%s: description set to >%s< ", DaemonName, emsPtr->msbDescription);
-    LOGIT(message);
-    result = getConfig(INT, &emsPtr->interval, "1000000", CONFIGFILE, "V4K", "interval");
-    if (result)
-	sprintf(message, "%s: interval not defined, set to default >%d<", DaemonName, 1000000);
-    else
-	sprintf(message, "%s: interval set to >%d< ", DaemonName, emsPtr->interval);
-    LOGIT(message);
+    msbConfig(emsPtr);
+    // phase of the samples to the wall clock in µs, -1: not aligned
+    phase = Conf->v4k.phase;
     
     // install signal handler for other signals (USR1, SEGV,...)
     if (signal(SIGUSR1, SIGgen_handler_msb) == SIG_ERR) {
@@ -225,7 +168,7 @@ int main (int argc, char** argv) {
 	    _exit(errno);
 	}
 	else {
-	    emsPtr->msbPid = sid;
+	    emsPtr->proc[PROC_MSB].pid = sid;
 	}
 	sprintf(message, "%s: running with pid %d", DaemonName, sid);
 	LOGIT(message);
@@ -246,32 +189,48 @@ int main (int argc, char** argv) {
 	fprintf(stderr, "%s: running in foreground\n", DaemonName);
     }
 
+    // wait for emsDecode to fill the field registry
+    while (emsPtr->reg.nFields == 0) {
+	sprintf(message, "%s: field registry still empty, waiting for emsDecode", DaemonName);
+	LOGIT(message);
+	sleep(10);
+    }
+
     // init state check
-    LastboilerState = emsPtr->boilerState;
+    LastboilerState = fieldInt(F_BOILERSTATE);
 
     // initialize msb
     result = initMsb(emsPtr);
 
+    cfgWatch();
+    tickInit(&tick, (int64_t)emsPtr->cfg.interval * 1000, phase < 0 ? -1 : (int64_t)phase * 1000);
     for (;;) {
-	// get actual time
-	currentTime = time(NULL);
+	// wait for the next interval, at a fixed deadline
+	currentTime = tickWait(&tick, &emsPtr->stat.msb);
 
 	// tell we're alive
-	emsPtr->heartbeatMsb = currentTime;
+	emsPtr->proc[PROC_MSB].heartbeat = currentTime;
+
+	// the config file was changed
+	if (cfgReloaded(&applied) && (cfgChanged(&applied, "V4K", "interval") || cfgChanged(&applied, "V4K", "phase"))) {
+	    emsPtr->cfg.interval = Conf->v4k.interval;
+	    phase = Conf->v4k.phase;
+	    tickInit(&tick, (int64_t)emsPtr->cfg.interval * 1000, phase < 0 ? -1 : (int64_t)phase * 1000);
+	    sprintf(message, "%s: sampling every %d µs from now on, phase %d µs", DaemonName,
+		    emsPtr->cfg.interval, phase);
+	    LOGIT(message);
+	}
 	
 	// check if ems process is running
-	if (currentTime > emsPtr->heartbeatDecode + 60) {
+	if (currentTime > emsPtr->proc[PROC_DECODE].heartbeat + 60) {
 	    sprintf(message,
 		    "%s: ems decode process did not update his heatbeat for more than 60s, should (but will not) terminate", DaemonName);
 	    LOGERR(message);
 	    //exit (42);
 	}
 
-	// send values to msb
+	// queue the values for msb, the sender thread publishes them
 	result = msb(emsPtr);
-
-	// wait for interval
-	usleep(emsPtr->interval);
     }
 }
 
@@ -0,0 +1,269 @@
+//
+// emsPub.c - publish ems values to several sinks from one process
+//
+// $Id$
+//
+// Instead of running emsMqtt and emsMsb (each with its own snapshot and
+// timer), emsPub takes one consistent snapshot per cycle and fans it out to
+// the sinks of [PUB] sinks (mqtt, msb, file, influx), see sink.c. Every
+// sink runs on its own thread behind a bounded queue, so a slow sink never
+// delays the others. emsMqtt's deadband, spool and commands are not part of
+// the mqtt sink, run emsMqtt for those.
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include <signal.h>
+#include <string.h>
+#include "ems.h"
+
+// forward declarations
+
+void SIGgen_handler_pub(int);
+void mqttBroker(const char *host, int port);
+
+static struct emsField Snap[MAXFIELDS];
+
+#define SVN "$Id$"
+
+int main (int argc, char** argv) {
+    key_t key = SHMKEY;
+    pid_t daemonPid = 0;
+    pid_t sid;
+    time_t currentTime;
+    FILE *fp;
+    int tries = 0;
+    int n, c, result, period, phase, sinks = 0;
+    char buff[MAXPATH], message[2 * MAXPATH], *p;
+    struct tick tick;
+    struct cfgApplied applied = { 0 };
+
+    // default: run as daemon
+    Daemon = 1;
+
+    while ((c = getopt(argc, argv, "vnhV")) != -1) {
+	switch (c) {
+	case 'v': // be verbose
+	    Debug = 1;
+	    break;
+
+	case 'V': // show version and exit
+#ifdef SVN_REV
+	    fprintf (stderr, "emsPub, svn rev: %s\n", SVN_REV);
+#else
+	    fprintf (stderr, "emsPub, svn info: %s\n", SVN);
+#endif
+	    exit (0);
+	    break;
+
+	case 'n': // run in foreground
+	    Daemon = 0;
+	    break;
+
+	case 'h':
+	case '?':
+	    fprintf (stderr, "%s:\tOption -v activates debug mode,\n", argv[0]);
+	    fprintf (stderr, "\tOption -n disables daemon mode\n");
+	    fprintf (stderr, "\tOption -?/-h show this information\n");
+	    fprintf (stderr, "\tOption -V shows the version information\n");
+	    fprintf (stderr, "signalling with SIGUSR1 will enable debug mode (each process separately switchable)\n");
+	    fprintf (stderr, "signalling with SIGUSR2 or changing %s will reread it\n", CONFIGFILE);
+	    exit(0);
+	    break;
+
+	default:
+	    exit(0);
+	}
+    }
+
+#undef DAEMON_NAME
+#define DAEMON_NAME "emsPub"
+    sprintf(DaemonName, "%s", DAEMON_NAME);
+
+    if (Daemon) {
+	openlog(DaemonName, LOG_CONS | LOG_NDELAY | LOG_PERROR | LOG_PID, LOG_USER);
+	syslog(LOG_INFO, "emsPub running as daemon");
+    }
+    // check the config file, an invalid one is fatal
+    if (cfgLoad(CONFIGFILE) < 0)
+	exit(1);
+
+    // try to get shared memory, if it already exists...
+ retry:
+    result = shmAttach(key, false);
+    if (result == SHM_NOSEG) {
+	sprintf(message,
+		"%s: could not get shared memory, error %d, %s. Try %d / 30",
+		DaemonName, errno, strerror(errno), tries);
+	LOGERR(message);
+	sleep(10);
+	if (tries++ < 30) // wait for about 5 minutes
+	    goto retry;
+	else
+	    _exit(errno);
+    }
+    else if (result != SHM_OK) {
+	sprintf(message,  "%s: could not attach shared memory at line %d", DaemonName, __LINE__);
+	LOGERR(message);
+	_exit(1);
+    }
+    // init status vars
+    emsPtr->proc[PROC_PUB].heartbeat = time(NULL);
+
+    snprintf(emsPtr->cfg.datapath, sizeof(emsPtr->cfg.datapath), "%s", Conf->ems.datapath);
+    period = Conf->pub.period;
+    phase = Conf->pub.phase;
+
+    // install signal handler for other signals (USR1, SEGV,...)
+    if (signal(SIGUSR1, SIGgen_handler_pub) == SIG_ERR) {
+	sprintf(message, "%s: SIGUSR1 install error", DaemonName);
+	LOGERR(message);
+	_exit(errno);
+    }
+    if (signal(SIGSEGV, SIGgen_handler_pub) == SIG_ERR) {
+	sprintf(message, "%s: SIGSEGV install error", DaemonName);
+	LOGERR(message);
+	_exit(errno);
+    }
+    if (signal(SIGTERM, SIGgen_handler_pub) == SIG_ERR) {
+	sprintf(message, "%s: SIGTERM install error", DaemonName);
+	LOGERR(message);
+	_exit(errno);
+    }
+
+    if (Daemon) {
+	// create process
+	daemonPid = fork();
+
+	if (daemonPid < 0) {
+	    syslog(LOG_ERR, "could not fork %s daemon process", DaemonName);
+	    _exit(errno);
+	}
+	else {
+	    // check if parent or son
+	    if (daemonPid == 0) {
+		// son, will continue
+		syslog(LOG_INFO, "%s daemon started", DaemonName);
+	    }
+	    else {
+		fp = fopen("/run/emsPub.pid", "w");
+		if (fp == NULL)
+		    _exit(errno);
+		else {
+		    fprintf(fp, "%d\n", daemonPid);
+		    fclose(fp);
+		}
+		// parent must die to be able to detach controlling tty
+		exit(0);
+	    }
+	}
+	// get pid of this (forked) process
+	sid = getpid();
+	if (sid < 0) {
+	    _exit(errno);
+	}
+	else {
+	    emsPtr->proc[PROC_PUB].pid = sid;
+	}
+	sprintf(message, "%s: running with pid %d", DaemonName, sid);
+	LOGIT(message);
+
+	//Close Standard File Descriptors
+	close(STDIN_FILENO);
+	close(STDOUT_FILENO);
+	close(STDERR_FILENO);
+    } // daemon mode
+    else {
+	fprintf(stderr, "%s: running in foreground\n", DaemonName);
+    }
+
+    // wait for emsDecode to fill the field registry
+    while (emsPtr->reg.nFields == 0) {
+	sprintf(message, "%s: field registry still empty, waiting for emsDecode", DaemonName);
+	LOGIT(message);
+	sleep(10);
+    }
+
+    // start the sinks, their threads run after the fork
+    memset(emsPtr->stat.sink, 0, sizeof(emsPtr->stat.sink));
+    snprintf(buff, sizeof(buff), "%s", Conf->pub.sinks);
+    for (p = strtok(buff, ", "); p != NULL; p = strtok(NULL, ", "))
+	if (sinkStart(p) == 0)
+	    sinks++;
+    if (sinks == 0) {
+	sprintf(message, "%s: no sink could be started, terminating", DaemonName);
+	LOGERR(message);
+	exit(1);
+    }
+    sprintf(message, "%s: publishing to %d sinks every %d ms, %s %d ms", DaemonName, sinks, period,
+	    phase >= 0 ? "aligned to the wall clock +" : "not aligned,", phase);
+    LOGIT(message);
+
+    cfgWatch();
+    tickInit(&tick, (int64_t)period * 1000000, phase < 0 ? -1 : (int64_t)phase * 1000000);
+    for (;;) {
+	// wait for the next cycle, its deadline is the time of the snapshot
+	currentTime = tickWait(&tick, &emsPtr->stat.pub);
+
+	// tell we're alive
+	emsPtr->proc[PROC_PUB].heartbeat = currentTime;
+
+	// the config file was changed
+	if (cfgReloaded(&applied)) {
+	    if (cfgChanged(&applied, "EMS", "broker") || cfgChanged(&applied, "EMS", "port"))
+		mqttBroker(Conf->ems.broker, Conf->ems.port);
+	    if (cfgChanged(&applied, "PUB", "period") || cfgChanged(&applied, "PUB", "phase")) {
+		period = Conf->pub.period;
+		phase = Conf->pub.phase;
+		tickInit(&tick, (int64_t)period * 1000000, phase < 0 ? -1 : (int64_t)phase * 1000000);
+		sprintf(message, "%s: publishing every %d ms from now on, phase %d ms", DaemonName, period, phase);
+		LOGIT(message);
+	    }
+	}
+
+	// check if ems process is running
+	if (currentTime > emsPtr->proc[PROC_DECODE].heartbeat + 60) {
+	    sprintf(message,
+		    "%s: ems decode process did not update his heatbeat for more than 60s", DaemonName);
+	    LOGERR(message);
+	}
+
+	// one snapshot for all sinks
+	n = snapTake(Snap);
+	sinkPut(Snap, n, currentTime);
+    }
+}
+
+void  SIGgen_handler_pub(int sig)
+{
+    char message[1000];
+
+    switch (sig)
+	{
+	case SIGUSR1:
+	    if (Debug) {
+		sprintf(message,"%s/SIGgen_handler_pub: switch debug mode off, got signal %d (%s) ", DaemonName, sig, strsignal(sig));
+		Debug = false;
+	    }
+	    else {
+		sprintf(message,"%s/SIGgen_handler_pub: switch debug mode on, got signal %d (%s) ", DaemonName, sig, strsignal(sig));
+		Debug = true;
+	    }
+	    LOGIT(message);
+	    break;
+
+	case SIGSEGV:
+	    sprintf(message,"%s/SIGgen_handler_pub: got signal %d (%s), line %d ", DaemonName, sig, strsignal(sig), Line);
+	    LOGERR(message);
+	    exit (11);
+	    break;
+
+	case SIGTERM:
+	    sprintf(message,"%s/SIGgen_handler_pub: got signal %d (%s), terminating", DaemonName, sig, strsignal(sig));
+	    LOGIT(message);
+	    exit (0);
+	    break;
+
+	default:
+	    break;
+	}
+}
@@ -0,0 +1,234 @@
+//
+// emsQuery.c - aggregates over the stored history, as CSV or JSON
+//
+// $Id$
+//
+// emsQuery -f 06:00 -t 08:00 -s 1m tempBoiler
+// emsQuery -f -30d -s 1d starts
+
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include "ems.h"
+#include "col.h"
+
+#define MAXBUCKETS 1000000
+
+// forward declarations
+static int parseTime(const char *s, time_t now, time_t *t);
+static long parseStep(const char *s);
+static void listFields(const char *path);
+
+#define SVN "$Id$"
+
+int main(int argc, char **argv) {
+    char path[MAXPATH], stamp[32], avg[16], min[16], max[16], delta[16];
+    time_t now, from = 0, to = 0, start;
+    long step = 0, nb;
+    int c, i, f, res, json = false, list = false, scale, first = true;
+    const char *unit;
+    struct queryBucket *b;
+    struct queryStats st;
+    struct timespec t0, t1;
+    struct tm tm;
+
+    sprintf(DaemonName, "emsQuery");
+    path[0] = '\0';
+    now = time(NULL);
+
+    while ((c = getopt(argc, argv, "d:f:t:s:jlvhV")) != -1) {
+	switch (c) {
+	case 'd':
+	    snprintf(path, MAXPATH, "%s", optarg);
+	    break;
+	case 'f':
+	case 't':
+	    if (parseTime(optarg, now, c == 'f' ? &from : &to) < 0) {
+		fprintf(stderr, "emsQuery: can not parse time >%s<\n", optarg);
+		exit(1);
+	    }
+	    break;
+	case 's':
+	    if ((step = parseStep(optarg)) < 0) {
+		fprintf(stderr, "emsQuery: can not parse step >%s<\n", optarg);
+		exit(1);
+	    }
+	    break;
+	case 'j':
+	    json = true;
+	    break;
+	case 'l':
+	    list = true;
+	    break;
+	case 'v':
+	    Debug = true;
+	    break;
+	case 'V':
+	    fprintf(stderr, "emsQuery, svn info: %s\n", SVN);
+	    exit(0);
+	case 'h':
+	case '?':
+	default:
+	    fprintf(stderr, "usage: %s [-d datapath] [-f from] [-t to] [-s step] [-j] field...\n", argv[0]);
+	    fprintf(stderr, "\tfrom/to: now, -2h, -30d, HH:MM, YYYY-MM-DD [HH:MM[:SS]] or s since epoch\n");
+	    fprintf(stderr, "\t         (default: the last 24 hours)\n");
+	    fprintf(stderr, "\tstep: bucket size, e.g. 60, 1m, 15m, 1h, 1d (default: one bucket)\n");
+	    fprintf(stderr, "\tOption -j prints JSON instead of CSV\n");
+	    fprintf(stderr, "\tOption -l lists the fields with a history\n");
+	    fprintf(stderr, "\tOption -v prints timing and segment statistics to stderr\n");
+	    exit(0);
+	}
+    }
+
+    if (path[0] == '\0') {
+	if (cfgLoad(CONFIGFILE) < 0)
+	    exit(1);
+	snprintf(path, sizeof(path), "%s", Conf->ems.datapath);
+    }
+    if (list) {
+	listFields(path);
+	exit(0);
+    }
+    if (optind >= argc) {
+	fprintf(stderr, "emsQuery: no field given, try -l\n");
+	exit(1);
+    }
+    if (to == 0)
+	to = now;
+    if (from == 0)
+	from = to - 86400;
+    nb = (step > 0) ? (to - from) / step + 1 : 1;
+    if (from > to || nb > MAXBUCKETS) {
+	fprintf(stderr, "emsQuery: empty range or more than %d buckets\n", MAXBUCKETS);
+	exit(1);
+    }
+    if ((b = malloc(nb * sizeof(*b))) == NULL)
+	exit(1);
+
+    printf(json ? "[" : "field,time,count,avg,min,max,delta\n");
+    for (f = optind; f < argc; f++) {
+	if (fieldDef(argv[f], &scale, &unit) < 0) {
+	    scale = 0;
+	    unit = "";
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	res = queryRun(path, argv[f], from, to, step, b, nb, &st);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (res < 0) {
+	    fprintf(stderr, "emsQuery: no history for %s in %s/%s\n", argv[f], path, COLDIR);
+	    continue;
+	}
+	if (Debug)
+	    fprintf(stderr, "%s: %.3f ms, %u segments, %u from index, %u decoded, %d buckets\n",
+		    argv[f], (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6,
+		    st.segments, st.indexed, st.decoded, res);
+
+	if (json)
+	    printf("%s\n{\"field\":\"%s\",\"unit\":\"%s\",\"buckets\":[", first ? "" : ",", argv[f], unit);
+	first = false;
+	for (i = 0, c = 0; i < nb; i++) {
+	    if (b[i].count == 0)
+		continue;
+	    start = b[i].start;
+	    localtime_r(&start, &tm);
+	    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+	    fmtFixed((int32_t)((b[i].sum + (b[i].sum >= 0 ? 1 : -1) * (int64_t)(b[i].count / 2)) / b[i].count),
+		     scale, avg);
+	    fmtFixed(b[i].min, scale, min);
+	    fmtFixed(b[i].max, scale, max);
+	    fmtFixed(b[i].delta, scale, delta);
+	    if (json)
+		printf("%s\n {\"time\":\"%s\",\"t\":%u,\"count\":%u,\"avg\":%s,\"min\":%s,\"max\":%s,\"delta\":%s}",
+		       c++ ? "," : "", stamp, b[i].start, b[i].count, avg, min, max, delta);
+	    else
+		printf("%s,%s,%u,%s,%s,%s,%s\n", argv[f], stamp, b[i].count, avg, min, max, delta);
+	}
+	if (json)
+	    printf("]}");
+    }
+    if (json)
+	printf("\n]\n");
+    free(b);
+    exit(0);
+}
+
+static int parseTime(const char *s, time_t now, time_t *t) {
+    struct tm tm;
+    char *end;
+    long n;
+
+    if (strcmp(s, "now") == 0) {
+	*t = now;
+	return (0);
+    }
+    if (s[0] == '-') {
+	if ((n = parseStep(s + 1)) < 0)
+	    return (-1);
+	*t = now - n;
+	return (0);
+    }
+    n = strtol(s, &end, 10);
+    if (*end == '\0' && n > 86400) {
+	*t = n;
+	return (0);
+    }
+
+    localtime_r(&now, &tm);
+    tm.tm_sec = 0;
+    end = strptime(s, "%H:%M", &tm);
+    if (end == NULL || *end != '\0') {
+	memset(&tm, 0, sizeof(tm));
+	end = strptime(s, "%Y-%m-%d", &tm);
+	if (end != NULL && (*end == ' ' || *end == 'T'))
+	    end = strptime(end + 1, "%H:%M", &tm);
+	if (end != NULL && *end == ':')
+	    end = strptime(end + 1, "%S", &tm);
+	if (end == NULL || *end != '\0')
+	    return (-1);
+    }
+    tm.tm_isdst = -1;
+    *t = mktime(&tm);
+    return (0);
+}
+
+// number with optional unit s, m, h or d, in s
+static long parseStep(const char *s) {
+    char *end;
+    long n;
+
+    n = strtol(s, &end, 10);
+    if (end == s || n < 0)
+	return (-1);
+    switch (tolower((unsigned char)*end)) {
+    case '\0':
+    case 's':
+	return (n);
+    case 'm':
+	return (n * 60);
+    case 'h':
+	return (n * 3600);
+    case 'd':
+	return (n * 86400);
+    default:
+	return (-1);
+    }
+}
+
+static void listFields(const char *path) {
+    char dir[MAXPATH], *dot;
+    struct dirent *e;
+    DIR *d;
+
+    snprintf(dir, MAXPATH, "%s/%s", path, COLDIR);
+    if ((d = opendir(dir)) == NULL) {
+	fprintf(stderr, "emsQuery: no history in %s\n", dir);
+	return;
+    }
+    while ((e = readdir(d)) != NULL) {
+	dot = strrchr(e->d_name, '.');
+	if (dot != NULL && strcmp(dot, ".idx") == 0)
+	    printf("%.*s\n", (int)(dot - e->d_name), e->d_name);
+    }
+    closedir(d);
+}
@@ -34,13 +34,9 @@
 
 struct termios tios;
 int waitingfor;
-struct STATS stats;
 pthread_t readloop = 0;
 int Logging = 0;
 
-// forward declarations
-int getConfig(enum varType, void *var, char *defVal, char *cFile, char *group, char *key);
-
 void print_stats() {
     char message[MAXPATH];
     
@@ -49,21 +45,21 @@ void print_stats() {
     
     sprintf(message, "Statistics");
     LOGIT(message);
-    sprintf(message, "RX bus access errors    %d", stats.rx_mac_errors);
+    sprintf(message, "RX bus access errors    %d", emsPtr->stat.serio.rx_mac_errors);
     LOGIT(message);
-    sprintf(message, "RX total                %d", stats.rx_total);
+    sprintf(message, "RX total                %d", emsPtr->stat.serio.rx_total);
     LOGIT(message);
-    sprintf(message, "RX success              %d", stats.rx_success);
+    sprintf(message, "RX success              %d", emsPtr->stat.serio.rx_success);
     LOGIT(message);
-    sprintf(message, "RX too short            %d", stats.rx_short);
+    sprintf(message, "RX too short            %d", emsPtr->stat.serio.rx_short);
     LOGIT(message);
-    sprintf(message, "RX wrong sender         %d", stats.rx_sender);
+    sprintf(message, "RX wrong sender         %d", emsPtr->stat.serio.rx_sender);
     LOGIT(message);
-    sprintf(message, "RX CRC errors           %d", stats.rx_format);
+    sprintf(message, "RX CRC errors           %d", emsPtr->stat.serio.rx_format);
     LOGIT(message);
-    sprintf(message, "TX total                %d", stats.tx_total);
+    sprintf(message, "TX total                %d", emsPtr->stat.serio.tx_total);
     LOGIT(message);
-    sprintf(message, "TX failures             %d", stats.tx_fail);
+    sprintf(message, "TX failures             %d", emsPtr->stat.serio.tx_fail);
     LOGIT(message);
 }
 
@@ -71,7 +67,7 @@ void print_packet(int out, int loglevel, uint8_t *msg, size_t len) {
     char message[MAXPATH];
 
     // update heartbeat after every received telegram
-    emsPtr->heartbeatSerio = time(NULL);
+    emsPtr->proc[PROC_SERIO].heartbeat = time(NULL);
     
     if (!(Logging & loglevel))
         return;
@@ -128,17 +124,17 @@ int start(ems *emsPtrL) {
     int ret;
     char message[MAXPATH];
 
-    ret = open_serial(emsPtrL->emstty);
+    ret = open_serial(emsPtrL->cfg.emstty);
     if (ret != 0) {
-        snprintf(message, MAXPATH - strlen(emsPtrL->emstty), "Failed to open %s: %i (%d)", emsPtrL->emstty, ret, errno);
+        snprintf(message, MAXPATH - strlen(emsPtrL->cfg.emstty), "Failed to open %s: %i (%d)", emsPtrL->cfg.emstty, ret, errno);
 	LOGERR(message);
         return (-1);
     } else {
-	snprintf(message, MAXPATH - strlen(emsPtrL->emstty), "Serial port %s opened", emsPtrL->emstty);
+	snprintf(message, MAXPATH - strlen(emsPtrL->cfg.emstty), "Serial port %s opened", emsPtrL->cfg.emstty);
 	LOGIT(message);
     }
     
-    ret = setup_queue(&tx_queue, emsPtrL->txqueue);
+    ret = setup_queue(&tx_queue, emsPtrL->cfg.txqueue);
     if (tx_queue == -1) {
         sprintf(message, "Failed to open TX message queue: %i %s (%d)", tx_queue, strerror(ret), ret);
 	LOGERR(message);
@@ -149,7 +145,7 @@ int start(ems *emsPtrL) {
 	LOGIT(message);
     }
     
-    ret = setup_queue(&rx_queue, emsPtrL->rxqueue);
+    ret = setup_queue(&rx_queue, emsPtrL->cfg.rxqueue);
     if (rx_queue == -1) {
         sprintf(message, "Failed to open RX message queue: %i  %s (%d)", rx_queue, strerror(ret), ret);
 	LOGERR(message);
@@ -225,57 +221,25 @@ int main(int argc, char *argv[]) {
         syslog(LOG_INFO, "%s running as daemon", DaemonName);
     }   
 
-    // try to get shared memory, if it already exists or create it
-    ShmId = shmget(key, sizeof(ems), 0);
-    if (ShmId < 0) {
-        sprintf(message,
-                "%s: could not get shared memory, shmid = %d, error %d, %s. Trying to create it...",
-                DaemonName, ShmId, errno, strerror(errno));
-        LOGERR(message);
-	// try to create it
-	ShmId = shmget(key, sizeof(ems), IPC_CREAT | 0666);
-	if (errno != 0 && ShmId < 0) {
-	    sprintf(message, "%s: could not create shared memory, error %s, errno = %d, shmid = %d",
-		    DaemonName, strerror(errno), errno, ShmId);
-	    LOGERR(message);
-	    exit (errno);
-	}
-    }
+    // check the config file, an invalid one is fatal
+    if (cfgLoad(CONFIGFILE) < 0)
+        exit(1);
 
-    emsPtr = shmat(ShmId, NULL, 0);
-    sprintf(message,
-	    "%s: attached shared memory, shmid = %d, ptr = %x",
-	    DaemonName, ShmId, (int)emsPtr);
-    LOGIT(message);
-
-    if (emsPtr != (void *) -1) {
-        // init status vars
-        emsPtr->heartbeatSerio = time(NULL);
-    } else {
-        sprintf(message,  "%s: could not attach shared memory at line %d, errno = %d (%s)",
-                DaemonName, __LINE__, errno, strerror(errno));
+    // try to get shared memory, if it already exists or create it
+    if (shmAttach(key, true) != SHM_OK) {
+        sprintf(message,  "%s: could not attach shared memory at line %d", DaemonName, __LINE__);
         LOGERR(message);
         _exit(1);
     }
+    // init status vars
+    emsPtr->proc[PROC_SERIO].heartbeat = time(NULL);
 
     // get names for serial device and message queues
-    result = getConfig(CHAR, &emsPtr->emstty, EMSTTY, CONFIGFILE, "EMS", "emstty");
-    if (result)
-	sprintf(message, "%s: emstty not defined, set to default >%s<", DaemonName, EMSTTY);
-    else
-	snprintf(message, MAXPATH - strlen(emsPtr->emstty), "%s: emstty set to >%s< ", DaemonName, emsPtr->emstty);
-    LOGIT(message);
-    result = getConfig(CHAR, &emsPtr->rxqueue, RX_QUEUE_NAME, CONFIGFILE, "EMS", "rxqueue");
-    if (result)
-	sprintf(message, "%s: rxqueue not defined, set to default >%s<", DaemonName, RX_QUEUE_NAME);
-    else
-	sprintf(message, "%s: rxqueue set to >%s< ", DaemonName, emsPtr->rxqueue);
-    LOGIT(message);
-    result = getConfig(CHAR, &emsPtr->txqueue, TX_QUEUE_NAME, CONFIGFILE, "EMS", "txqueue");
-    if (result)
-	sprintf(message, "%s: txqueue not defined, set to default >%s<", DaemonName, TX_QUEUE_NAME);
-    else
-	sprintf(message, "%s: txqueue set to >%s< ", DaemonName, emsPtr->txqueue);
+    snprintf(emsPtr->cfg.emstty, sizeof(emsPtr->cfg.emstty), "%s", Conf->ems.emstty);
+    snprintf(emsPtr->cfg.rxqueue, sizeof(emsPtr->cfg.rxqueue), "%s", Conf->ems.rxqueue);
+    snprintf(emsPtr->cfg.txqueue, sizeof(emsPtr->cfg.txqueue), "%s", Conf->ems.txqueue);
+    snprintf(message, MAXPATH, "%s: emstty >%.300s<, rxqueue >%s<, txqueue >%s<", DaemonName,
+	     emsPtr->cfg.emstty, emsPtr->cfg.rxqueue, emsPtr->cfg.txqueue);
     LOGIT(message);
 
     // we want to run as daemon, so we have to fork (the daemon will then
@@ -313,7 +277,7 @@ int main(int argc, char *argv[]) {
 	    _exit(errno);
 	}
 	else {
-	    emsPtr->serioPid = sid;
+	    emsPtr->proc[PROC_SERIO].pid = sid;
 	}
 	sprintf(message, "%s: running with pid %d", DaemonName, sid);
 	LOGIT(message);
@@ -336,6 +300,7 @@ int main(int argc, char *argv[]) {
 
     // start thread
     ret = start(emsPtr);
+    cfgWatch();
 
     // Set signal handler and wait for the thread
     signal_action.sa_handler = sig_stop;
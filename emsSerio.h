@@ -2,7 +2,6 @@
 
 #include "defines.h"
 
-extern struct STATS stats;
 extern int logging;
 extern pthread_t readloop;
 
@@ -0,0 +1,201 @@
+//
+// fields.c - registry of decoded values in shared memory
+//
+// $Id$
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "ems.h"
+
+struct fieldDef {
+    int id;
+    char *name;
+    int type;
+    char *unit;
+    int scale;
+    int flags;
+};
+
+// the known fields, emsDecode copies these into shared memory at startup.
+// New values just need an id in ems.h and a line here.
+static const struct fieldDef FieldDefs[] = {
+    { F_STATUS,         "status",         FT_INT,   "",    0, FF_RETAIN },
+    { F_BOILERSTATE,    "boilerState",    FT_INT,   "",    0, 0 },
+    { F_WATERSTATE,     "waterState",     FT_INT,   "",    0, 0 },
+    { F_PUMP,           "pump",           FT_INT,   "",    0, 0 },
+    { F_CIRCPUMP,       "circPump",       FT_INT,   "",    0, 0 },
+    { F_CIRCSTATE1,     "circState1",     FT_INT,   "",    0, 0 },
+    { F_CIRCSTATE2,     "circState2",     FT_INT,   "",    0, 0 },
+    { F_CODE1,          "code1",          FT_INT,   "",    0, 0 },
+    { F_CODE2,          "code2",          FT_INT,   "",    0, 0 },
+    { F_MODEL,          "model",          FT_INT,   "",    0, 0 },
+    { F_ERROR1,         "error1",         FT_INT,   "",    0, 0 },
+    { F_ERROR2,         "error2",         FT_INT,   "",    0, 0 },
+    { F_ERROR3,         "error3",         FT_INT,   "",    0, 0 },
+    { F_ERRORCODE,      "errorCode",      FT_INT,   "",    0, 0 },
+    { F_UBACODE,        "ubaCode",        FT_INT,   "",    0, 0 },
+    { F_BURNERCODE,     "burnerCode",     FT_INT,   "",    0, 0 },
+    { F_LOADINGPUMP,    "loadingPump",    FT_INT,   "",    0, 0 },
+    { F_POWER,          "power",          FT_INT,   "%",   0, 0 },
+    { F_STARTS,         "starts",         FT_INT,   "",    0, 0 },
+    { F_OPTIME,         "opTime",         FT_INT,   "min", 0, 0 },
+    { F_SETWATERTEMP,   "setWaterTemp",   FT_FIXED, "°C",  0, 0 },
+    { F_SETTEMPERATURE, "setTemperature", FT_FIXED, "°C",  0, 0 },
+    { F_TEMPBOILER,     "tempBoiler",     FT_FIXED, "°C",  1, FF_MSB },
+    { F_TEMPEXHAUST,    "tempExhaust",    FT_FIXED, "°C",  1, FF_MSB },
+    { F_TEMPWATER,      "tempWater",      FT_FIXED, "°C",  1, FF_MSB },
+    { F_TEMPOUTSIDE,    "tempOutside",    FT_FIXED, "°C",  1, FF_MSB },
+    { F_TEMPINSIDE,     "tempInside",     FT_FIXED, "°C",  1, FF_MSB },
+    { F_CURRENT,        "current",        FT_FIXED, "µA",  1, 0 },
+    { F_BURNER,         "burner",         FT_INT,   "",    0, 0 },
+    { F_BLOWER,         "blower",         FT_INT,   "",    0, 0 },
+};
+
+// fill the registry from FieldDefs, called by the writer (emsDecode).
+// Values already in shared memory are kept.
+void fieldInit(void) {
+    char message[MAXPATH];
+    struct emsField *f;
+    size_t i;
+
+    for (i = 0; i < sizeof(FieldDefs) / sizeof(FieldDefs[0]); i++) {
+	if (FieldDefs[i].id >= MAXFIELDS) {
+	    sprintf(message, "%s: field %s has id %d >= MAXFIELDS, ignored",
+		    DaemonName, FieldDefs[i].name, FieldDefs[i].id);
+	    LOGERR(message);
+	    continue;
+	}
+	f = &emsPtr->field[FieldDefs[i].id];
+	f->id = FieldDefs[i].id;
+	f->type = FieldDefs[i].type;
+	f->flags = FieldDefs[i].flags;
+	f->scale = FieldDefs[i].scale;
+	snprintf(f->name, FIELDNAME, "%s", FieldDefs[i].name);
+	snprintf(f->unit, FIELDUNIT, "%s", FieldDefs[i].unit);
+    }
+    __sync_synchronize();
+    emsPtr->reg.nFields = F_MAX;
+
+    sprintf(message, "%s: registered %d fields", DaemonName, F_MAX);
+    LOGIT(message);
+}
+
+// get id of field by name, -1 if unknown (linear, use at startup only)
+int fieldByName(const char *name) {
+    uint32_t i;
+
+    for (i = 0; i < emsPtr->reg.nFields; i++)
+	if (strcmp(emsPtr->field[i].name, name) == 0)
+	    return (i);
+    return (-1);
+}
+
+// look up a field in the compiled in table, for tools that work without
+// the shared memory. Returns the id or -1, scale and unit may be NULL.
+int fieldDef(const char *name, int *scale, const char **unit) {
+    size_t i;
+
+    for (i = 0; i < sizeof(FieldDefs) / sizeof(FieldDefs[0]); i++) {
+	if (strcmp(FieldDefs[i].name, name) != 0)
+	    continue;
+	if (scale != NULL)
+	    *scale = (FieldDefs[i].type == FT_FIXED) ? FieldDefs[i].scale : 0;
+	if (unit != NULL)
+	    *unit = FieldDefs[i].unit;
+	return (FieldDefs[i].id);
+    }
+    return (-1);
+}
+
+static inline void fieldBeginWrite(struct emsField *f) {
+    __atomic_store_n(&f->seq, f->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void fieldEndWrite(struct emsField *f, int64_t stamp) {
+    f->stamp = stamp;
+    f->updates++;
+    __atomic_store_n(&f->seq, f->seq + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&emsPtr->reg.seq, 2, __ATOMIC_RELEASE);
+}
+
+// bracket the fields of one telegram: reg.seq is odd in between, so that
+// snapTake() does not copy half of a telegram. emsDecode only, a counter
+// left odd by a crash mid-telegram stays odd until the next end.
+void fieldTelegramBegin(void) {
+    uint32_t seq = __atomic_load_n(&emsPtr->reg.seq, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&emsPtr->reg.seq, (seq & 1) ? 2 : 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void fieldTelegramEnd(void) {
+    __atomic_add_fetch(&emsPtr->reg.seq, 1, __ATOMIC_RELEASE);
+}
+
+void fieldSetInt(int id, int32_t val, int64_t stamp) {
+    struct emsField *f = &emsPtr->field[id];
+
+    fieldBeginWrite(f);
+    f->value = val;
+    aggUpdate(id, val, stamp);
+    fieldEndWrite(f, stamp);
+    histUpdate(id, val, stamp);
+}
+
+// consistent copy of field id, returns -1 for an unknown id
+int fieldRead(int id, struct emsField *copy) {
+    struct emsField *f;
+    uint32_t seq;
+
+    if (id < 0 || (uint32_t)id >= emsPtr->reg.nFields)
+	return (-1);
+    f = &emsPtr->field[id];
+    do {
+	while ((seq = __atomic_load_n(&f->seq, __ATOMIC_ACQUIRE)) & 1)
+	    ;
+	memcpy(copy, f, sizeof(*copy));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (seq != __atomic_load_n(&f->seq, __ATOMIC_RELAXED));
+
+    return (0);
+}
+
+// plain read of a single raw value (a 32 bit load cannot tear)
+int32_t fieldInt(int id) {
+    return (__atomic_load_n(&emsPtr->field[id].value, __ATOMIC_RELAXED));
+}
+
+// value as double, for sinks that want floating point numbers (msb)
+double fieldDouble(const struct emsField *f) {
+    static const double Scale[] = { 1.0, 10.0, 100.0, 1000.0 };
+
+    if (f->type == FT_FIXED && f->scale > 0 && f->scale < 4)
+	return ((double)f->value / Scale[(int)f->scale]);
+    return ((double)f->value);
+}
+
+// format the value of f into buff (at least 16 bytes), returns length
+int fieldFormat(const struct emsField *f, char *buff) {
+    switch (f->type) {
+    case FT_FIXED:
+	return (fmtFixed(f->value, f->scale, buff));
+    case FT_BOOL:
+	return (fmtInt(f->value ? 1 : 0, buff));
+    case FT_INT:
+    default:
+	return (fmtInt(f->value, buff));
+    }
+}
+
+// current time in ns since epoch
+int64_t stampNow(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ((int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
@@ -0,0 +1,145 @@
+//
+// hist.c - history ring of every field with 1 and 15 minute tiers
+//
+// $Id$
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ems.h"
+
+static const uint32_t HistSize[HT_MAX] = { HISTRAW, HIST1MIN, HIST15MIN };
+static const uint32_t HistWidth[HT_MAX] = { 0, 60, 900 };
+
+// close the interval in progress of tier and publish it
+static void histFlush(struct emsHistory *h, int tier) {
+    struct histAccu *a = &h->acc[tier];
+    struct histSample *s;
+    uint32_t n;
+
+    n = h->head[tier];
+    s = (tier == HT_1MIN) ? &h->min1[n % HIST1MIN] : &h->min15[n % HIST15MIN];
+    s->time = a->start;
+    s->mean = (int32_t)((a->sum + (a->sum >= 0 ? a->count / 2 : -a->count / 2)) / a->count);
+    s->min = a->min;
+    s->max = a->max;
+    __atomic_store_n(&h->head[tier], n + 1, __ATOMIC_RELEASE);
+    a->count = 0;
+}
+
+// append a sample, called by the field writer for every update
+void histUpdate(int id, int32_t value, int64_t stamp) {
+    struct emsHistory *h = &emsPtr->hist[id];
+    struct histAccu *a;
+    uint32_t n, sec, start;
+    int tier;
+
+    sec = (uint32_t)(stamp / 1000000000LL);
+
+    n = h->head[HT_RAW];
+    h->raw[n % HISTRAW].time = sec;
+    h->raw[n % HISTRAW].value = value;
+    __atomic_store_n(&h->head[HT_RAW], n + 1, __ATOMIC_RELEASE);
+
+    for (tier = HT_1MIN; tier < HT_MAX; tier++) {
+	a = &h->acc[tier];
+	start = sec - sec % HistWidth[tier];
+	if (a->count > 0 && a->start != start)
+	    histFlush(h, tier);
+	if (a->count == 0) {
+	    a->start = start;
+	    a->sum = 0;
+	    a->min = value;
+	    a->max = value;
+	}
+	a->sum += value;
+	a->count++;
+	if (value < a->min)
+	    a->min = value;
+	if (value > a->max)
+	    a->max = value;
+    }
+}
+
+// copy the n entries of tier starting with index *first into buf and drop
+// those the writer may have overwritten meanwhile, anything older than the
+// slot it could be writing now is suspect. Advances *first past the dropped
+// entries, returns the number of entries left in buf.
+static int histCopy(struct emsHistory *h, int tier, uint32_t *first, int n, struct histSample *buf) {
+    uint32_t head, valid, size, i;
+    int skip = 0;
+
+    size = HistSize[tier];
+    for (i = 0; i < (uint32_t)n; i++) {
+	switch (tier) {
+	case HT_RAW:
+	    buf[i].time = h->raw[(*first + i) % HISTRAW].time;
+	    buf[i].mean = buf[i].min = buf[i].max = h->raw[(*first + i) % HISTRAW].value;
+	    break;
+	case HT_1MIN:
+	    buf[i] = h->min1[(*first + i) % HIST1MIN];
+	    break;
+	default:
+	    buf[i] = h->min15[(*first + i) % HIST15MIN];
+	    break;
+	}
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    head = __atomic_load_n(&h->head[tier], __ATOMIC_RELAXED);
+    valid = (head >= size) ? head - size + 1 : 0;
+    if ((int32_t)(valid - *first) > 0)
+	skip = (valid - *first > (uint32_t)n) ? n : (int)(valid - *first);
+    if (skip > 0) {
+	memmove(buf, buf + skip, (n - skip) * sizeof(*buf));
+	*first += skip;
+    }
+    return (n - skip);
+}
+
+// copy up to max of the latest entries of tier for field id into buf,
+// oldest first. Raw samples have mean == min == max. Returns the number
+// of entries copied or -1 on error. Never blocks the writer.
+int histRead(int id, int tier, struct histSample *buf, int max) {
+    struct emsHistory *h;
+    uint32_t head, first;
+    int n;
+
+    if (id < 0 || (uint32_t)id >= emsPtr->reg.nFields || tier < 0 || tier >= HT_MAX || max <= 0)
+	return (-1);
+    h = &emsPtr->hist[id];
+
+    head = __atomic_load_n(&h->head[tier], __ATOMIC_ACQUIRE);
+    n = (head < HistSize[tier]) ? head : HistSize[tier];
+    if (n > max)
+	n = max;
+    first = head - n;
+
+    return (histCopy(h, tier, &first, n, buf));
+}
+
+// like histRead(), but for readers following a tier: copies up to max
+// entries starting at *pos (0 for the oldest one still kept) and advances
+// *pos behind them. If the reader fell behind, *pos is moved forward first,
+// the number of lost entries is the advance of *pos minus the return value.
+int histReadFrom(int id, int tier, uint32_t *pos, struct histSample *buf, int max) {
+    struct emsHistory *h;
+    uint32_t head, avail;
+    int n;
+
+    if (id < 0 || (uint32_t)id >= emsPtr->reg.nFields || tier < 0 || tier >= HT_MAX || max <= 0)
+	return (-1);
+    h = &emsPtr->hist[id];
+
+    head = __atomic_load_n(&h->head[tier], __ATOMIC_ACQUIRE);
+    avail = head - *pos;
+    if (avail > HistSize[tier]) {
+	*pos = head - HistSize[tier];
+	avail = HistSize[tier];
+    }
+    n = (avail > (uint32_t)max) ? max : (int)avail;
+
+    n = histCopy(h, tier, pos, n, buf);
+    *pos += n;
+    return (n);
+}
@@ -0,0 +1,335 @@
+//
+// influx.c - InfluxDB line protocol sink of emsPub
+//
+// $Id$
+//
+// Every field is written with the receive time of its telegram (ns), the
+// fields of one telegram share a line:
+//
+//   <measurement> tempBoiler=45.3,status=3i 1700000000123456789
+//
+// A field is written again only when a newer telegram set it. Integers carry
+// the i suffix, fixed point values are written with their decimals, so no
+// precision is lost.
+//
+// Lines are collected in a buffer and sent in batches of up to [INFLUX]
+// batchsize bytes, once the buffer holds that much or its oldest line is
+// batchage ms old. [INFLUX] url selects the transport:
+//
+//   udp://127.0.0.1:8089                     one datagram per batch
+//   http://127.0.0.1:8086/write?db=ems&precision=ns
+//   http://127.0.0.1:8086/api/v2/write?org=o&bucket=b&precision=ns (token)
+//
+// HTTP uses a keep-alive connection. Batches that could not be sent stay in
+// the buffer and are retried with a doubling delay (1 s .. 60 s); when the
+// buffer ([INFLUX] retrykb) is full the oldest lines are dropped. Batches
+// refused with 4xx would never succeed and are dropped as well.
+
+#define _POSIX_C_SOURCE 200809L
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ems.h"
+
+#define MEASUREMENT "ems"
+#define BATCHUDP "1400"     // fits into one ethernet frame
+#define BATCHHTTP "65536"
+#define BATCHAGE "5000"
+#define RETRYKB "1024"
+#define RETRYMIN 1000       // ms
+#define RETRYMAX 60000      // ms
+#define LINESIZE 4096
+
+static int Http = false;
+static int Sock = -1;
+static struct sockaddr_in Addr;
+static char Host[MAXNAME], Path[MAXPATH], Token[MAXNAME];
+static char Measurement[MAXNAME] = MEASUREMENT;
+
+static char *Buf = NULL;        // lines not sent yet
+static size_t BufLen, BufMax, BatchSize;
+static int64_t BufSince;        // ns, when the oldest line was added
+static int64_t BatchAge;        // ns
+static int64_t NextTry = 0;     // ns, no send before (after a failure)
+static int RetryDelay = RETRYMIN;
+static int64_t LastStamp[MAXFIELDS];
+
+// transport, batch size and age (ms) and buffer size (kB), -1 on a bad url
+int influxSetup(const char *url, int batchSize, int batchAge, int retryKb) {
+    char scheme[8], message[2 * MAXPATH];
+    int port = 0, n = 0;
+
+    Path[0] = '\0';
+    if (sscanf(url, "%7[a-z]://%99[^:/]:%d%n", scheme, Host, &port, &n) < 3 || port <= 0 || port > 65535
+	|| (strcmp(scheme, "udp") && strcmp(scheme, "http"))) {
+	sprintf(message, "%s/influx: invalid url >%s<, use udp://<ip>:<port> or http://<ip>:<port>/<path>",
+		DaemonName, url);
+	LOGERR(message);
+	return (-1);
+    }
+    snprintf(Path, sizeof(Path), "%s", url[n] ? url + n : "/write?db=ems&precision=ns");
+    Http = (strcmp(scheme, "http") == 0);
+    memset(&Addr, 0, sizeof(Addr));
+    Addr.sin_family = AF_INET;
+    Addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, Host, &Addr.sin_addr) != 1) {
+	sprintf(message, "%s/influx: invalid host >%s<, use an IPv4 address", DaemonName, Host);
+	LOGERR(message);
+	return (-1);
+    }
+    if (Sock >= 0)
+	close(Sock);
+    Sock = -1;
+    if (!Http && (Sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+	sprintf(message, "%s/influx: could not create socket, %s", DaemonName, strerror(errno));
+	LOGERR(message);
+	return (-1);
+    }
+
+    BatchSize = batchSize > 0 ? batchSize : atoi(Http ? BATCHHTTP : BATCHUDP);
+    BatchAge = (int64_t)(batchAge >= 0 ? batchAge : atoi(BATCHAGE)) * 1000000;
+    BufMax = (size_t)(retryKb > 0 ? retryKb : atoi(RETRYKB)) * 1024;
+    if (BufMax < BatchSize + LINESIZE)
+	BufMax = BatchSize + LINESIZE;
+    free(Buf);
+    if ((Buf = malloc(BufMax)) == NULL)
+	return (-1);
+    BufLen = 0;
+    memset(LastStamp, 0, sizeof(LastStamp));
+    return (0);
+}
+
+int influxInit(void) {
+    char message[2 * MAXPATH];
+
+    snprintf(Measurement, sizeof(Measurement), "%s", Conf->influx.measurement);
+    snprintf(Token, sizeof(Token), "%s", Conf->influx.token);
+    // batchsize 0 is the default of the transport
+    if (influxSetup(Conf->influx.url, Conf->influx.batchsize, Conf->influx.batchage, Conf->influx.retrykb) < 0)
+	return (-1);
+    sprintf(message, "%s/influx: sending %s to %s, batches of %u bytes or %d ms, buffer %u kB", DaemonName,
+	    Measurement, Conf->influx.url, (unsigned)BatchSize, (int)(BatchAge / 1000000), (unsigned)(BufMax / 1024));
+    LOGIT(message);
+    return (0);
+}
+
+// append line, dropping the oldest lines if the buffer is full
+static void influxAppend(const char *line, size_t len) {
+    struct influxStats *st = &emsPtr->stat.influx;
+    char *p;
+    size_t cut = 0;
+
+    while (BufLen - cut + len > BufMax && cut < BufLen) {
+	p = memchr(Buf + cut, '\n', BufLen - cut);
+	cut = (p == NULL) ? BufLen : (size_t)(p - Buf) + 1;
+	st->dropped++;
+    }
+    if (cut > 0) {
+	memmove(Buf, Buf + cut, BufLen - cut);
+	BufLen -= cut;
+    }
+    if (BufLen == 0)
+	BufSince = stampNow();
+    memcpy(Buf + BufLen, line, len);
+    BufLen += len;
+    st->lines++;
+    st->pending = BufLen;
+}
+
+// write header and body with one call, so they leave in the same segment
+static int writeAll(int fd, struct iovec *iov, int cnt) {
+    ssize_t n;
+
+    while (cnt > 0) {
+	if ((n = writev(fd, iov, cnt)) <= 0) {
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    return (-1);
+	}
+	for (; cnt > 0 && (size_t)n >= iov->iov_len; iov++, cnt--)
+	    n -= iov->iov_len;
+	if (cnt > 0) {
+	    iov->iov_base = (char *)iov->iov_base + n;
+	    iov->iov_len -= n;
+	}
+    }
+    return (0);
+}
+
+// read the answer to a POST, returns the HTTP status or -1
+static int httpAnswer(void) {
+    char buff[2048], *end, *p;
+    size_t len = 0, body = 0, have;
+    ssize_t n;
+    int status, keep = true;
+
+    // headers
+    while ((end = (len ? strstr(buff, "\r\n\r\n") : NULL)) == NULL) {
+	if (len >= sizeof(buff) - 1 || (n = read(Sock, buff + len, sizeof(buff) - 1 - len)) <= 0)
+	    return (-1);
+	len += n;
+	buff[len] = '\0';
+    }
+    if (sscanf(buff, "HTTP/1.%*d %d", &status) != 1)
+	return (-1);
+    for (p = buff; p < end; p++) {
+	if (strncasecmp(p, "\r\ncontent-length:", 17) == 0)
+	    body = strtoul(p + 17, NULL, 10);
+	if (strncasecmp(p, "\r\nconnection: close", 19) == 0)
+	    keep = false;
+    }
+    if (!keep) {
+	close(Sock);
+	Sock = -1;
+	return (status);
+    }
+
+    // skip the rest of the body (error text), keep the connection
+    have = len - (end + 4 - buff);
+    body = (have < body) ? body - have : 0;
+    while (body > 0) {
+	if ((n = read(Sock, buff, body < sizeof(buff) ? body : sizeof(buff))) <= 0)
+	    return (-1);
+	body -= n;
+    }
+    return (status);
+}
+
+// POST len bytes of lines, returns the HTTP status or -1 on a network error
+static int httpPost(char *p, size_t len) {
+    char head[3 * MAXPATH];
+    struct timeval tv = { 2, 0 };
+    struct iovec iov[2];
+    int status;
+
+    if (Sock < 0) {
+	if ((Sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	    return (-1);
+	setsockopt(Sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(Sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (connect(Sock, (struct sockaddr *)&Addr, sizeof(Addr)) < 0) {
+	    close(Sock);
+	    Sock = -1;
+	    return (-1);
+	}
+    }
+    iov[0].iov_base = head;
+    iov[0].iov_len = snprintf(head, sizeof(head), "POST %s HTTP/1.1\r\nHost: %s:%d\r\n"
+		    "Content-Type: text/plain; charset=utf-8\r\nContent-Length: %u\r\n%s%s%s\r\n",
+		    Path, Host, ntohs(Addr.sin_port), (unsigned)len,
+		    Token[0] ? "Authorization: Token " : "", Token, Token[0] ? "\r\n" : "");
+    iov[1].iov_base = p;
+    iov[1].iov_len = len;
+    if (writeAll(Sock, iov, 2) < 0 || (status = httpAnswer()) < 0) {
+	close(Sock);
+	Sock = -1;
+	return (-1);
+    }
+    return (status);
+}
+
+// send the buffer in batches, -1 if a batch failed and is kept for a retry
+int influxFlush(void) {
+    struct influxStats *st = &emsPtr->stat.influx;
+    char message[MAXPATH], *p;
+    size_t len;
+    int64_t t0;
+    uint32_t us;
+    int status;
+
+    while (BufLen > 0) {
+	// whole lines, at most BatchSize bytes (a longer line alone)
+	len = BufLen;
+	if (len > BatchSize) {
+	    for (p = Buf + BatchSize; p > Buf && p[-1] != '\n'; p--)
+		;
+	    len = (p > Buf) ? (size_t)(p - Buf) : (size_t)((char *)memchr(Buf, '\n', BufLen) - Buf) + 1;
+	}
+
+	t0 = stampNow();
+	if (Http)
+	    status = httpPost(Buf, len);
+	else
+	    status = (sendto(Sock, Buf, len, 0, (struct sockaddr *)&Addr, sizeof(Addr)) == (ssize_t)len) ? 204 : -1;
+
+	if (status < 0 || status >= 500) {
+	    // endpoint away or busy: keep the batch, try again later
+	    st->retries++;
+	    NextTry = stampNow() + (int64_t)RetryDelay * 1000000;
+	    if (Debug) {
+		sprintf(message, "%s/influx: sending %u bytes failed (%d), retry in %d ms", DaemonName,
+			(unsigned)len, status, RetryDelay);
+		LOGERR(message);
+	    }
+	    RetryDelay = (RetryDelay * 2 > RETRYMAX) ? RETRYMAX : RetryDelay * 2;
+	    return (-1);
+	}
+	if (status >= 300) {
+	    // refused (e.g. 400 bad line protocol): would never succeed
+	    for (p = Buf; p < Buf + len; p++)
+		st->dropped += (*p == '\n');
+	    sprintf(message, "%s/influx: batch of %u bytes refused with status %d, dropped", DaemonName,
+		    (unsigned)len, status);
+	    LOGERR(message);
+	}
+	else {
+	    st->batches++;
+	    st->bytes += len;
+	}
+	us = (stampNow() - t0) / 1000;
+	st->lastBatch = us;
+	if (us > st->maxBatch)
+	    st->maxBatch = us;
+	RetryDelay = RETRYMIN;
+	memmove(Buf, Buf + len, BufLen - len);
+	BufLen -= len;
+	BufSince = stampNow();
+	st->pending = BufLen;
+    }
+    return (0);
+}
+
+// the fields of the snapshot set by telegrams not written yet, as lines with
+// their receive time. Sent when a batch is full or due.
+int influxSend(const struct emsField *snap, int n, time_t t) {
+    static char line[LINESIZE];
+    struct influxStats *st = &emsPtr->stat.influx;
+    char num[24], done[MAXFIELDS];
+    int64_t stamp, now;
+    size_t pos;
+    int i, j, len;
+
+    if (Buf == NULL)
+	return (-1);
+    memset(done, 0, sizeof(done));
+    for (i = 0; i < n; i++) {
+	stamp = snap[i].stamp;
+	if (done[i] || stamp == 0 || stamp == LastStamp[i])
+	    continue;
+	// one line for all fields of this telegram
+	pos = snprintf(line, LINESIZE, "%s ", Measurement);
+	for (j = i; j < n && pos < LINESIZE; j++) {
+	    if (done[j] || snap[j].stamp != stamp)
+		continue;
+	    done[j] = true;
+	    LastStamp[j] = stamp;
+	    len = fieldFormat(&snap[j], num);
+	    pos += snprintf(line + pos, LINESIZE - pos, "%s%s=%.*s%s", j > i ? "," : "", snap[j].name, len, num,
+			    snap[j].type == FT_FIXED ? "" : "i");
+	    st->points++;
+	}
+	if (pos < LINESIZE)
+	    pos += snprintf(line + pos, LINESIZE - pos, " %lld\n", (long long)stamp);
+	if (pos < LINESIZE)
+	    influxAppend(line, pos);
+    }
+
+    now = stampNow();
+    if (BufLen == 0 || now < NextTry || (BufLen < BatchSize && now - BufSince < BatchAge))
+	return (0);
+    return (influxFlush());
+}
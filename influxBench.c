@@ -0,0 +1,152 @@
+//
+// influxBench.c - throughput of the influx sink against a local listener
+//
+// $Id$
+//
+// Runs influx.c without shared memory against a stand-in for InfluxDB on
+// 127.0.0.1 (a UDP socket resp. a minimal HTTP server answering 204) and
+// prints points/s and MB/s for some batch sizes. make influxbench
+//
+//   influxBench [snapshots]
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ems.h"
+
+#define FIELDS 40
+#define PERLINE 8       // fields set by one telegram
+
+static int Listen;
+static volatile uint64_t Lines, Bytes;
+
+static void *udpListener(void *arg) {
+    static char buff[65536];
+    ssize_t n, i;
+
+    while ((n = recv(Listen, buff, sizeof(buff), 0)) > 0) {
+	for (i = 0; i < n; i++)
+	    Lines += (buff[i] == '\n');
+	Bytes += n;
+    }
+    return (NULL);
+}
+
+static void *httpListener(void *arg) {
+    static char buff[1 << 22];
+    const char *ok = "HTTP/1.1 204 No Content\r\nContent-Length: 0\r\n\r\n";
+    char *end, *p;
+    size_t len, body, i;
+    ssize_t n;
+    int fd;
+
+    while ((fd = accept(Listen, NULL, NULL)) >= 0) {
+	for (len = 0;;) {
+	    buff[len] = '\0';
+	    if ((end = strstr(buff, "\r\n\r\n")) == NULL) {
+		if ((n = read(fd, buff + len, sizeof(buff) - 1 - len)) <= 0)
+		    break;
+		len += n;
+		continue;
+	    }
+	    p = strstr(buff, "Content-Length:");
+	    body = (p != NULL) ? strtoul(p + 15, NULL, 10) : 0;
+	    end += 4;
+	    while ((size_t)(buff + len - end) < body) {
+		if ((n = read(fd, buff + len, sizeof(buff) - 1 - len)) <= 0)
+		    goto done;
+		len += n;
+	    }
+	    for (i = 0; i < body; i++)
+		Lines += (end[i] == '\n');
+	    Bytes += body;
+	    if (write(fd, ok, strlen(ok)) < 0)
+		break;
+	    len -= end + body - buff;
+	    memmove(buff, end + body, len);
+	}
+    done:
+	close(fd);
+    }
+    return (NULL);
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void bench(const char *scheme, int batch, int snapshots) {
+    struct emsField snap[FIELDS];
+    struct sockaddr_in addr;
+    socklen_t alen = sizeof(addr);
+    pthread_t thread;
+    char url[MAXNAME];
+    int64_t stamp = 1700000000000000000LL;
+    uint64_t expect;
+    double t0, t1;
+    int i, j, size = 1 << 22;
+
+    Listen = socket(AF_INET, strcmp(scheme, "udp") ? SOCK_STREAM : SOCK_DGRAM, 0);
+    setsockopt(Listen, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(Listen, (struct sockaddr *)&addr, sizeof(addr));
+    getsockname(Listen, (struct sockaddr *)&addr, &alen);
+    if (strcmp(scheme, "udp"))
+	listen(Listen, 1);
+    Lines = Bytes = 0;
+    pthread_create(&thread, NULL, strcmp(scheme, "udp") ? httpListener : udpListener, NULL);
+
+    snprintf(url, sizeof(url), "%s://127.0.0.1:%d/write?db=ems&precision=ns", scheme, ntohs(addr.sin_port));
+    influxSetup(url, batch, 3600000, 8192);
+    memset(snap, 0, sizeof(snap));
+    for (i = 0; i < FIELDS; i++) {
+	snprintf(snap[i].name, FIELDNAME, "field%02d", i);
+	snap[i].type = (i % 2) ? FT_FIXED : FT_INT;
+	snap[i].scale = 1;
+    }
+
+    t0 = now();
+    for (j = 0; j < snapshots; j++) {
+	for (i = 0; i < FIELDS; i++) {
+	    snap[i].value = j * 7 + i;
+	    snap[i].stamp = stamp + (j * FIELDS + i) / PERLINE * 1000;
+	}
+	influxSend(snap, FIELDS, 0);
+    }
+    influxFlush();
+    t1 = now();
+
+    // wait for the listener to see all of it
+    expect = (uint64_t)snapshots * FIELDS / PERLINE;
+    for (i = 0; i < 100 && Lines < expect; i++)
+	nanosleep(&(struct timespec){ 0, 10000000 }, NULL);
+    printf("%-4s batch %6d: %8.0f points/s, %6.1f MB/s, %llu of %llu lines received\n", scheme, batch,
+	   snapshots * FIELDS / (t1 - t0), emsPtr->stat.influx.bytes / (t1 - t0) / 1e6,
+	   (unsigned long long)Lines, (unsigned long long)expect);
+    memset(&emsPtr->stat.influx, 0, sizeof(emsPtr->stat.influx));
+    shutdown(Listen, SHUT_RDWR);
+    close(Listen);
+    pthread_cancel(thread);
+    pthread_join(thread, NULL);
+}
+
+int main(int argc, char **argv) {
+    int snapshots = (argc > 1) ? atoi(argv[1]) : 100000;
+
+    sprintf(DaemonName, "influxBench");
+    emsPtr = calloc(1, sizeof(ems));
+    bench("udp", 1400, snapshots);
+    bench("udp", 8192, snapshots);
+    bench("http", 8192, snapshots);
+    bench("http", 65536, snapshots);
+    bench("http", 262144, snapshots);
+    return (0);
+}
@@ -3,6 +3,8 @@
 
  $Id: itoa.c 203 2020-11-23 18:38:26Z juh $
  */
+
+#include <stdint.h>
 	
 void strreverse(char* begin, char* end) {	
     char aux;
@@ -33,3 +35,46 @@ void itoa(int value, char* str, int base) {
     // Reverse string
     strreverse(str,wstr-1);
 }
+
+/**
+ * fast formatting of decoded values (no printf, no floating point)
+ *
+ * fmtInt() writes value in decimal, fmtFixed() writes a fixed point value
+ * stored as integer in units of 10^-scale, e.g. fmtFixed(-5, 1, s) gives
+ * "-0.5". Both return the length of the string written to str, which must
+ * hold at least 16 characters.
+ */
+
+int fmtFixed(int32_t value, int scale, char *str) {
+    char tmp[16];
+    char *t = tmp, *s = str;
+    uint32_t v;
+    int digits = 0;
+
+    // work on the magnitude, INT32_MIN has no positive counterpart in int32
+    v = value < 0 ? (uint32_t)0 - (uint32_t)value : (uint32_t)value;
+    if (scale < 0 || scale > 9)
+	scale = 0;
+
+    // digits in reverse order, at least scale + 1 of them ("0.5", not ".5")
+    do {
+	*t++ = '0' + v % 10;
+	v /= 10;
+	digits++;
+    } while (v || digits <= scale);
+
+    if (value < 0)
+	*s++ = '-';
+    while (t > tmp) {
+	if (scale && t - tmp == scale)
+	    *s++ = '.';
+	*s++ = *--t;
+    }
+    *s = '\0';
+
+    return (s - str);
+}
+
+int fmtInt(int32_t value, char *str) {
+    return (fmtFixed(value, 0, str));
+}
@@ -9,165 +9,246 @@
  // many valid cases. 
 # pragma GCC diagnostic ignored "-Wshadow"
 
+#define _DEFAULT_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
+
+#include <mosquitto.h>
 
 #include "ems.h"
 
+// mosquitto handle, local to this process (not in shared memory). It is
+// created once; connecting and reconnecting is done by MqttThread, so the
+// publish loop never waits for DNS, TCP or TLS.
+struct mosquitto *Mosq = NULL;
+
+// connection state machine:
+//
+//   DOWN --(connect started)--> CONNECTING --(CONNACK ok)--> UP
+//     ^                              |                         |
+//     +----(error, refused: backoff)-+----(connection lost)----+
+//
+// after a failure the thread waits a jittered, exponentially growing delay
+// between [EMS] reconnectmin and reconnectmax seconds before trying again
+enum mqttState { MQ_DOWN, MQ_CONNECTING, MQ_UP };
+
+static volatile int State = MQ_DOWN;
+static volatile int Attempt = 0;   // failed attempts since the last connect
+static int Refused = 0;            // CONNACK code of a refused connect, 0: none
+static int64_t DownSince = 0;      // ns, 0: never connected
+static pthread_t MqttThread;
+static int DelayMin, DelayMax;      // ms
+
+// another broker from a config reload, taken over by the connection thread
+static char NewBroker[MAXNAME];
+static int NewPort;
+static int Switch = false;
+
+// MQTT v5 ([EMS] mqttversion = 5, the default): topics registered with
+// mqttTopic() are sent with a topic alias, so the topic string goes over
+// the wire only once per connection, and with their QoS, retain flag and
+// message expiry. A broker refusing v5 is asked again with v3.1.1; then
+// topics are sent in full and the expiry is left out.
+//
+// Only QoS 0 messages go out with the alias alone: mosquitto sends QoS 1
+// and 2 messages again after a reconnect, when the alias is not known on
+// the new connection, so they always carry the topic as well. SendLock
+// keeps the connection thread from starting a new connection between the
+// state check of mqttSend() and its publish, so a message never takes the
+// alias of the last connection to the next one.
+#define MAXTOPICS (MAXFIELDS + 8)
+
+struct mqttTopic {
+    char name[2 * MAXNAME];
+    int qos;
+    bool retain;
+    mosquitto_property *alias;  // topic alias and expiry
+    mosquitto_property *plain;  // expiry only (or NULL)
+    uint32_t gen;               // connection the alias was announced on
+};
+
+static struct mqttTopic Topics[MAXTOPICS];
+static int NTopics = 0;
+static volatile int Proto = MQTT_PROTOCOL_V5;
+static volatile int AliasMax = 0;   // topic alias maximum of the broker
+static volatile uint32_t Gen = 1;   // incremented on every connect
+static pthread_mutex_t SendLock = PTHREAD_MUTEX_INITIALIZER;
+
+// the process this connection belongs to, see mqttOwner()
+static int Owner = PROC_MQTT;
+
+// subscription, renewed on every connect; messages go to OnMessage
+static char SubTopic[2 * MAXNAME];
+static void (*OnMessage)(const char *topic, const void *payload, int len) = NULL;
+
 void mosqLogCallback(struct mosquitto *mosq, void *userdata, int level, const char *str);
+void mosqConnectCallback(struct mosquitto *mosq, void *userdata, int rc, int flags, const mosquitto_property *props);
+void mosqDisconnectCallback(struct mosquitto *mosq, void *userdata, int rc);
+void mosqMessageCallback(struct mosquitto *mosq, void *userdata, const struct mosquitto_message *msg);
+static void *mqttRun(void *arg);
+static int pubResult(ems *emsPtr, const char *topic, const void *val, int len, int result);
 
+// the statistics of the owner of the connection
+static struct pubStats *mqttStats(void) {
+    return ((Owner == PROC_PUB) ? &emsPtr->stat.pubMqtt : &emsPtr->stat.mqtt);
+}
+
+// use client id, availability (proc[]) and statistics of process proc,
+// PROC_MQTT (default) or PROC_PUB for the mqtt sink of emsPub, so that both
+// can run side by side. Call before initMosquitto().
+void mqttOwner(int proc) {
+    Owner = proc;
+}
+
+// create the mosquitto instance (once) and start the connection thread
 int initMosquitto(ems *emsPtr) {
-    int result, retries, errval, loop;
-    char message[1000], error[100];
-
-    //initialize mosquitto
-    emsPtr->mqttAvail = false;
-
-    errval = 0;
-
-    sprintf(message, "emsMqtt-%d", emsPtr->mqttPid);
-    emsPtr->mosq = mosquitto_new(message, true, NULL);
-    if (emsPtr->mosq == NULL)
-	errval = errno;
-    
-    if (errval != 0) {
-	switch (errval) {
-	case ENOMEM:
-	    sprintf(error, "out of memory");
-	    break;
-	case EINVAL:
-	    sprintf(error, "invalid input parameters");
-	    break;
-	default:
-	    sprintf(error, "unknown error");
-	    break;
-	}
-	sprintf(message, "%s/mqtt/initMosquitto: could not initialize mosquitto for publishing, error %s", DaemonName, error);
+    char message[1000];
+    int result;
+
+    if (Mosq != NULL)
+	return (0);
+    emsPtr->proc[Owner].avail = false;
+
+    sprintf(message, "%s-%d", (Owner == PROC_PUB) ? "emsPub" : "emsMqtt", emsPtr->proc[Owner].pid);
+    Mosq = mosquitto_new(message, true, NULL);
+    if (Mosq == NULL) {
+	sprintf(message, "%s/mqtt/initMosquitto: could not initialize mosquitto for publishing, error %s",
+		DaemonName, errno == ENOMEM ? "out of memory" : errno == EINVAL ? "invalid input parameters" : "unknown error");
 	LOGERR(message);
 	return (-1);
     }
-    else {
-	sprintf(message, "%s/mqtt/initMosquitto: initialized mosquitto for publishing.\n", DaemonName);
-	LOGIT(message);
+
+    mosquitto_log_callback_set(Mosq, mosqLogCallback);
+    mosquitto_connect_v5_callback_set(Mosq, mosqConnectCallback);
+    mosquitto_disconnect_callback_set(Mosq, mosqDisconnectCallback);
+    mosquitto_message_callback_set(Mosq, mosqMessageCallback);
+
+    // check if cert is given
+    if (strlen(emsPtr->cfg.cert) > 5
+	&& (result = mosquitto_tls_set(Mosq, emsPtr->cfg.cert, NULL, NULL, NULL, NULL)) != MOSQ_ERR_SUCCESS) {
+	sprintf(message, "%s/mqtt/initMosquitto: could not use certificate %s, %s", DaemonName,
+		emsPtr->cfg.cert, mosquitto_strerror(result));
+	LOGERR(message);
     }
 
-    mosquitto_log_callback_set(emsPtr->mosq, mosqLogCallback);
-    
-    retries = 0;
-    
- retry:
+    Proto = (Conf->ems.mqttversion == MQTT_V5) ? MQTT_PROTOCOL_V5 : MQTT_PROTOCOL_V311;
+    mosquitto_int_option(Mosq, MOSQ_OPT_PROTOCOL_VERSION, Proto);
+
+    DelayMin = Conf->ems.reconnectmin * 1000;
+    DelayMax = (Conf->ems.reconnectmax * 1000 < DelayMin ? DelayMin : Conf->ems.reconnectmax * 1000);
+    srandom(time(NULL) ^ getpid());
 
-    sprintf(message, "%s/mqtt: trying to connect to broker >%s< (ptr = 0x%0x)",
-	    DaemonName, emsPtr->broker, (int)emsPtr);
+    if ((result = pthread_create(&MqttThread, NULL, mqttRun, NULL)) != 0) {
+	sprintf(message, "%s/mqtt/initMosquitto: could not start connection thread, %s", DaemonName, strerror(result));
+	LOGERR(message);
+	mosquitto_destroy(Mosq);
+	Mosq = NULL;
+	return (-1);
+    }
+    emsPtr->proc[Owner].avail = true;
+    sprintf(message, "%s/mqtt: connecting to broker >%s< port %d in the background, backoff %d..%d s",
+	    DaemonName, emsPtr->cfg.broker, emsPtr->cfg.port, DelayMin / 1000, DelayMax / 1000);
     LOGIT(message);
+    return (0);
+}
 
-    // check if cert is given
+// jittered exponential backoff: the n-th retry waits a random time between
+// half and all of min * 2^n, at most max
+static int backoff(int n) {
+    int64_t d = DelayMin;
 
-    if (emsPtr->cert != NULL && strlen(emsPtr->cert) > 5)
-	result =  mosquitto_tls_set(emsPtr->mosq, emsPtr->cert, NULL, NULL, NULL, NULL);
-    
-    result = mosquitto_connect_async(emsPtr->mosq, emsPtr->broker, emsPtr->port, 60); // get live sign from broker after 60 s
-    
-    switch (result) {
-    case MOSQ_ERR_CONN_PENDING: // -1
-	sprintf(message, "%s/mqtt: connection pending", DaemonName);
-	break;
-    case MOSQ_ERR_SUCCESS: // 0
-	sprintf(message, "%s/mqtt: successfully connected to broker >%s<", DaemonName, emsPtr->broker);
-	break;
-    case MOSQ_ERR_NOMEM: // 1
-	sprintf(message, "%s/mqtt: not enough memory", DaemonName);
-	break;
-    case MOSQ_ERR_PROTOCOL: // 2
-	sprintf(message, "%s/mqtt: protocol error", DaemonName);
-	break;
-    case MOSQ_ERR_INVAL: // 3
-	sprintf(message, "%s/mqtt: the input parameters were invalid. mosq = %d, broker = %s, port = %d",
-		DaemonName, (int)emsPtr->mosq, emsPtr->broker, emsPtr->port);
-	break;
-    case MOSQ_ERR_NO_CONN: // 4
-	sprintf(message, "%s/mqtt: no connection", DaemonName);
-	break;
-    case MOSQ_ERR_CONN_REFUSED: // 5
-	sprintf(message, "%s/mqtt: connection refused", DaemonName);
-	break;
-    case MOSQ_ERR_NOT_FOUND: // 6
-	sprintf(message, "%s/mqtt: error not found (?)", DaemonName);
-	break;
-    case MOSQ_ERR_CONN_LOST: // 7
-	sprintf(message, "%s/mqtt: connection lost", DaemonName);
-	break;
-    case MOSQ_ERR_TLS: // 8
-	sprintf(message, "%s/mqtt: tls error", DaemonName);
-	break;
-    case MOSQ_ERR_PAYLOAD_SIZE: // 9
-	sprintf(message, "%s/mqtt: payload size error", DaemonName);
-	break;
-    case MOSQ_ERR_NOT_SUPPORTED: // 10
-	sprintf(message, "%s/mqtt: error (?) not supported", DaemonName);
-	break;
-    case MOSQ_ERR_AUTH: // 11
-	sprintf(message, "%s/mqtt: authentification error", DaemonName);
-	break;
-    case MOSQ_ERR_UNKNOWN: // 13
-	sprintf(message, "%s/mqtt: unknown error", DaemonName);
-	break;
-    case MOSQ_ERR_PROXY: // 16
-	sprintf(message, "%s/mqtt: proxy error", DaemonName);
-	break;
-    case MOSQ_ERR_ACL_DENIED: // 1
-	sprintf(message, "%s/mqtt: acl error", DaemonName);
-	break;
-    case MOSQ_ERR_ERRNO:
-	sprintf(message, "%s/mqtt: a system call returned an error. errno %d (%s)", DaemonName, errno, strerror(errno));
-	break;
-    case MOSQ_ERR_EAI:
-	sprintf(message, "%s/mqtt: could not connect to broker >%s< (MOSQ_ERR_EAI), retry after 10 seconds, retry %d",
-		DaemonName, emsPtr->broker, retries);
-	retries++;
-	if (result) { // we got a non-zero value back
+    while (n-- > 0 && d < DelayMax)
+	d *= 2;
+    if (d > DelayMax)
+	d = DelayMax;
+    return (d / 2 + random() % (d / 2 + 1));
+}
+
+// the connection thread: connects, runs the network loop and reconnects
+static void *mqttRun(void *arg) {
+    char message[500];
+    int result, first = true, delay;
+
+    for (;;) {
+	if (__atomic_exchange_n(&Switch, false, __ATOMIC_ACQUIRE)) {
+	    snprintf(emsPtr->cfg.broker, sizeof(emsPtr->cfg.broker), "%s", NewBroker);
+	    emsPtr->cfg.port = NewPort;
+	    if (State != MQ_DOWN)
+		mosquitto_disconnect(Mosq);
+	    State = MQ_DOWN;
+	    Attempt = 0;
+	    first = true;   // connect to the new host, not reconnect
+	    sprintf(message, "%s/mqtt: switching to broker >%s< port %d", DaemonName, NewBroker, NewPort);
+	    LOGIT(message);
+	}
+	if (State == MQ_DOWN) {
+	    pthread_mutex_lock(&SendLock);
+	    State = MQ_CONNECTING;
+	    pthread_mutex_unlock(&SendLock);
+	    // may block on DNS and TCP, but only this thread
+	    if (first)
+		result = mosquitto_connect(Mosq, emsPtr->cfg.broker, emsPtr->cfg.port, 60); // live sign after 60 s
+	    else
+		result = mosquitto_reconnect(Mosq);
+	    first = false;
+	    if (result != MOSQ_ERR_SUCCESS) {
+		State = MQ_DOWN;
+		delay = backoff(Attempt++);
+		sprintf(message, "%s/mqtt: could not connect to broker >%s<: %s, retry %d in %d ms", DaemonName,
+			emsPtr->cfg.broker, result == MOSQ_ERR_ERRNO ? strerror(errno) : mosquitto_strerror(result),
+			Attempt, delay);
+		LOGERR(message);
+		usleep(delay * 1000);
+		continue;
+	    }
+	}
+	// TLS handshake, CONNACK, keepalive and the messages of the publish
+	// loop are handled here, the callbacks are called from this thread
+	result = mosquitto_loop(Mosq, 1000, 1);
+	if (Refused) {
+	    // not authorized and the like: back off as for a failed connect
+	    delay = backoff(Attempt++);
+	    sprintf(message, "%s/mqtt: broker >%s< refused connection: %s, retry %d in %d ms", DaemonName,
+		    emsPtr->cfg.broker, mosquitto_connack_string(Refused), Attempt, delay);
 	    LOGERR(message);
+	    Refused = 0;
+	    usleep(delay * 1000);
+	    continue;
 	}
-
-	sleep(10);
-	if (retries < 7)
-	    goto retry;
-	else {
-	    emsPtr->mqttAvail = false;
-	    return (result);
+	if (result != MOSQ_ERR_SUCCESS) {
+	    if (State == MQ_UP) {
+		// lost without a disconnect callback
+		mqttStats()->disconnects++;
+		DownSince = stampNow();
+	    }
+	    State = MQ_DOWN;
+	    delay = backoff(Attempt++);
+	    if (Debug) {
+		sprintf(message, "%s/mqtt: network loop: %s, reconnect in %d ms", DaemonName,
+			mosquitto_strerror(result), delay);
+		LOGIT(message);
+	    }
+	    usleep(delay * 1000);
 	}
-	break;
-    default:
-	sprintf(message, "%s/mqtt: error return from connect %d, %s", DaemonName, result, mosquitto_strerror(result));
-	break;
     }
+    return (NULL);
+}
 
-    if (result) { // we got a non-zero value back
-	LOGERR(message);
-	emsPtr->mqttAvail = false;
-	return (result);
-    }
-    else {
-	LOGIT(message);
-	emsPtr->mqttAvail = true;
-    }
-    
-    loop = mosquitto_loop_start(emsPtr->mosq);
-    
-    if (loop != MOSQ_ERR_SUCCESS) {
-	sprintf(message, "%s/mqtt: Unable to start mosquitto loop: %i", DaemonName, loop);
-	LOGERR(message);
-	emsPtr->mqttAvail = false;
-	return (loop);
-    }
-    else {
-	sprintf(message, "%s/mqtt: started mosquitto loop %i", DaemonName, loop);
-	LOGIT(message);
+// use broker host:port from now on, the connection thread disconnects and
+// connects there; the publish loop is not held up
+void mqttBroker(const char *host, int port) {
+    if (Mosq == NULL) {
+	snprintf(emsPtr->cfg.broker, sizeof(emsPtr->cfg.broker), "%s", host);
+	emsPtr->cfg.port = port;
+	return;
     }
-    
-    return (result);
-}    
+    snprintf(NewBroker, sizeof(NewBroker), "%s", host);
+    NewPort = port;
+    __atomic_store_n(&Switch, true, __ATOMIC_RELEASE);
+}
 
 void mosqLogCallback(struct mosquitto *mosq, void *userdata, int level, const char *str)
 {
@@ -194,66 +275,229 @@ void mosqLogCallback(struct mosquitto *mosq, void *userdata, int level, const ch
 	LOGIT(message);
 }
 
-void mqttPublish(ems *emsPtr, char *topic, void *val, int qos, bool retain) {
+void mosqConnectCallback(struct mosquitto *mosq, void *userdata, int rc, int flags, const mosquitto_property *props) {
+    struct pubStats *s = mqttStats();
+    char message[500];
+    uint16_t max = 0;
+    uint32_t ms;
+
+    if (rc) {
+	State = MQ_DOWN;
+	// 1: unacceptable protocol version (3.1.1), 0x84: unsupported (v5);
+	// the only case retried at once, mqttRun() backs off for all others
+	if (Proto == MQTT_PROTOCOL_V5 && (rc == 1 || rc == 0x84)) {
+	    Proto = MQTT_PROTOCOL_V311;
+	    mosquitto_int_option(mosq, MOSQ_OPT_PROTOCOL_VERSION, Proto);
+	    Attempt = 0;
+	    sprintf(message, "%s/mqtt: broker does not speak MQTT v5, falling back to v3.1.1", DaemonName);
+	    LOGERR(message);
+	} else
+	    Refused = rc;
+	return;
+    }
+    if (Proto == MQTT_PROTOCOL_V5)
+	mosquitto_property_read_int16(props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, &max, false);
+    AliasMax = max;
+    // mqttSend() sees the new generation once it sees the connection up
+    __atomic_add_fetch(&Gen, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&State, MQ_UP, __ATOMIC_RELEASE);
+    Attempt = 0;
+    s->connects++;
+    if (DownSince != 0) {
+	ms = (stampNow() - DownSince) / 1000000;
+	s->lastReconnect = ms;
+	if (ms > s->maxReconnect)
+	    s->maxReconnect = ms;
+	DownSince = 0;
+    }
+    sprintf(message, "%s/mqtt: connected to broker >%s< with MQTT %s, %d topic aliases, reconnect took %u ms",
+	    DaemonName, emsPtr->cfg.broker, Proto == MQTT_PROTOCOL_V5 ? "v5" : "v3.1.1", AliasMax, s->lastReconnect);
+    LOGIT(message);
+
+    if (SubTopic[0] != '\0' && (rc = mosquitto_subscribe(mosq, NULL, SubTopic, 1)) != MOSQ_ERR_SUCCESS) {
+	sprintf(message, "%s/mqtt: could not subscribe to %s, %s", DaemonName, SubTopic, mosquitto_strerror(rc));
+	LOGERR(message);
+    }
+}
+
+void mosqDisconnectCallback(struct mosquitto *mosq, void *userdata, int rc) {
+    char message[200];
+
+    if (State == MQ_UP) {
+	mqttStats()->disconnects++;
+	DownSince = stampNow();
+    }
+    State = MQ_DOWN;
+    sprintf(message, "%s/mqtt: disconnected from broker, %s", DaemonName, rc ? "connection lost" : "on request");
+    LOGERR(message);
+}
+
+// called from the connection thread for every message on SubTopic
+void mosqMessageCallback(struct mosquitto *mosq, void *userdata, const struct mosquitto_message *msg) {
+    if (OnMessage != NULL)
+	OnMessage(msg->topic, msg->payload, msg->payloadlen);
+}
+
+// subscribe to topic (with wildcards) from the next connect on, handler is
+// called from the connection thread. Call before initMosquitto().
+void mqttSubscribe(const char *topic, void (*handler)(const char *topic, const void *payload, int len)) {
+    snprintf(SubTopic, sizeof(SubTopic), "%s", topic);
+    OnMessage = handler;
+}
+
+// is the broker connected right now?
+int mqttConnected(void) {
+    return (State == MQ_UP);
+}
+
+// send len bytes of val on topic. Does not block: when the broker is not
+// reachable the message is not sent (the caller may spool it), reconnecting
+// is left to the mosquitto loop thread. Returns the mosquitto result.
+int mqttPublish(ems *emsPtr, const char *topic, const void *val, int len, int qos, bool retain) {
     char message[1000];
     int result;
 
-    // check if already initialzed
-    if (emsPtr->mosq == NULL) {
-	sprintf(message, "%s/mqtt/mqttPublish: mosquitto not initialized, abort", DaemonName);
-	LOGERR(message);
-	return;
+    // not initialized or not connected: do not queue it inside mosquitto
+    if (Mosq == NULL || State != MQ_UP) {
+	mqttStats()->errors++;
+	if (Debug) {
+	    sprintf(message, "%s/mqtt/mqttPublish: mosquitto not %s, %s not sent", DaemonName,
+		    Mosq == NULL ? "initialized" : "connected", topic);
+	    LOGERR(message);
+	}
+	return (MOSQ_ERR_NO_CONN);
     }
-    
-    if (!emsPtr->mqttAvail) {
-	sprintf(message, "%s/mqtt/mqttPublish: mosquitto not available, abort", DaemonName);
+
+    result = mosquitto_publish(Mosq, NULL, topic, len, val, qos, retain);
+    return (pubResult(emsPtr, topic, val, len, result));
+}
+
+// register topic with its policy, expiry in s (0: none). Returns the id for
+// mqttSend() or -1.
+int mqttTopic(const char *topic, int qos, bool retain, uint32_t expiry) {
+    struct mqttTopic *t;
+
+    char message[3 * MAXNAME];
+
+    if (NTopics >= MAXTOPICS) {
+	snprintf(message, sizeof(message), "%s/mqtt: more than %d topics, %s is not sent", DaemonName,
+		 MAXTOPICS, topic);
 	LOGERR(message);
-	return;
+	return (-1);
+    }
+    t = &Topics[NTopics];
+    snprintf(t->name, sizeof(t->name), "%s", topic);
+    t->qos = (qos < 0 || qos > 2) ? 1 : qos;
+    t->retain = retain;
+    t->alias = t->plain = NULL;
+    t->gen = 0;
+    if (expiry > 0) {
+	mosquitto_property_add_int32(&t->alias, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, expiry);
+	mosquitto_property_add_int32(&t->plain, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, expiry);
+    }
+    mosquitto_property_add_int16(&t->alias, MQTT_PROP_TOPIC_ALIAS, NTopics + 1);
+    return (NTopics++);
+}
+
+// register topic with the policy of key in [TOPICS] (format see
+// emsMqtt.c), retain unless the key says otherwise. Returns its id
+int topicPolicy(const char *key, const char *topic, int retain) {
+    const char *v;
+    char *p;
+    int qos = Conf->topics.qos, expiry = Conf->topics.expiry;
+
+    if (key[0] != '\0' && (v = cfgGet("TOPICS", key)) != NULL) {
+	qos = strtol(v, &p, 10);
+	while ((p = strchr(p, ',')) != NULL) {
+	    p++;
+	    if (strncmp(p, "retain", 6) == 0)
+		retain = true;
+	    else if (strncmp(p, "noretain", 8) == 0)
+		retain = false;
+	    else if (strncmp(p, "expiry=", 7) == 0)
+		expiry = atoi(p + 7);
+	}
+    }
+    return (mqttTopic(topic, qos, retain, expiry > 0 ? expiry : 0));
+}
+
+// send len bytes of val on the registered topic id, with QoS 0 with its
+// alias alone from the second message of a connection on. Does not block,
+// like mqttPublish().
+int mqttSend(ems *emsPtr, int id, const void *val, int len) {
+    struct mqttTopic *t;
+    uint32_t gen;
+    int result;
+
+    if (id < 0 || id >= NTopics) {
+	mqttStats()->errors++;
+	return (MOSQ_ERR_INVAL);
+    }
+    t = &Topics[id];
+    pthread_mutex_lock(&SendLock);
+    if (Mosq == NULL || __atomic_load_n(&State, __ATOMIC_ACQUIRE) != MQ_UP) {
+	pthread_mutex_unlock(&SendLock);
+	mqttStats()->errors++;
+	return (MOSQ_ERR_NO_CONN);
+    }
+    gen = Gen;
+    if (Proto != MQTT_PROTOCOL_V5)
+	result = mosquitto_publish(Mosq, NULL, t->name, len, val, t->qos, t->retain);
+    else if (id + 1 > AliasMax)
+	result = mosquitto_publish_v5(Mosq, NULL, t->name, len, val, t->qos, t->retain, t->plain);
+    else {
+	// the topic string with the first message after a connect and
+	// with every one that may be sent again on the next connection
+	result = mosquitto_publish_v5(Mosq, NULL, (t->gen == gen && t->qos == 0) ? NULL : t->name, len, val,
+				      t->qos, t->retain, t->alias);
+	if (result == MOSQ_ERR_SUCCESS)
+	    t->gen = gen;
+    }
+    pthread_mutex_unlock(&SendLock);
+    return (pubResult(emsPtr, t->name, val, len, result));
+}
+
+// statistics and log of a publish
+static int pubResult(ems *emsPtr, const char *topic, const void *val, int len, int result) {
+    char message[1000];
+
+    if (result == MOSQ_ERR_SUCCESS) {
+	mqttStats()->lastData = time(NULL);
+	mqttStats()->published++;
+	if (Debug) {
+	    snprintf(message, sizeof(message), "%s/mqtt/mqttPublish: successfull sent val %.*s for topic %s",
+		     DaemonName, len, (const char *)val, topic);
+	    LOGIT(message);
+	}
+	return (result);
     }
-    
 
-    result = mosquitto_publish(emsPtr->mosq, NULL, topic, strlen(val), val, qos, retain);
-	
     switch (result) {
-	
-    case MOSQ_ERR_SUCCESS:
-	emsPtr->lastData = time(NULL);
-	sprintf(message, "%s/mqtt/mqttPublish: successfull sent val %s for topic %s", DaemonName, (char *)val, topic);
-	break;
     case MOSQ_ERR_INVAL:
-	sprintf(message, "%s/mqtt/mqttPublish: the input parameters (%s, %s) were invalid.", DaemonName, topic, (char *)val);
+	snprintf(message, sizeof(message), "%s/mqtt/mqttPublish: the input parameters (%s, %.*s) were invalid.",
+		 DaemonName, topic, len, (const char *)val);
 	break;
     case MOSQ_ERR_NOMEM:
 	sprintf(message, "%s/mqtt/mqttPublish: out of memory condition occurred.", DaemonName);
 	break;
     case MOSQ_ERR_NO_CONN:
-	sleep(5);
-	mosquitto_reconnect(emsPtr->mosq);
-	result = mosquitto_publish(emsPtr->mosq, NULL, topic, strlen(val), val, qos, retain);
-	sprintf(message, "%s/mqtt/mqttPublish: the client wasn’t connected to a broker, tried to reconnect. Result of re-sending is %s",
-		DaemonName, mosquitto_strerror(result));
+	sprintf(message, "%s/mqtt/mqttPublish: the client is not connected to a broker, %s dropped", DaemonName, topic);
 	break;
     case MOSQ_ERR_PROTOCOL:
 	sprintf(message, "%s/mqtt/mqttPublish: there is a protocol error communicating with the broker", DaemonName);
 	break;
     case MOSQ_ERR_PAYLOAD_SIZE:
-	sprintf(message, "%s/mqtt/mqttPublish: payloadlen (%d) is too large", DaemonName, strlen(val));
+	sprintf(message, "%s/mqtt/mqttPublish: payloadlen (%d) is too large", DaemonName, len);
 	break;
     case MOSQ_ERR_MALFORMED_UTF8:
 	sprintf(message, "%s/mqtt/mqttPublish: the topic (%s) is not valid UTF-8", DaemonName, topic);
 	break;
     default:
 	sprintf(message, "%s/mqtt/mqttPublish: error (%d) from  mosquitto_publish(), %s", DaemonName, result, mosquitto_strerror(result));
-	sleep(5);
-	mosquitto_reconnect(emsPtr->mosq);
 	break;
     }
-    
-    if (result) {
-	LOGERR(message);
-    }
-    else {
-	if (Debug)
-	    LOGIT(message);
-    }
+
+    mqttStats()->errors++;
+    LOGERR(message);
+    return (result);
 }
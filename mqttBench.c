@@ -0,0 +1,184 @@
+//
+// mqttBench.c - topic aliases and QoS of mqtt.c against a local broker
+//
+// $Id$
+//
+// Publishes through mqtt.c like emsMqtt: FIELDS topics <prefix>/fieldNN,
+// round robin, and subscribes to <prefix>/# to count what the broker
+// delivers back. The connection goes through a relay on 127.0.0.1 that
+// counts the bytes sent to the broker, so the aliases show up as bytes per
+// message. Start mosquitto first (mosquitto -p 1883). make mqttbench
+//
+//   mqttBench [-3] [-q qos] [-n messages] [host [port]]
+//
+// -3 speaks MQTT v3.1.1 (full topics), the default is v5 with aliases.
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <mosquitto.h>
+
+#include "ems.h"
+
+#define FIELDS 40
+#define PREFIX "emsbench/a/long/topic/prefix/like/in/the/field"
+
+int initMosquitto(ems *emsPtr);
+int mqttConnected(void);
+int mqttTopic(const char *topic, int qos, bool retain, uint32_t expiry);
+int mqttSend(ems *emsPtr, int id, const void *val, int len);
+void mqttSubscribe(const char *topic, void (*handler)(const char *topic, const void *payload, int len));
+
+static int Listen;
+static const char *Host = "127.0.0.1";
+static const char *Port = "1883";
+static volatile uint64_t Up;        // bytes from us to the broker
+static volatile uint32_t Received;  // messages delivered back
+
+static void onMessage(const char *topic, const void *payload, int len) {
+    __atomic_add_fetch(&Received, 1, __ATOMIC_RELAXED);
+}
+
+// copy fd from to fd to, returns the bytes or -1 when one of them closed
+static ssize_t relay(int from, int to) {
+    char buff[16384];
+    ssize_t n;
+
+    if ((n = read(from, buff, sizeof(buff))) <= 0 || write(to, buff, n) != n)
+	return (-1);
+    return (n);
+}
+
+// accept the connections of mqtt.c and pass them on to the broker
+static void *relayThread(void *arg) {
+    struct addrinfo hints, *ai;
+    struct pollfd p[2];
+    ssize_t n;
+    int fd, broker;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    while ((fd = accept(Listen, NULL, NULL)) >= 0) {
+	if (getaddrinfo(Host, Port, &hints, &ai) != 0) {
+	    close(fd);
+	    continue;
+	}
+	broker = socket(ai->ai_family, SOCK_STREAM, 0);
+	if (broker < 0 || connect(broker, ai->ai_addr, ai->ai_addrlen) < 0) {
+	    fprintf(stderr, "mqttBench: can not connect to %s port %s\n", Host, Port);
+	    exit(1);
+	}
+	freeaddrinfo(ai);
+	p[0].fd = fd;
+	p[1].fd = broker;
+	p[0].events = p[1].events = POLLIN;
+	for (;;) {
+	    if (poll(p, 2, -1) < 0)
+		break;
+	    if (p[0].revents) {
+		if ((n = relay(fd, broker)) < 0)
+		    break;
+		Up += n;
+	    }
+	    if (p[1].revents && relay(broker, fd) < 0)
+		break;
+	}
+	close(broker);
+	close(fd);
+    }
+    return (NULL);
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+int main(int argc, char **argv) {
+    static struct conf cf;
+    struct sockaddr_in addr;
+    socklen_t alen = sizeof(addr);
+    pthread_t thread;
+    char topic[2 * MAXNAME], val[16];
+    int id[FIELDS];
+    uint64_t up0;
+    double t0, t1;
+    int c, i, len, qos = 0, v3 = false, messages = 100000;
+
+    while ((c = getopt(argc, argv, "3q:n:")) != -1) {
+	switch (c) {
+	case '3':
+	    v3 = true;
+	    break;
+	case 'q':
+	    qos = atoi(optarg);
+	    break;
+	case 'n':
+	    messages = atoi(optarg);
+	    break;
+	default:
+	    fprintf(stderr, "usage: %s [-3] [-q qos] [-n messages] [host [port]]\n", argv[0]);
+	    exit(1);
+	}
+    }
+    if (optind < argc)
+	Host = argv[optind++];
+    if (optind < argc)
+	Port = argv[optind++];
+
+    sprintf(DaemonName, "mqttBench");
+    emsPtr = calloc(1, sizeof(ems));
+    cf.ems.mqttversion = v3 ? MQTT_V311 : MQTT_V5;
+    cf.ems.reconnectmin = cf.ems.reconnectmax = 1;
+    Conf = &cf;
+
+    Listen = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(Listen, (struct sockaddr *)&addr, sizeof(addr));
+    getsockname(Listen, (struct sockaddr *)&addr, &alen);
+    listen(Listen, 1);
+    pthread_create(&thread, NULL, relayThread, NULL);
+    snprintf(emsPtr->cfg.broker, sizeof(emsPtr->cfg.broker), "127.0.0.1");
+    emsPtr->cfg.port = ntohs(addr.sin_port);
+
+    for (i = 0; i < FIELDS; i++) {
+	snprintf(topic, sizeof(topic), "%s/field%02d", PREFIX, i);
+	id[i] = mqttTopic(topic, qos, false, 0);
+    }
+    mqttSubscribe(PREFIX "/#", onMessage);
+    mosquitto_lib_init();
+    if (initMosquitto(emsPtr) < 0)
+	exit(1);
+    for (i = 0; i < 500 && !mqttConnected(); i++)
+	nanosleep(&(struct timespec){ 0, 10000000 }, NULL);
+    if (!mqttConnected()) {
+	fprintf(stderr, "mqttBench: no connection to %s port %s\n", Host, Port);
+	exit(1);
+    }
+    nanosleep(&(struct timespec){ 0, 200000000 }, NULL); // SUBACK
+
+    up0 = Up;
+    t0 = now();
+    for (i = 0; i < messages; i++) {
+	len = snprintf(val, sizeof(val), "%d.%d", i % 100, i % 10);
+	mqttSend(emsPtr, id[i % FIELDS], val, len);
+    }
+    // until the broker delivered all of them back (QoS 0 may lose some)
+    for (i = 0; i < 1000 && Received < (uint32_t)messages; i++)
+	nanosleep(&(struct timespec){ 0, 10000000 }, NULL);
+    t1 = now();
+
+    printf("MQTT %s QoS %d: %d messages in %.3f s, %.0f messages/s, %.1f bytes/message to the broker, %u received\n",
+	   v3 ? "v3.1.1" : "v5", qos, messages, t1 - t0, Received / (t1 - t0),
+	   (double)(Up - up0) / messages, Received);
+    return (0);
+}
@@ -16,16 +16,132 @@
 #include <sys/types.h>
 #include <uuid/uuid.h>
 #include <unistd.h>      // for usleep()
+#include <ctype.h>       // for tolower()
+#include <pthread.h>
+
+#include <libMsbClientC.h>  // in /usr/local/include
 
 #include "ems.h"
 
+// msb client, local to this process (not in shared memory)
+msbClient *Client = NULL;
+
+// publishing is asynchronous: msb() only puts a sample of the fields
+// flagged FF_MSB into a bounded queue (the oldest is dropped when it is
+// full). A sender thread hands the samples to the client without waiting,
+// up to Pipe events. The client has no completion callback or fd, so the
+// sender polls its dataOutInterfaceFlag, every 20 ms while events are in
+// flight and 10 ms when the pipeline is full, and counts the events sent
+// in the msb statistics. Only the sender waits, never the sampling loop.
+//
+// With [V4K] batch > 1 the event is an array: up to batch samples, each with
+// its time (ms since epoch), are sent as one event, or fewer once the oldest
+// is batchtime ms old.
+#define MSBQUEUE 64     // samples waiting for the sender
+#define MSBPIPE 8       // events handed to the client before waiting for it
+#define MSBBATCH 256    // most samples of an array event, see [V4K] batch
+
+struct msbSample {
+    int64_t stamp;      // ns, when it was taken
+    double v[MAXFIELDS];
+};
+
+static struct msbSample Queue[MSBQUEUE];
+static uint32_t QHead = 0, QTail = 0;   // next to put / to send
+static pthread_mutex_t QLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t QCond = PTHREAD_COND_INITIALIZER;
+static pthread_t Sender;
+
+// one payload per pipeline slot, built once by initMsb(): an object with
+// one double per FF_MSB field, or an array of Batch such objects with a
+// time each. The values are updated in place before each publish.
+static json_object *Payload[MSBPIPE];
+static json_object **Elem;      // [slot][sample], the objects of the samples
+static json_object **Values;    // [slot][sample][field]
+static json_object **Times;     // [slot][sample]
+static int Ids[MAXFIELDS];      // ids of the FF_MSB fields
+static int NIds = 0;
+static int Pipe = MSBPIPE, Batch = 1;
+static int64_t BatchTime;       // ns
+static struct emsField Snap[MAXFIELDS];
+
+// sender thread only
+static int Slot = 0, Fill = 0;  // next slot, samples in it
+static int64_t SlotStamp[MSBPIPE];  // first sample of each slot
+
+static void *msbSender(void *arg);
+
 extern int usleep (__useconds_t __useconds);
 char* msbObjectSelfDescription(const msbObject* object);
 
+// msb property names are the field names in lower case
+static void msbPropName(const char *name, char *prop) {
+    while (*name)
+	*prop++ = tolower((unsigned char)*name++);
+    *prop = '\0';
+}
+
+
+// read the msb settings of [V4K] into the configuration
+int msbConfig(ems *myEmsPtr) {
+    const struct conf *c = Conf;
+    char message[2 * MAXPATH];
+
+    snprintf(myEmsPtr->cfg.msbUrl, sizeof(myEmsPtr->cfg.msbUrl), "%s", c->v4k.url);
+    snprintf(myEmsPtr->cfg.msbPort, sizeof(myEmsPtr->cfg.msbPort), "%s", c->v4k.port);
+    snprintf(myEmsPtr->cfg.msbCert, sizeof(myEmsPtr->cfg.msbCert), "%s", c->v4k.cert);
+    snprintf(myEmsPtr->cfg.msbUuid, sizeof(myEmsPtr->cfg.msbUuid), "%s", c->v4k.uuid);
+    snprintf(myEmsPtr->cfg.msbToken, sizeof(myEmsPtr->cfg.msbToken), "%s", c->v4k.token);
+    snprintf(myEmsPtr->cfg.msbClass, sizeof(myEmsPtr->cfg.msbClass), "%s", c->v4k.class);
+    snprintf(myEmsPtr->cfg.msbName, sizeof(myEmsPtr->cfg.msbName), "%s", c->v4k.name);
+    snprintf(myEmsPtr->cfg.msbDescription, sizeof(myEmsPtr->cfg.msbDescription), "%s", c->v4k.description);
+    myEmsPtr->cfg.interval = c->v4k.interval;
+    snprintf(message, sizeof(message), "%s: url >%s<, port >%s<, cert >%s<, uuid >%s<, token >%s<", DaemonName,
+	     c->v4k.url, c->v4k.port, c->v4k.cert, c->v4k.uuid, c->v4k.token);
+    LOGIT(message);
+    snprintf(message, sizeof(message), "%s: class >%s<, name >%s<, description >%s<, interval %d µs", DaemonName,
+	     c->v4k.class, c->v4k.name, c->v4k.description, c->v4k.interval);
+    LOGIT(message);
+    return (0);
+}
+
+// build the payloads of all pipeline slots, the only allocation of them
+static void msbPayloads(void) {
+    char prop[FIELDNAME];
+    json_object *e;
+    int i, j, k;
+
+    for (i = 0, NIds = 0; i < (int)emsPtr->reg.nFields; i++)
+	if (emsPtr->field[i].flags & FF_MSB)
+	    Ids[NIds++] = i;
+    Elem = calloc(Pipe * Batch, sizeof(*Elem));
+    Times = calloc(Pipe * Batch, sizeof(*Times));
+    Values = calloc(Pipe * Batch * NIds + 1, sizeof(*Values));
+    for (j = 0; j < Pipe; j++) {
+	if (Batch > 1)
+	    Payload[j] = json_object_new_array();
+	for (k = 0; k < Batch; k++) {
+	    e = Elem[j * Batch + k] = json_object_new_object();
+	    if (Batch > 1) {
+		Times[j * Batch + k] = json_object_new_int64(0);
+		json_object_object_add(e, "time", Times[j * Batch + k]);
+		// our own reference, the array drops its one when it is cut
+		json_object_array_add(Payload[j], json_object_get(e));
+	    }
+	    else
+		Payload[j] = e;
+	    for (i = 0; i < NIds; i++) {
+		msbPropName(emsPtr->field[Ids[i]].name, prop);
+		Values[(j * Batch + k) * NIds + i] = json_object_new_double(0.0);
+		json_object_object_add(e, prop, Values[(j * Batch + k) * NIds + i]);
+	    }
+	}
+    }
+}
 
 int initMsb(ems *myEmsPtr) {
     int result = 0;
-    char message[MAXPATH], error[MAXPATH];
+    char message[MAXPATH], error[MAXPATH], prop[FIELDNAME];
     uuid_t uuid;
 
     // use this only for session id
@@ -38,9 +154,9 @@ int initMsb(ems *myEmsPtr) {
 	if (unp[i] != '-')
 	    t[j++] = unp[i];
     
-    strcpy((char *)uuid, myEmsPtr->msbUuid);
+    strcpy((char *)uuid, myEmsPtr->cfg.msbUuid);
 
-    sprintf(message, "initMsb: uuid = %s, token = %s, t = %s", myEmsPtr->msbUuid, myEmsPtr->msbToken, t);
+    sprintf(message, "initMsb: uuid = %s, token = %s, t = %s", myEmsPtr->cfg.msbUuid, myEmsPtr->cfg.msbToken, t);
     LOGIT(message);
 
 /**
@@ -68,56 +184,56 @@ int initMsb(ems *myEmsPtr) {
 , DESCRIPTION, false, NULL, NULL, NULL);
 
 */
-    myEmsPtr->client = msbClientNewClientURL(
-					     myEmsPtr->msbUrl,
+    Client = msbClientNewClientURL(
+					     myEmsPtr->cfg.msbUrl,
 					     NULL, // origin
-					     myEmsPtr->msbUuid,
-					     myEmsPtr->msbToken,
-					     myEmsPtr->msbClass,
-					     myEmsPtr->msbName,
-					     myEmsPtr->msbDescription,
+					     myEmsPtr->cfg.msbUuid,
+					     myEmsPtr->cfg.msbToken,
+					     myEmsPtr->cfg.msbClass,
+					     myEmsPtr->cfg.msbName,
+					     myEmsPtr->cfg.msbDescription,
 					     false, // use tls TODO: check if url starts with wss and set it to true
 					     NULL, // path to client cert
 					     NULL, // path to client key
 					     NULL  // path to ca certificate
 					     );
 
-    sprintf(message, "initMsb: created client, ptr 0x%0x", (unsigned int)myEmsPtr->client);
+    sprintf(message, "initMsb: created client, ptr %p", (void *)Client);
     LOGIT(message);
     
     if (Debug)
-	msbClientSetDebug(myEmsPtr->client, true);
+	msbClientSetDebug(Client, true);
     else
-	msbClientSetDebug(myEmsPtr->client, false);
+	msbClientSetDebug(Client, false);
     Line = __LINE__;    
-    msbClientUseSockJSPath(myEmsPtr->client,
+    msbClientUseSockJSPath(Client,
 			   "000", // server_id
 			   t, // session_id
 			   "websocket" // transport_id
 			   );
     Line = __LINE__;    
-    msbClientSetSockJSFraming(myEmsPtr->client,
+    msbClientSetSockJSFraming(Client,
 			       1 // framing active
 			       );
     Line = __LINE__;    
 
-    msbClientSetFunctionCacheSize(myEmsPtr->client, 100);
+    msbClientSetFunctionCacheSize(Client, 100);
     Line = __LINE__;    
-    msbClientSetEventCacheSize(myEmsPtr->client, 100);
+    msbClientSetEventCacheSize(Client, 100);
     Line = __LINE__;    
 
 
-    msbClientRunClientStateMachine(myEmsPtr->client);
+    msbClientRunClientStateMachine(Client);
     Line = __LINE__;    
 
     json_object* dataformat = json_object_new_object();
     
-    int bl = myEmsPtr->debug ? 0 : 1;
-    msbClientAddConfigParam(myEmsPtr->client, "debug", MSB_BOOL, MSB_NONE, &bl);
+    int bl = myEmsPtr->ctl.debug ? 0 : 1;
+    msbClientAddConfigParam(Client, "debug", MSB_BOOL, MSB_NONE, &bl);
     Line = __LINE__;    
     
-    int32_t interval = myEmsPtr->interval;
-    msbClientAddConfigParam(myEmsPtr->client, "interval", MSB_INTEGER, MSB_INT32, &interval);
+    int32_t interval = myEmsPtr->cfg.interval;
+    msbClientAddConfigParam(Client, "interval", MSB_INTEGER, MSB_INT32, &interval);
     Line = __LINE__;    
 
     json_object *dataObject;
@@ -129,56 +245,63 @@ int initMsb(ems *myEmsPtr) {
     json_object_object_add(event, "type", json_object_new_string("object"));
     json_object_object_add(event, "additionalProperties", json_object_new_boolean(false));
 
+    Batch = Conf->v4k.batch;
+    BatchTime = (int64_t)Conf->v4k.batchtime * 1000000;
+    if (Batch > 1) {
+	// a batch is large and waits long anyway
+	Pipe = 2;
+	sprintf(message, "initMsb: array events of up to %d samples or %d ms", Batch, (int)(BatchTime / 1000000));
+	LOGIT(message);
+    }
+
+    // all fields flagged FF_MSB are properties of the event
     json_object* required = json_object_new_array();
-    json_object_array_add(required, json_object_new_string("tempboiler"));
-    json_object_array_add(required, json_object_new_string("tempwater"));
-    json_object_array_add(required, json_object_new_string("tempexhaust"));
-    json_object_array_add(required, json_object_new_string("tempinside"));
-    json_object_array_add(required, json_object_new_string("tempoutside"));
+    json_object* properties = json_object_new_object();
+    if (Batch > 1) {
+	json_object_array_add(required, json_object_new_string("time"));
+	json_object* property = json_object_new_object();
+	json_object_object_add(property, "type", json_object_new_string("integer"));
+	json_object_object_add(property, "format", json_object_new_string("int64"));
+	json_object_object_add(properties, "time", property);
+    }
+    for (i = 0; i < (int)emsPtr->reg.nFields; i++) {
+	if (!(emsPtr->field[i].flags & FF_MSB))
+	    continue;
+	msbPropName(emsPtr->field[i].name, prop);
+	json_object_array_add(required, json_object_new_string(prop));
+	json_object* property = json_object_new_object();
+	json_object_object_add(property, "type", json_object_new_string("number"));
+	json_object_object_add(property, "format", json_object_new_string("double"));
+	json_object_object_add(properties, prop, property);
+    }
 
-    json_object_object_add(event, "required", required);
+    msbPayloads();
 
-    json_object* properties = json_object_new_object();
-    json_object* tempboiler = json_object_new_object();
-    json_object* tempwater = json_object_new_object();
-    json_object* tempexhaust = json_object_new_object();
-    json_object* tempinside = json_object_new_object();
-    json_object* tempoutside = json_object_new_object();
-    json_object_object_add(tempboiler, "type", json_object_new_string("number"));
-    json_object_object_add(tempboiler, "format", json_object_new_string("double"));
-    json_object_object_add(tempwater, "type", json_object_new_string("number"));
-    json_object_object_add(tempwater, "format", json_object_new_string("double"));
-    json_object_object_add(tempexhaust, "type", json_object_new_string("number"));
-    json_object_object_add(tempexhaust, "format", json_object_new_string("double"));
-    json_object_object_add(tempinside, "type", json_object_new_string("number"));
-    json_object_object_add(tempinside, "format", json_object_new_string("double"));
-    json_object_object_add(tempoutside, "type", json_object_new_string("number"));
-    json_object_object_add(tempoutside, "format", json_object_new_string("double"));
-
-    json_object_object_add(properties, "tempboiler", tempboiler);
-    json_object_object_add(properties, "tempwater", tempwater);
-    json_object_object_add(properties, "tempexhaust", tempexhaust);
-    json_object_object_add(properties, "tempinside", tempinside);
-    json_object_object_add(properties, "tempoutside", tempoutside);
+    json_object_object_add(event, "required", required);
     json_object_object_add(event, "properties", properties);
 
     json_object_object_add(dataformat, "complexevent", event);
     Line = __LINE__;    
 
-    msbClientAddComplexEvent(myEmsPtr->client,
+    msbClientAddComplexEvent(Client,
 			     "emsvalues", // event id
 			     "EMS+ Values", // event name
 			     "Values from Buderus via EMS bus", // event description
 			     dataformat, // format described in json object
-			     false // is NO array
+			     Batch > 1 // array of samples
 			     );
     Line = __LINE__;    
 
     // register at msb
-    //    result = msbClientRegister(myEmsPtr->client);
+    //    result = msbClientRegister(Client);
     //sprintf(message, "initMsb: registered client, result = %d", result);
     //LOGIT(message);
 
+    if ((result = pthread_create(&Sender, NULL, msbSender, NULL)) != 0) {
+	sprintf(message, "initMsb: could not start sender thread, %s", strerror(result));
+	LOGERR(message);
+    }
+
     return (result);    
 }
 
@@ -186,61 +309,193 @@ void closeMsb(ems *myEmsPtr) {
     char message[1000], error[1000];
     uuid_t uuid;
 
-    msbClientHaltClientStateMachine(myEmsPtr->client);
+    msbClientHaltClientStateMachine(Client);
 }
 
-int msb(ems *myEmsPtr) {
-    int result;
-    char message[1000], error[1000];
-    uuid_t uuid;
-
-    
-    // msbClientRunAutomatThreadI(myEmsPtr->client); //automat in thread
-
-    json_object *dataObjectA;
-	
-    dataObjectA = json_object_new_object();
+// queue a sample of the fields in snap (n entries, taken at stamp ns) for
+// the sender thread, never blocks. Returns the number of samples waiting.
+int msbQueue(const struct emsField *snap, int n, int64_t stamp) {
+    struct pubStats *st = &emsPtr->stat.msb;
+    struct msbSample *q;
+    uint32_t depth;
+    int i;
+
+    pthread_mutex_lock(&QLock);
+    if (QHead - QTail >= MSBQUEUE) {
+	// the client falls behind: drop the oldest sample
+	QTail++;
+	st->dropped++;
+    }
+    q = &Queue[QHead % MSBQUEUE];
+    q->stamp = stamp;
+    for (i = 0; i < NIds; i++)
+	q->v[i] = (Ids[i] < n) ? fieldDouble(&snap[Ids[i]]) : 0.0;
+    QHead++;
+    depth = QHead - QTail;
+    pthread_cond_signal(&QCond);
+    pthread_mutex_unlock(&QLock);
+
+    st->pending = depth;
+    if (depth > st->maxPending)
+	st->maxPending = depth;
+    return (depth);
+}
 
-    json_object_object_add(dataObjectA, "tempboiler", json_object_new_double(myEmsPtr->tempBoiler));
-    json_object_object_add(dataObjectA, "tempwater", json_object_new_double(myEmsPtr->tempWater));
-    json_object_object_add(dataObjectA, "tempexhaust", json_object_new_double(myEmsPtr->tempExhaust));
-    json_object_object_add(dataObjectA, "tempinside", json_object_new_double(myEmsPtr->tempInside));
-    json_object_object_add(dataObjectA, "tempoutside", json_object_new_double(myEmsPtr->tempOutside));
+// queue a sample of the current values
+int msb(ems *myEmsPtr) {
+    int n = snapTake(Snap);
 
-    usleep(100000);
+    return (msbQueue(Snap, n, stampNow()));
+}
 
-    // for (int i = 0; i < 3; i++) {
+// the client sent all n events handed to it, the oldest taken at stamp.
+// Sender thread, without QLock.
+static void msbComplete(int n, int64_t stamp) {
+    struct pubStats *st = &emsPtr->stat.msb;
+    char message[MAXPATH];
+    uint32_t ms;
+
+    if (n == 0)
+	return;
+    ms = (stampNow() - stamp) / 1000000;
+    st->latency = ms;
+    if (ms > st->maxLatency)
+	st->maxLatency = ms;
+    st->published += n;
+    st->lastData = time(NULL);
+
+    // get self description (allocated by the client)
+    if (emsPtr->ctl.debug > 1) {
+	char* msg = msbObjectSelfDescription(Client->msbObjectData);
+	LOGIT(msg);
+	free(msg);
+    }
+    if (Debug || !Daemon) {
+	sprintf(message, "msb: sent %d events, latency %u ms, %u waiting, cpu %u µs",
+		n, ms, st->pending, st->cycleCpu);
+	LOGIT(message);
+    }
+}
 
-    Line = __LINE__;    
+// hand the samples in the current slot to the client
+static void msbFlush(void) {
+    struct timespec t0;
+    size_t len;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+    if (Batch > 1) {
+	// an early batch is cut to its samples, the next one extended again
+	len = json_object_array_length(Payload[Slot]);
+	if (len > (size_t)Fill)
+	    json_object_array_del_idx(Payload[Slot], Fill, len - Fill);
+	for (; len < (size_t)Fill; len++)
+	    json_object_array_add(Payload[Slot], json_object_get(Elem[Slot * Batch + len]));
+    }
 
+    // the client drops its reference to the data once it is sent, our
+    // own one keeps the payload for the next round
+    json_object_get(Payload[Slot]);
+    Line = __LINE__;
     msbClientPublishComplex(
-			    myEmsPtr->client,
+			    Client,
 			    "emsvalues", // event id
 			    HIGH, // priority
-			    dataObjectA, // data
+			    Payload[Slot], // data
 			    NULL // correlation id string, auto generated if NULL
 			    );
-    Line = __LINE__;    
+    Line = __LINE__;
+    Slot++;
+    Fill = 0;
+    pubCpu(&emsPtr->stat.msb, &t0);
+}
 
-    while (myEmsPtr->client->dataOutInterfaceFlag == 1) {
-	usleep(50000);
+// swap the objects of slots a and b, payload and the samples in it
+static void msbSwap(int a, int b) {
+    json_object *o;
+    int k, i;
+
+#define SWAP(x, y) (o = (x), (x) = (y), (y) = o)
+    SWAP(Payload[a], Payload[b]);
+    for (k = 0; k < Batch; k++) {
+	SWAP(Elem[a * Batch + k], Elem[b * Batch + k]);
+	SWAP(Times[a * Batch + k], Times[b * Batch + k]);
+	for (i = 0; i < NIds; i++)
+	    SWAP(Values[(a * Batch + k) * NIds + i], Values[(b * Batch + k) * NIds + i]);
     }
-    Line = __LINE__;    
-    
-    //    }
+#undef SWAP
+}
 
-    // get self description
-    char* msg = msbObjectSelfDescription(myEmsPtr->client->msbObjectData);
-    if (myEmsPtr->debug > 1)
-	LOGIT(msg);
-    Line = __LINE__;    
+// see whether the events in flight were sent and the batch is due
+static void msbPoll(void) {
+    if (Fill > 0 && stampNow() - SlotStamp[Slot] >= BatchTime)
+	msbFlush();
+    if (Slot > 0 && Client->dataOutInterfaceFlag == 0) {
+	msbComplete(Slot, SlotStamp[0]);
+	// a batch being filled moves down to the first slot, whose
+	// payload was sent
+	if (Fill > 0) {
+	    msbSwap(0, Slot);
+	    SlotStamp[0] = SlotStamp[Slot];
+	}
+	Slot = 0;
+    }
+}
 
-    int flag = myEmsPtr->client->dataOutInterfaceFlag;
-    
-    sprintf(message, "msb: published data, flag = %d, tempboiler = %.1f, tempwater = %.1f",
-	    flag, myEmsPtr->tempBoiler, myEmsPtr->tempWater);
-    if (Debug || !Daemon)
-	LOGIT(message);
-    
-    return (flag);
+// put sample s into the current slot, publish it when it is full
+static void msbAdd(const struct msbSample *s) {
+    int i, k;
+
+    if (Fill == 0) {
+	// pipeline full: wait until the client has sent them, so the
+	// payloads can be reused
+	if (Slot == Pipe) {
+	    while (Client->dataOutInterfaceFlag == 1)
+		usleep(10000);
+	    msbComplete(Slot, SlotStamp[0]);
+	    Slot = 0;
+	}
+	SlotStamp[Slot] = s->stamp;
+    }
+    k = Slot * Batch + Fill;
+    if (Batch > 1)
+	json_object_set_int64(Times[k], s->stamp / 1000000);
+    for (i = 0; i < NIds; i++)
+	json_object_set_double(Values[k * NIds + i], s->v[i]);
+    if (++Fill >= Batch)
+	msbFlush();
+}
+
+// takes samples from the queue and hands them to the client
+static void *msbSender(void *arg) {
+    struct msbSample s;
+    struct timespec until;
+
+    for (;;) {
+	pthread_mutex_lock(&QLock);
+	while (QHead == QTail) {
+	    if (Slot == 0 && Fill == 0) {
+		pthread_cond_wait(&QCond, &QLock);
+		continue;
+	    }
+	    // events in flight or a batch started: look every 20 ms
+	    clock_gettime(CLOCK_REALTIME, &until);
+	    until.tv_nsec += 20000000;
+	    if (until.tv_nsec >= 1000000000) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	    }
+	    pthread_cond_timedwait(&QCond, &QLock, &until);
+	    pthread_mutex_unlock(&QLock);
+	    msbPoll();
+	    pthread_mutex_lock(&QLock);
+	}
+	s = Queue[QTail % MSBQUEUE];
+	QTail++;
+	emsPtr->stat.msb.pending = QHead - QTail;
+	pthread_mutex_unlock(&QLock);
+
+	msbAdd(&s);
+	msbPoll();
+    }
+    return (NULL);
 }
@@ -0,0 +1,420 @@
+
+/*! \file
+    \brief This file contains the read-only parser mode working on a single arena
+
+    parsemap() reads the whole file with one read() into an arena, splits it
+    into lines and tokens in place and takes all <tt> struct entry </tt>
+    values from the same arena. Names, values and comments point into the
+    file text, so nothing is copied or allocated per token, and parseclose()
+    frees the arena blocks (normally one) instead of walking the tree.
+    */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "parser.h"
+#include "parser_local.h"
+
+#define ARENA_MIN 4096 /*!< \brief The smallest arena block */
+#define ARENA_ENTRIES 3 /*!< \brief Entries reserved per line of the file */
+
+/*! \brief A block of the arena, blocks are chained when one is full */
+struct arena
+{
+	struct arena *next; /*!< The block allocated before this one */
+	size_t size; /*!< The bytes in \c mem */
+	size_t used; /*!< The bytes of \c mem handed out */
+	char mem[]; /*!< The memory */
+};
+
+/*! \brief A token found by scan() */
+struct token
+{
+	char *name; /*!< The text of the token, terminated by writing \c null to \c term */
+	char *term; /*!< Where the terminating \c null goes */
+	char *end; /*!< The first character after the token in the line */
+	int eq; /*!< The token is a run of = */
+};
+
+/*! \if API
+
+  \brief Chain a new block of \c size bytes in front of the arena
+
+  \param arena The address of the current block, \c NULL for a new arena
+  \param size The bytes in the block
+
+  \retval block The new block, its memory is not initialized
+
+  \endif
+  */
+static struct arena *arenablock(struct arena **arena, size_t size)
+{
+	struct arena *block;
+
+	block = malloc(sizeof(*block) + size);
+	if(block == NULL)
+		exit(-1);
+	block->next = *arena;
+	block->size = size;
+	block->used = 0;
+
+	return *arena = block;
+}
+
+/*! \if API
+
+  \brief Allocate \c size bytes from the arena
+
+  The memory is aligned for <tt> struct entry </tt> and zeroed. When the current block is full, a new one of the same size (at least \c size) is chained in front of it.
+
+  \param arena The address of the current block
+  \param size The bytes required
+
+  \retval mem The memory
+
+  \endif
+  */
+static void *arenaalloc(struct arena **arena, size_t size)
+{
+	const size_t align = __alignof__(struct entry);
+	struct arena *block = *arena;
+	size_t bytes;
+	void *mem;
+
+	size = (size + align - 1) & ~(align - 1);
+	if(block == NULL || block->used + size > block->size)
+	{
+		bytes = (block && block->size > ARENA_MIN) ? block->size : ARENA_MIN;
+		block = arenablock(arena, (bytes < size) ? size : bytes);
+	}
+	mem = block->mem + block->used;
+	block->used += size;
+
+	return memset(mem, 0, size);
+}
+
+/*! \brief Free all blocks of an arena
+
+    \param arena The arena of a file opened with parsemap()
+    */
+void arenafree(void *arena)
+{
+	struct arena *block, *next;
+
+	for(block = arena ; block ; block = next)
+	{
+		next = block->next;
+		free(block);
+	}
+}
+
+/*! \if API
+
+  \brief Find the next token in a line
+
+  The rules are those of gettoken(): a token is delimited by whitespace, = or a quote, quoted tokens may contain these and backslash escapes, and a run of ='s (with whitespace) is one = token. A quoted token is unquoted and unescaped in place right away, as it only gets shorter. Any other token can only be terminated after the token following it has been found, since its \c null replaces the first character after it.
+
+  \param str The string to scan
+  \param token Set to the token found
+
+  \retval 1 if a token was found
+  \retval 0 otherwise
+
+  \endif
+  */
+static int scan(char *str, struct token *token)
+{
+	char *close, *r, *w;
+
+	while(isspace((unsigned char)*str))
+		str++;
+	if(*str == '\0')
+		return 0;
+
+	token->eq = 0;
+	if(*str == '=')
+	{
+		token->name = token->term = str;
+		token->end = str + strspn(str, "= \n\r\t");
+		token->eq = 1;
+	}
+	else if(*str == '"' || *str == '\'')
+	{
+		token->end = skipquotes(str);
+		close = (token->end - 1 > str && token->end[-1] == *str) ? token->end - 1 : token->end;
+		token->name = r = w = str + 1;
+		while(r < close)
+		{
+			if(*r == '\\' && r + 1 < close)
+				r++;
+			*w++ = *r++;
+		}
+		token->term = w;
+	}
+	else
+	{
+		token->name = str;
+		token->end = token->term = str + strcspn(str, " \t=\"'\n\r");
+	}
+
+	return 1;
+}
+
+/*! \if API
+
+  \brief Convert a line to a list of key and value entries in place
+
+  This is getvalues() for parsemap(): <code> key = value </code> becomes a key entry with a value entry as its \c sub, a token without = a value entry. The names point into \c line.
+
+  \param arena The arena to take the entries from
+  \param prev The address where to link the first entry
+  \param line The line, without its comment
+
+  \endif
+  */
+static void mapvalues(struct arena **arena, struct entry **prev, char *line)
+{
+	struct token key, next, value;
+	struct entry *entry;
+	int more;
+
+	for(more = scan(line, &key) ; more ; prev = &entry->next)
+	{
+		more = scan(key.end, &next);
+		*key.term = '\0';
+
+		entry = *prev = arenaalloc(arena, sizeof(*entry));
+		entry->name = key.name;
+		entry->type = ENTRY_VALUE;
+
+		if(key.eq || (more && next.eq))
+		{
+			// key = value, the key is empty if the line starts with =
+			if(!key.eq)
+			{
+				more = scan(next.end, &value);
+				*next.term = '\0';
+				next = value;
+			}
+			entry->type = ENTRY_KEY;
+			entry->sub = arenaalloc(arena, sizeof(*entry));
+			entry->sub->type = ENTRY_VALUE;
+			entry->sub->name = key.term; // "" if there is no value
+			if(more)
+			{
+				entry->sub->name = next.name;
+				more = scan(next.end, &value);
+				*next.term = '\0';
+				next = value;
+			}
+		}
+		key = next;
+	}
+}
+
+/*! \if API
+
+  \brief Get the group name of a line in place
+
+  The name is the text between \c [ and \c ], quoted parts of it are unquoted.
+
+  \param open The \c [ in the line
+
+  \retval name The group name
+
+  \endif
+  */
+static char *mapgroup(char *open)
+{
+	char *name, *r, *w, *end, *close;
+
+	name = r = w = open + 1;
+	while(*r != '\0' && *r != ']')
+	{
+		if(*r == '"' || *r == '\'')
+		{
+			end = skipquotes(r);
+			close = (end - 1 > r && end[-1] == *r) ? end - 1 : end;
+			for(r++ ; r < close ; )
+			{
+				if(*r == '\\' && r + 1 < close)
+					r++;
+				*w++ = *r++;
+			}
+			r = end;
+		}
+		else
+			*w++ = *r++;
+	}
+	*w = '\0';
+
+	return name;
+}
+
+/*! \if API
+
+  \brief Read the whole file into a new arena
+
+  The text gets a block of its own, the entries a second one sized by the number of lines, so normally there are two.
+
+  \param filename The name of the file
+  \param arena Set to the arena, the file text is in its first block
+  \param length Set to the length of the text
+
+  \retval text The text of the file, \c null terminated
+  \retval NULL if the file could not be read
+
+  \endif
+  */
+static char *slurp(const char *filename, struct arena **arena, size_t *length)
+{
+	struct stat st;
+	char *text, *p;
+	ssize_t n = 0;
+	size_t len, lines;
+	int fd;
+
+	if((fd = open(filename, O_RDONLY)) < 0)
+		return NULL;
+	if(fstat(fd, &st) < 0)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	*arena = NULL;
+	text = arenablock(arena, st.st_size + 1)->mem;
+	(*arena)->used = st.st_size + 1;
+
+	for(len = 0 ; len < (size_t)st.st_size ; len += n)
+		if((n = read(fd, text + len, st.st_size - len)) <= 0)
+			break;
+	close(fd);
+	if(n < 0)
+	{
+		arenafree(*arena);
+		return NULL;
+	}
+	text[len] = '\0';
+	*length = len;
+
+	for(lines = 1, p = text ; (p = memchr(p, '\n', text + len - p)) != NULL ; p++)
+		lines++;
+	arenablock(arena, ARENA_ENTRIES * lines * sizeof(struct entry) + ARENA_MIN);
+
+	return text;
+}
+
+/*! \brief Open a configuration file read-only, with all entries in one arena
+
+    The tree is the same as the one of parseopen() with these differences:
+    \li the name of a line entry is the empty string, it is not rebuilt from its values
+    \li quoted parts of group names are unquoted
+
+    The file must not be changed with the functions of modify.c or saved; parsecopy() gives a copy that can. Close it with parseclose() as usual, which frees all of it at once.
+
+    \param filename The name of the file
+
+    \retval NULL if the file could not be read, otherwise a valid <tt> struct parsefile * </tt>
+    */
+struct parsefile *parsemap(const char *filename)
+{
+	struct arena *arena;
+	struct parsefile *file;
+	struct entry *entry, *group, *line;
+	char *text, *p, *q, *nl, *end, *open, *comment, *top, *topend, *empty;
+	size_t len;
+
+	if((text = slurp(filename, &arena, &len)) == NULL)
+		return NULL;
+	end = text + len;
+
+	file = arenaalloc(&arena, sizeof(*file));
+	file->name = strcpy(arenaalloc(&arena, strlen(filename) + 1), filename);
+	empty = arenaalloc(&arena, 1);
+
+	p = text;
+	if(p[0] == '#' && p[1] == '!')
+	{
+		if((nl = memchr(p, '\n', end - p)) == NULL)
+			nl = end;
+		*nl = '\0';
+		file->interpreter = p + 2;
+		p = nl + 1;
+	}
+
+	group = line = NULL;
+	top = topend = NULL;
+	for( ; p < end ; p = nl + 1)
+	{
+		if((nl = memchr(p, '\n', end - p)) == NULL)
+			nl = end;
+		*nl = '\0';
+		for(q = p ; (q = memchr(q, '\0', nl - q)) != NULL ; ) // as null2space()
+			*q = ' ';
+
+		if((comment = strrchr(p, '#')) != NULL)
+			*comment++ = '\0';
+
+		if(strspn(p, " \t\n\v\f\r") == strlen(p))
+		{
+			// top comment of the next entry, joined in place
+			if(comment == NULL)
+				continue;
+			len = strlen(comment);
+			if(top == NULL)
+				topend = top = comment;
+			else
+			{
+				*topend++ = '\n';
+				memmove(topend, comment, len + 1);
+			}
+			topend += len;
+			continue;
+		}
+
+		entry = arenaalloc(&arena, sizeof(*entry));
+		entry->side = comment;
+		entry->top = top;
+		top = NULL;
+
+		if((open = strchr(p, '[')) != NULL)
+		{
+			entry->name = mapgroup(open);
+			entry->type = ENTRY_GROUP;
+			if(group == NULL)
+				file->root = entry;
+			else
+				group->next = entry;
+			group = entry;
+			line = NULL;
+			continue;
+		}
+
+		if(__builtin_expect(group == NULL, 0))
+		{
+			file->root = group = arenaalloc(&arena, sizeof(*group));
+			group->name = empty; // DEFAULT_GRPNAME
+			group->type = ENTRY_GROUP;
+		}
+		entry->name = empty;
+		entry->type = ENTRY_LINE;
+		mapvalues(&arena, &entry->sub, p);
+		if(line == NULL)
+			group->sub = entry;
+		else
+			line->next = entry;
+		line = entry;
+	}
+
+	file->orphan = top;
+	file->arena = arena;
+
+	return file;
+}
@@ -0,0 +1,137 @@
+
+/*! \file
+    \brief Benchmark of parsemap() against parseopen()
+
+    Writes a generated configuration file of some groups with keys, values,
+    quotes, escapes and comments, checks that both modes give the same
+    entries and times open + walk + close of each, the best of some runs
+    (the first run of a mode pays for faulting in fresh memory). make bench
+
+    bench [groups [keys per group [runs]]]
+    */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "parser.h"
+
+static char *generate(int groups, int keys)
+{
+	static char name[] = "/tmp/parserbench.cfg";
+	FILE *fp;
+	int g, k;
+
+	if((fp = fopen(name, "w")) == NULL)
+		return NULL;
+	fprintf(fp, "# generated by parser/bench\n\n");
+	for(g = 0 ; g < groups ; g++)
+	{
+		fprintf(fp, "# group %d\n# of %d keys\n[group%d] # side\n", g, keys, g);
+		for(k = 0 ; k < keys ; k++)
+			switch(k % 5)
+			{
+			case 0: fprintf(fp, "key%d=%d\n", k, g * keys + k); break;
+			case 1: fprintf(fp, "\tkey%d = value%d # side comment\n", k, k); break;
+			case 2: fprintf(fp, "key%d=\"quoted value with \\\"escapes\\\" %d\"\n", k, k); break;
+			case 3: fprintf(fp, "key%d=a%d b=c plain%d\n", k, k, k); break;
+			default: fprintf(fp, "\n# top comment\nkey%d='%d.%d'\n", k, g, k); break;
+			}
+	}
+	fprintf(fp, "# orphan\n");
+	fclose(fp);
+
+	return name;
+}
+
+static int same(const char *a, const char *b)
+{
+	if(a == NULL || b == NULL)
+		return a == b;
+	return !strcmp(a, b);
+}
+
+// compare the entries of a and b, the names of lines differ by design
+static long compare(struct entry *a, struct entry *b)
+{
+	long diff = 0;
+
+	for( ; a && b ; a = a->next, b = b->next)
+	{
+		if(a->type != b->type || !same(a->top, b->top) || !same(a->side, b->side)
+		   || (!isline(a) && !same(a->name, b->name)))
+		{
+			fprintf(stderr, "differ: %d >%s< >%s<\n", a->type, a->name, b->name);
+			diff++;
+		}
+		diff += compare(a->sub, b->sub);
+	}
+	return diff + (a != b);
+}
+
+// what a user does: visit every key and value
+static long walk(struct parsefile *file)
+{
+	struct entry *g, *l, *v;
+	long sum = 0;
+
+	for(g = file->root ; g ; g = g->next)
+		foreachline(g, l)
+			foreach(l, v)
+				sum += name(v)[0] + (iskey(v) ? keyvalue(v)[0] : 0);
+	return sum;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	int groups = (argc > 1) ? atoi(argv[1]) : 100;
+	int keys = (argc > 2) ? atoi(argv[2]) : 1000;
+	int runs = (argc > 3) ? atoi(argv[3]) : 5;
+	struct parsefile *a, *b;
+	double t, open = 1e9, map = 1e9;
+	long sum = 0, diff;
+	char *name;
+	int i;
+
+	if((name = generate(groups, keys)) == NULL)
+		return 1;
+	a = parseopen(name, NULL, NULL);
+	b = parsemap(name);
+	diff = compare(a->root, b->root) + !same(a->orphan, b->orphan);
+	parseclose(a);
+	parseclose(b);
+	printf("%d groups of %d keys: %ld differences\n", groups, keys, diff);
+
+	for(i = 0 ; i < runs ; i++)
+	{
+		t = now();
+		a = parseopen(name, NULL, NULL);
+		sum += walk(a);
+		parseclose(a);
+		t = now() - t;
+		open = (t < open) ? t : open;
+
+		t = now();
+		b = parsemap(name);
+		sum -= walk(b);
+		parseclose(b);
+		t = now() - t;
+		map = (t < map) ? t : map;
+	}
+	printf("parseopen: %8.2f ms\nparsemap:  %8.2f ms (%.1fx)%s\n", open * 1000, map * 1000, open / map,
+	       sum ? ", walks differ" : "");
+	unlink(name);
+
+	return diff != 0 || sum != 0;
+}
@@ -430,6 +430,7 @@ struct parsefile *parsecopy(struct parsefile *oldfile, char *newname)
 	newfile->orphan = (oldfile->orphan) ? strdup(oldfile->orphan) : NULL;
 
 	newfile->handler = oldfile->handler;
+	newfile->arena = NULL;
 
 	dupentries(&newfile->root, oldfile->root);
 
@@ -161,6 +161,7 @@ static char *getinterp(FILE *fp)
 		return interpreter;
 	}
 
+	free(line);
 	fseek(fp, 0, SEEK_SET);
 	return NULL;
 }
@@ -216,6 +217,7 @@ struct parsefile * parseopen(char *filename, struct phandler *list, phandler han
 	file->orphan = orphan;
 	file->interpreter = interpreter;
 	file->handler = (handler) ? handler : defaultparser;
+	file->arena = NULL;
 
 	if(list == NULL)
 		return file;
@@ -265,12 +267,19 @@ void freeentries(struct entry *root)
 /*! \brief This function is called to close an already opened file.
 
     Calling parseclose() will free all the <tt> struct entry </tt> data present in the <tt> struct parsefile * file </tt> argument. After calling this function, \c file is no more a valid parsefile handle.
+    A file opened with parsemap() is freed at once with its arena.
 
     \param file the parsefile handle to close
 
     */
 void parseclose(struct parsefile *file)
 {
+	if(file->arena) // parsemap(): the file is in there, too
+	{
+		arenafree(file->arena);
+		return;
+	}
+
 	freeentries(file->root);
 
 	if(file->name)
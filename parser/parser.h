@@ -118,6 +118,7 @@ struct parsefile
 	char *interpreter; /*!< The interpreter for this configuration file */
 	phandler handler; /*!< The default handler to be used for this file */
 	char *orphan; /*!< Represents any orphan comment found in the file */
+	void *arena; /*!< All of the file if opened with parsemap(), otherwise \c NULL */
 };
 
 /*! \brief This structure is used to register handler for a particular group name
@@ -180,6 +181,10 @@ struct entry * getkeyorvalue(struct entry *line, char *key, int index);
 /*! \brief This macro gets the side comment of \c entry */
 #define sidecomment(entry) ((entry)->side)
 
+// arena.c
+
+struct parsefile *parsemap(const char *filename);
+
 // modify.c
 
 struct entry *addgroup(struct entry *group, char *name);
@@ -19,6 +19,7 @@ char *parsGetline(FILE *fp);
 #define DEFAULT_GRPNAME ""  /*!< The group name to be assumed for those lines which does not belong to any group */
 
 struct entry *transform(FILE *fp, char **orphan);
+char *skipquotes(char *str);
 
 // parse.c
 
@@ -27,6 +28,10 @@ struct parsefile ;
 
 void freeentries(struct entry *root);
 
+// arena.c
+
+void arenafree(void *arena);
+
 // modify.c
 
 #endif
@@ -0,0 +1,109 @@
+//
+// query.c - bucketed aggregates over the columnar history
+//
+// $Id$
+
+#include "ems.h"
+#include "col.h"
+
+static void bucketAdd(struct queryBucket *b, int32_t v) {
+    if (b->count == 0) {
+	b->min = b->max = b->first = v;
+    }
+    if (v < b->min)
+	b->min = v;
+    if (v > b->max)
+	b->max = v;
+    b->last = v;
+    b->sum += v;
+    b->count++;
+}
+
+// aggregate the samples of field name between from and to (inclusive) into
+// nb buckets of step s, b[i] starting at from + i * step (step 0: one bucket
+// for the whole range). Only segments overlapping the range are touched, a
+// segment inside one bucket is taken from the index without decoding.
+// Returns the number of buckets with samples or -1 if there is no column.
+int queryRun(const char *path, const char *name, uint32_t from, uint32_t to, uint32_t step,
+	     struct queryBucket *b, int nb, struct queryStats *st) {
+    static uint32_t t[COLSEG / 2];
+    static int32_t v[COLSEG / 2];
+    const struct colIndex *x;
+    struct colReader r;
+    struct queryBucket *c;
+    uint64_t width, span;
+    uint32_t seg, k;
+    int32_t prev = 0;
+    int i, n, havePrev = false, used = 0;
+
+    memset(st, 0, sizeof(*st));
+    if (to < from || nb < 1 || colOpenRead(&r, path, name) < 0)
+	return (-1);
+    // 64 bit: the range from 0 to UINT32_MAX is 2^32 s wide
+    span = (uint64_t)to - from + 1;
+    width = (step == 0) ? span : step;
+    if (step == 0)
+	nb = 1;
+    if ((uint64_t)nb * width < span)
+	to = from + nb * width - 1;
+    memset(b, 0, nb * sizeof(*b));
+    for (i = 0; i < nb; i++)
+	b[i].start = from + i * width;
+    st->segments = r.nSeg;
+
+    // value before the range, for the delta of the first bucket
+    seg = colFind(&r, from);
+    if (seg > 0) {
+	prev = r.idx[seg - 1].vLast;
+	havePrev = true;
+    }
+
+    for (; seg < r.nSeg && r.idx[seg].tFirst <= to; seg++) {
+	x = &r.idx[seg];
+	if (x->count == 0)
+	    continue;
+	k = (x->tFirst >= from) ? (x->tFirst - from) / width : 0;
+	if (x->tFirst >= from && x->tLast <= to && k == (x->tLast - from) / width) {
+	    // whole segment in one bucket: the index is enough
+	    c = &b[k];
+	    if (c->count == 0) {
+		c->min = x->vMin;
+		c->max = x->vMax;
+		c->first = x->vFirst;
+	    }
+	    if (x->vMin < c->min)
+		c->min = x->vMin;
+	    if (x->vMax > c->max)
+		c->max = x->vMax;
+	    c->last = x->vLast;
+	    c->sum += x->sum;
+	    c->count += x->count;
+	    st->indexed++;
+	    continue;
+	}
+	n = colDecode(&r, seg, t, v, COLSEG / 2);
+	st->decoded++;
+	for (i = 0; i < n; i++) {
+	    if (t[i] < from) {
+		prev = v[i];
+		havePrev = true;
+		continue;
+	    }
+	    if (t[i] > to)
+		break;
+	    bucketAdd(&b[(t[i] - from) / width], v[i]);
+	}
+    }
+    colCloseRead(&r);
+
+    // deltas, e.g. starts per bucket
+    for (i = 0; i < nb; i++) {
+	if (b[i].count == 0)
+	    continue;
+	b[i].delta = b[i].last - (havePrev ? prev : b[i].first);
+	prev = b[i].last;
+	havePrev = true;
+	used++;
+    }
+    return (used);
+}
@@ -22,6 +22,6 @@ void close_queues(ems *emsPtrL) {
     mq_close(rx_queue);
     mq_close(tx_queue);
     // and unlink it
-    mq_unlink(emsPtrL->rxqueue);
-    mq_unlink(emsPtrL->txqueue);    
+    mq_unlink(emsPtrL->cfg.rxqueue);
+    mq_unlink(emsPtrL->cfg.txqueue);    
 }
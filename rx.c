@@ -127,7 +127,7 @@ void rx_done() {
             if (state != WROTE) {
                 sprintf(message, "Got an ACK without prior write message from 0x%02hhx", polled_id);
 		LOGERR(message);
-                stats.rx_mac_errors++;
+                emsPtr->stat.serio.rx_mac_errors++;
             }
             if (polled_id == client_id) {
                 // The ACK is for us after a write command. We can send another message.
@@ -140,7 +140,7 @@ void rx_done() {
             if (state != ASSIGNED) {
                 sprintf(message, "Got bus release from 0x%02hhx without prior poll request", rx_buf[0]);
 		LOGERR(message);
-                stats.rx_mac_errors++;
+                emsPtr->stat.serio.rx_mac_errors++;
             }
             polled_id = 0;
             state = RELEASED;
@@ -149,7 +149,7 @@ void rx_done() {
             if (state != RELEASED && state != ASSIGNED) {
                 sprintf(message, "Got bus assign to 0x%02hhx without prior bus release from %02hhx", rx_buf[0], polled_id);
 		LOGERR(message);
-                stats.rx_mac_errors++;
+                emsPtr->stat.serio.rx_mac_errors++;
             }
             polled_id = rx_buf[0] & 0x7f;
             if (polled_id == client_id) {
@@ -161,20 +161,20 @@ void rx_done() {
         } else {
             sprintf(message, "Ignored unknown MAC package 0x%02hhx", rx_buf[0]);
 	    LOGERR(message);
-            stats.rx_mac_errors++;
+            emsPtr->stat.serio.rx_mac_errors++;
         }
         return;
     }
 
     print_packet(0, LOG_PACKET, rx_buf, rx_len);
 
-    stats.rx_total++;
+    emsPtr->stat.serio.rx_total++;
     if (rx_len < 6) {
         sprintf(message, "Ignored short package");
 	LOGERR(message);
         if (state == WROTE || state == READ)
             state = ASSIGNED;
-        stats.rx_short++;
+        emsPtr->stat.serio.rx_short++;
         return;
     }
 
@@ -190,7 +190,7 @@ void rx_done() {
             sprintf(message, "Ignored package from 0x%02hhx instead of polled 0x%02hhx or MASTER_ID",
                    rx_buf[0], polled_id);
 	    LOGERR(message);
-            stats.rx_sender++;
+            emsPtr->stat.serio.rx_sender++;
             return;
         }
         dst = rx_buf[1] & 0x7f;
@@ -199,7 +199,7 @@ void rx_done() {
                 sprintf(message, "Ignored read from 0x%02hhx to invalid address 0x%02hhx",
                     rx_buf[0], dst);
 		LOGERR(message);
-                stats.rx_format++;
+                emsPtr->stat.serio.rx_format++;
                 return;
             }
             // Write request, prepare immediate answer
@@ -213,7 +213,7 @@ void rx_done() {
                 sprintf(message, "Ignored write from 0x%02hhx to invalid address 0x%02hhx",
                     rx_buf[0], dst);
 		LOGERR(message);
-                stats.rx_format++;
+                emsPtr->stat.serio.rx_format++;
                 return;
             }
             if (dst >= 0x08) {
@@ -228,7 +228,7 @@ void rx_done() {
             sprintf(message, "Ignored not expected read header: %02hhx %02hhx %02hhx %02hhx",
                 rx_buf[0], rx_buf[1], rx_buf[2], rx_buf[3]);
 	    LOGERR(message);
-            stats.rx_format++;
+            emsPtr->stat.serio.rx_format++;
             return;
         }
         if (polled_id == client_id) {
@@ -237,17 +237,17 @@ void rx_done() {
     } else if (state == WROTE) {
         sprintf(message, "Received package from 0x%02hhx when waiting for write ACK", rx_buf[0]);
 	LOGERR(message);
-        stats.rx_sender++;
+        emsPtr->stat.serio.rx_sender++;
         return;
     } else if (rx_buf[0] != MASTER_ID) {
         sprintf(message, "Received package from 0x%02hhx when bus is not assigned", rx_buf[0]);
 	LOGERR(message);
-        stats.rx_sender++;
+        emsPtr->stat.serio.rx_sender++;
         return;
     }
 
     // Do not check the CRC here. It adds too much delay and we risk missing a poll cycle.
-    stats.rx_success++;
+    emsPtr->stat.serio.rx_success++;
     if (mq_send(rx_queue, (char *)rx_buf, rx_len, 0) == -1) {
         sprintf(message, "RX: Could not add packet to queue: %s", strerror(errno));
 	LOGERR(message);
@@ -0,0 +1,91 @@
+//
+// shm.c - attach the shared memory segment and check its layout
+//
+// $Id$
+
+#define _DEFAULT_SOURCE
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include "ems.h"
+
+// try to get and attach the segment with key, create it if create is set.
+// Sets emsPtr on success. A newly created segment gets its header written,
+// an existing one is only accepted if magic, version and size match ours.
+int shmAttach(key_t key, int create) {
+    char message[MAXPATH];
+    ems *ptr;
+    int tries;
+
+    ShmId = shmget(key, sizeof(ems), 0);
+    if (ShmId < 0 && errno == EINVAL) {
+	// segment exists, but is smaller than our layout
+	sprintf(message, "%s: shared memory with key %d has a different layout (size != %zu), remove it with ipcrm",
+		DaemonName, key, sizeof(ems));
+	LOGERR(message);
+	return (SHM_LAYOUT);
+    }
+    if (ShmId < 0) {
+	if (!create)
+	    return (SHM_NOSEG);
+	ShmId = shmget(key, sizeof(ems), IPC_CREAT | 0666);
+	if (ShmId < 0) {
+	    sprintf(message, "%s: could not create shared memory, error %s, errno = %d",
+		    DaemonName, strerror(errno), errno);
+	    LOGERR(message);
+	    return (SHM_NOSEG);
+	}
+    }
+
+    ptr = shmat(ShmId, NULL, 0);
+    if (ptr == (void *) -1) {
+	sprintf(message, "%s: could not attach shared memory, errno = %d (%s)",
+		DaemonName, errno, strerror(errno));
+	LOGERR(message);
+	return (SHM_NOATT);
+    }
+
+    if (ptr->hdr.magic == 0 && create
+	&& __sync_bool_compare_and_swap(&ptr->hdr.version, 0, SHMVERSION)) {
+	// fresh (zeroed) segment and we won the race to initialize it
+	ptr->hdr.size = sizeof(ems);
+	ptr->hdr.procMax = PROC_MAX;
+	ptr->hdr.created = time(NULL);
+	__sync_synchronize();
+	ptr->hdr.magic = SHMMAGIC;
+	sprintf(message, "%s: initialized shared memory layout version %d, %zu bytes",
+		DaemonName, SHMVERSION, sizeof(ems));
+	LOGIT(message);
+    }
+
+    // give a concurrent creator some time to finish the header
+    for (tries = 0; ptr->hdr.magic == 0 && tries < 10; tries++)
+	usleep(100000);
+    __sync_synchronize();
+
+    if (ptr->hdr.magic == 0) {
+	// nobody initialized it (yet), let the caller retry
+	shmdt(ptr);
+	return (SHM_NOSEG);
+    }
+
+    if (ptr->hdr.magic != SHMMAGIC || ptr->hdr.version != SHMVERSION
+	|| ptr->hdr.size != sizeof(ems) || ptr->hdr.procMax != PROC_MAX) {
+	sprintf(message, "%s: shared memory layout mismatch: magic %#x, version %u, size %u, expected %#x, %d, %zu",
+		DaemonName, ptr->hdr.magic, ptr->hdr.version, ptr->hdr.size,
+		SHMMAGIC, SHMVERSION, sizeof(ems));
+	LOGERR(message);
+	shmdt(ptr);
+	return (SHM_LAYOUT);
+    }
+
+    emsPtr = ptr;
+    sprintf(message, "%s: attached shared memory, shmid = %d, layout version %u",
+	    DaemonName, ShmId, ptr->hdr.version);
+    LOGIT(message);
+
+    return (SHM_OK);
+}
@@ -0,0 +1,275 @@
+//
+// sink.c - fan-out of the snapshots of emsPub to its sinks
+//
+// $Id$
+//
+// emsPub takes one consistent snapshot of all fields per cycle and hands it
+// to every sink with sinkPut(). Each sink runs on its own thread behind a
+// bounded queue of SINKQUEUE snapshots; when a sink falls behind its oldest
+// snapshot is dropped, so a slow sink (broker away, far msb server) never
+// delays the others. Sinks:
+//
+//   mqtt    one topic per field and/or the JSON document, see [EMS] mqttmode
+//   msb     the msb event, see [V4K]
+//   file    one JSON document per line appended to [PUB] file
+//   influx  InfluxDB line protocol, see influx.c
+
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "ems.h"
+
+#define SINKQUEUE 8
+#define JSONSIZE 4096
+
+int initMosquitto(ems *emsPtr);
+void mqttOwner(int proc);
+int mosquitto_lib_init(void);
+int mqttSend(ems *emsPtr, int id, const void *val, int len);
+int topicPolicy(const char *key, const char *topic, int retain);
+int msbConfig(ems *emsPtr);
+int initMsb(ems *emsPtr);
+int msbQueue(const struct emsField *snap, int n, int64_t stamp);
+
+struct sinkSnap {
+    time_t time;
+    int n;
+    struct emsField f[MAXFIELDS];
+};
+
+struct sink {
+    const char *name;
+    int (*init)(void);
+    int (*send)(const struct emsField *snap, int n, time_t t);
+    struct sinkStats *stat;
+    struct sinkSnap queue[SINKQUEUE];
+    uint32_t head, tail;    // next to put / to send
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+};
+
+static int mqttSinkInit(void);
+static int mqttSinkSend(const struct emsField *snap, int n, time_t t);
+static int msbSinkInit(void);
+static int msbSinkSend(const struct emsField *snap, int n, time_t t);
+static int fileSinkInit(void);
+static int fileSinkSend(const struct emsField *snap, int n, time_t t);
+
+static struct sink Sinks[] = {
+    { .name = "mqtt", .init = mqttSinkInit, .send = mqttSinkSend },
+    { .name = "msb", .init = msbSinkInit, .send = msbSinkSend },
+    { .name = "file", .init = fileSinkInit, .send = fileSinkSend },
+    { .name = "influx", .init = influxInit, .send = influxSend },
+};
+
+static struct sink *Active[SINKMAX];
+static int NActive = 0;
+
+static void *sinkRun(void *arg) {
+    struct sink *s = arg;
+    struct sinkSnap snap;
+    struct timespec t0, t1;
+    uint32_t us;
+    int result;
+
+    for (;;) {
+	// take a copy, sinkPut() may overwrite the slot meanwhile
+	pthread_mutex_lock(&s->lock);
+	while (s->head == s->tail)
+	    pthread_cond_wait(&s->cond, &s->lock);
+	snap.time = s->queue[s->tail % SINKQUEUE].time;
+	snap.n = s->queue[s->tail % SINKQUEUE].n;
+	memcpy(snap.f, s->queue[s->tail % SINKQUEUE].f, snap.n * sizeof(snap.f[0]));
+	s->tail++;
+	s->stat->pending = s->head - s->tail;
+	pthread_mutex_unlock(&s->lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	result = s->send(snap.f, snap.n, snap.time);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	us = (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
+	s->stat->lastSend = us;
+	if (us > s->stat->maxSend)
+	    s->stat->maxSend = us;
+	if (result < 0)
+	    s->stat->errors++;
+	else {
+	    s->stat->sent++;
+	    s->stat->lastData = time(NULL);
+	}
+    }
+    return (NULL);
+}
+
+// start the sink called name, -1 if there is none or it failed
+int sinkStart(const char *name) {
+    char message[MAXPATH];
+    struct sink *s = NULL;
+    int i, result;
+
+    for (i = 0; i < (int)(sizeof(Sinks) / sizeof(Sinks[0])); i++)
+	if (strcmp(Sinks[i].name, name) == 0)
+	    s = &Sinks[i];
+    if (s == NULL || NActive >= SINKMAX) {
+	sprintf(message, "%s: unknown sink >%s<", DaemonName, name);
+	LOGERR(message);
+	return (-1);
+    }
+    if (s->stat != NULL)
+	return (0);
+    if (s->init() < 0) {
+	sprintf(message, "%s: could not initialize sink %s", DaemonName, name);
+	LOGERR(message);
+	return (-1);
+    }
+
+    s->stat = &emsPtr->stat.sink[NActive];
+    memset(s->stat, 0, sizeof(*s->stat));
+    snprintf(s->stat->name, sizeof(s->stat->name), "%s", name);
+    s->head = s->tail = 0;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    if ((result = pthread_create(&s->thread, NULL, sinkRun, s)) != 0) {
+	sprintf(message, "%s: could not start thread of sink %s, %s", DaemonName, name, strerror(result));
+	LOGERR(message);
+	s->stat->name[0] = '\0';
+	s->stat = NULL;
+	return (-1);
+    }
+    Active[NActive++] = s;
+    sprintf(message, "%s: sink %s started", DaemonName, name);
+    LOGIT(message);
+    return (0);
+}
+
+// queue the snapshot (n fields, taken at t) for all sinks, never blocks
+void sinkPut(const struct emsField *snap, int n, time_t t) {
+    struct sink *s;
+    struct sinkSnap *q;
+    int i;
+
+    for (i = 0; i < NActive; i++) {
+	s = Active[i];
+	pthread_mutex_lock(&s->lock);
+	if (s->head - s->tail >= SINKQUEUE) {
+	    // the sink falls behind: give up its oldest snapshot
+	    s->tail++;
+	    s->stat->dropped++;
+	}
+	q = &s->queue[s->head % SINKQUEUE];
+	q->time = t;
+	q->n = n;
+	memcpy(q->f, snap, n * sizeof(*snap));
+	s->head++;
+	s->stat->queued++;
+	s->stat->pending = s->head - s->tail;
+	if (s->stat->pending > s->stat->maxPending)
+	    s->stat->maxPending = s->stat->pending;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+    }
+}
+
+// mqtt: the settings of [EMS] and [TOPICS], publishing as emsMqtt does
+// (registered topics with aliases, QoS, retain and expiry) but without
+// deadband and spool; while the broker is away snapshots are lost
+
+static char Prefix[MAXNAME];
+static char JsonTopic[2 * MAXNAME];
+static int Mode;        // MQTT_TOPICS and/or MQTT_JSON
+static char Json[JSONSIZE];
+static int TopicId[MAXFIELDS];  // mqttTopic() id per field
+static int NTopicIds = 0;
+static int JsonId;
+
+// register the topics of fields NTopicIds .. n-1 (new fields of emsDecode)
+static void mqttSinkTopics(const struct emsField *snap, int n) {
+    char topic[2 * MAXNAME + FIELDNAME];
+
+    for (; NTopicIds < n; NTopicIds++) {
+	snprintf(topic, sizeof(topic), "%s/%s", Prefix, snap[NTopicIds].name);
+	TopicId[NTopicIds] = topicPolicy(snap[NTopicIds].name, topic, snap[NTopicIds].flags & FF_RETAIN);
+    }
+}
+
+static int mqttSinkInit(void) {
+    snprintf(emsPtr->cfg.broker, sizeof(emsPtr->cfg.broker), "%s", Conf->ems.broker);
+    emsPtr->cfg.port = Conf->ems.port;
+    snprintf(emsPtr->cfg.cert, sizeof(emsPtr->cfg.cert), "%s", Conf->ems.cert);
+    Mode = Conf->ems.mqttmode;
+    snprintf(Prefix, sizeof(Prefix), "%s", Conf->ems.topicprefix);
+    if (Conf->ems.jsontopic[0] != '\0')
+	snprintf(JsonTopic, sizeof(JsonTopic), "%s", Conf->ems.jsontopic);
+    else
+	snprintf(JsonTopic, sizeof(JsonTopic), "%s/json", Prefix);
+    if (Mode & MQTT_JSON)
+	JsonId = topicPolicy("json", JsonTopic, false);
+    mosquitto_lib_init();
+    mqttOwner(PROC_PUB);
+    return (initMosquitto(emsPtr));
+}
+
+static int mqttSinkSend(const struct emsField *snap, int n, time_t t) {
+    char value[24];
+    int i, len, result = 0;
+
+    if (Mode & MQTT_JSON) {
+	if ((len = snapJson(snap, n, t, Json, JSONSIZE)) < 0
+	    || mqttSend(emsPtr, JsonId, Json, len) != 0)
+	    result = -1;
+    }
+    if (Mode & MQTT_TOPICS) {
+	mqttSinkTopics(snap, n);
+	for (i = 0; i < n; i++) {
+	    len = fieldFormat(&snap[i], value);
+	    if (mqttSend(emsPtr, TopicId[i], value, len) != 0)
+		result = -1;
+	}
+    }
+    return (result);
+}
+
+// msb: the settings of [V4K], the msb client has its own sender thread
+
+static int msbSinkInit(void) {
+    msbConfig(emsPtr);
+    return (initMsb(emsPtr));
+}
+
+static int msbSinkSend(const struct emsField *snap, int n, time_t t) {
+    msbQueue(snap, n, (int64_t)t * 1000000000);
+    return (0);
+}
+
+// file: JSON lines appended to [PUB] file
+
+static int FileFd = -1;
+
+static int fileSinkInit(void) {
+    char name[MAXPATH + 16], message[3 * MAXPATH];
+
+    if (Conf->pub.file[0] != '\0')
+	snprintf(name, sizeof(name), "%s", Conf->pub.file);
+    else
+	snprintf(name, sizeof(name), "%s/ems.jsonl", emsPtr->cfg.datapath);
+    if ((FileFd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+	sprintf(message, "%s: could not open %s, error %s", DaemonName, name, strerror(errno));
+	LOGERR(message);
+	return (-1);
+    }
+    return (0);
+}
+
+static int fileSinkSend(const struct emsField *snap, int n, time_t t) {
+    static char buff[JSONSIZE];
+    int len;
+
+    if ((len = snapJson(snap, n, t, buff, JSONSIZE - 1)) < 0)
+	return (-1);
+    buff[len++] = '\n';
+    return (write(FileFd, buff, len) == len ? 0 : -1);
+}
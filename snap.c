@@ -0,0 +1,95 @@
+//
+// snap.c - consistent snapshot of all fields and its JSON serialization,
+// helpers shared by the publishers
+//
+// $Id$
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+
+#include "ems.h"
+
+#define SNAPTRIES 100
+
+static uint32_t Torn = 0;   // snapshots taken without a consistent copy
+
+// copy all fields into snap (MAXFIELDS entries) so that all values belong
+// to the same moment: retried while emsDecode is in the middle of a
+// telegram (reg.seq odd) or decoded one during the copy. After SNAPTRIES
+// the last copy is used anyway, this is counted and logged.
+// Returns the number of fields.
+int snapTake(struct emsField *snap) {
+    char message[200];
+    uint32_t seq, n, i, t;
+    int tries;
+
+    for (tries = 0; tries < SNAPTRIES; tries++) {
+	seq = __atomic_load_n(&emsPtr->reg.seq, __ATOMIC_ACQUIRE);
+	if (seq & 1) {
+	    sched_yield();
+	    continue;
+	}
+	n = emsPtr->reg.nFields;
+	for (i = 0; i < n; i++)
+	    fieldRead(i, &snap[i]);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (seq == __atomic_load_n(&emsPtr->reg.seq, __ATOMIC_RELAXED))
+	    return (n);
+    }
+    n = emsPtr->reg.nFields;
+    for (i = 0; i < n; i++)
+	fieldRead(i, &snap[i]);
+    // 1st, 10th, 100th, ... time only
+    for (i = t = __atomic_add_fetch(&Torn, 1, __ATOMIC_RELAXED); i % 10 == 0; i /= 10)
+	;
+    if (i == 1) {
+	sprintf(message, "%s: no consistent snapshot after %d tries, %u times so far", DaemonName, SNAPTRIES, t);
+	LOGERR(message);
+    }
+    return (n);
+}
+
+// append s to buff at pos, returns new pos (stops at size)
+static size_t put(char *buff, size_t pos, size_t size, const char *s, size_t len) {
+    if (pos + len >= size)
+	len = (pos < size - 1) ? size - 1 - pos : 0;
+    memcpy(buff + pos, s, len);
+    return (pos + len);
+}
+
+// {"time":1700000000,"status":3,...,"tempBoiler":45.3} into buff without
+// any allocation. Returns the length or -1 if size was too small.
+int snapJson(const struct emsField *snap, int n, time_t t, char *buff, size_t size) {
+    char num[24];
+    size_t pos = 0;
+    int i;
+
+    pos = put(buff, pos, size, "{\"time\":", 8);
+    pos = put(buff, pos, size, num, snprintf(num, sizeof(num), "%lld", (long long)t));
+    for (i = 0; i < n; i++) {
+	pos = put(buff, pos, size, ",\"", 2);
+	pos = put(buff, pos, size, snap[i].name, strlen(snap[i].name));
+	pos = put(buff, pos, size, "\":", 2);
+	pos = put(buff, pos, size, num, fieldFormat(&snap[i], num));
+    }
+    pos = put(buff, pos, size, "}", 1);
+    buff[pos] = '\0';
+    return (pos + 1 < size ? (int)pos : -1);
+}
+
+// CPU time of this thread since t0 (CLOCK_THREAD_CPUTIME_ID), into the
+// cycle statistics s of a publisher
+void pubCpu(struct pubStats *s, const struct timespec *t0) {
+    struct timespec t1;
+    uint32_t us;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+    us = (t1.tv_sec - t0->tv_sec) * 1000000 + (t1.tv_nsec - t0->tv_nsec) / 1000;
+    s->cycleCpu = us;
+    if (us > s->maxCpu)
+	s->maxCpu = us;
+    s->totalCpu += us;
+    s->cycles++;
+}
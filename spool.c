@@ -0,0 +1,321 @@
+//
+// spool.c - bounded, crash-safe store-and-forward queue for emsMqtt
+//
+// $Id$
+//
+// <datapath>/mqtt.spool is a ring of SPOOLSLOT byte slots. Slot 0 is the file
+// header (magic, number of slots, sequence number of the last message that
+// was replayed), the others hold records:
+//
+//   struct spoolRec (seq, stamp, checksum, slots, topic and payload length)
+//   followed by topic and payload, spanning as many slots as needed.
+//
+// Records are written one after the other and wrap to slot 1 when the next
+// one does not fit before the end of the file. When the ring is full the
+// oldest records are overwritten (and counted as dropped). The checksum
+// covers the whole record, so a record torn by a crash or partly overwritten
+// is ignored. Only the header is updated in place; at start the file is
+// scanned for the oldest record after the header's done mark. Replay is
+// at-least-once: messages replayed after the last spoolSync() may be sent
+// again after a crash.
+
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ems.h"
+
+#define SPOOLMAGIC "EMSSPL1"
+#define SPOOLSLOT 64
+#define SPOOLNAME "mqtt.spool"
+
+struct spoolHdr {
+    char magic[8];
+    uint32_t slots;       // slots of the file, including this header
+    uint32_t pad;
+    uint64_t done;        // seq of the last replayed record
+};
+
+struct spoolRec {
+    uint64_t seq;
+    int64_t stamp;        // ns, when the message was spooled
+    uint32_t sum;         // FNV-1a of the record with sum = 0
+    uint16_t slots;
+    uint16_t plen;
+    uint8_t tlen;
+    uint8_t pad[7];
+};
+
+static int SpoolFd = -1;
+static uint32_t Slots;        // slots of the file
+static uint32_t Wpos, Rpos;   // slot of the next record to write / to replay
+static uint64_t Wseq, Rseq;   // its seq
+static int Dirty = false;
+static uint8_t Rec[SPOOLMAX];
+
+static uint32_t spoolSum(const uint8_t *p, size_t len) {
+    uint32_t h = 2166136261u;
+
+    while (len--) {
+	h ^= *p++;
+	h *= 16777619u;
+    }
+    return (h);
+}
+
+static uint32_t recSlots(int tlen, int plen) {
+    return ((sizeof(struct spoolRec) + tlen + plen + SPOOLSLOT - 1) / SPOOLSLOT);
+}
+
+// is buf (room for len bytes) a complete record?
+static int recValid(const uint8_t *buf, size_t len) {
+    struct spoolRec r;
+    uint32_t sum;
+
+    if (len < sizeof(r))
+	return (false);
+    memcpy(&r, buf, sizeof(r));
+    if (r.slots == 0 || r.seq == 0 || r.slots != recSlots(r.tlen, r.plen)
+	|| (size_t)r.slots * SPOOLSLOT > len)
+	return (false);
+    sum = r.sum;
+    r.sum = 0;
+    return (sum == (spoolSum((uint8_t *)&r, sizeof(r))
+		    ^ spoolSum(buf + sizeof(r), r.tlen + r.plen)));
+}
+
+// read the record at slot pos into Rec, returns its seq or 0
+static uint64_t recRead(uint32_t pos) {
+    struct spoolRec r;
+    ssize_t n;
+
+    if (pos < 1 || pos >= Slots)
+	return (0);
+    n = pread(SpoolFd, Rec, (Slots - pos) * SPOOLSLOT < SPOOLMAX ? (Slots - pos) * SPOOLSLOT : SPOOLMAX,
+	      (off_t)pos * SPOOLSLOT);
+    if (n <= 0 || !recValid(Rec, n))
+	return (0);
+    memcpy(&r, Rec, sizeof(r));
+    return (r.seq);
+}
+
+// find the record with the lowest seq >= from, returns its seq (0: none) and
+// its slot in *pos. If last is given, the highest seq and the slot after it
+// are returned there.
+static uint64_t spoolScan(uint64_t from, uint32_t *pos, uint64_t *last, uint32_t *next) {
+    struct spoolRec r;
+    uint64_t first = 0;
+    uint8_t *map;
+    uint32_t i;
+
+    map = mmap(NULL, (size_t)Slots * SPOOLSLOT, PROT_READ, MAP_SHARED, SpoolFd, 0);
+    if (map == MAP_FAILED)
+	return (0);
+    for (i = 1; i < Slots;) {
+	if (!recValid(map + (size_t)i * SPOOLSLOT, (size_t)(Slots - i) * SPOOLSLOT)) {
+	    i++;
+	    continue;
+	}
+	memcpy(&r, map + (size_t)i * SPOOLSLOT, sizeof(r));
+	if (r.seq >= from && (first == 0 || r.seq < first)) {
+	    first = r.seq;
+	    *pos = i;
+	}
+	if (last != NULL && r.seq > *last) {
+	    *last = r.seq;
+	    *next = i + r.slots;
+	}
+	i += r.slots;
+    }
+    munmap(map, (size_t)Slots * SPOOLSLOT);
+    return (first);
+}
+
+static int spoolHeader(uint64_t done) {
+    struct spoolHdr h;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SPOOLMAGIC, sizeof(SPOOLMAGIC));
+    h.slots = Slots;
+    h.done = done;
+    return (pwrite(SpoolFd, &h, sizeof(h), 0) == sizeof(h) ? 0 : -1);
+}
+
+// open (or create) the spool of kbytes in path and find the messages not
+// replayed yet. A spool of a different size is started anew.
+int spoolOpen(const char *path, uint32_t kbytes) {
+    char name[MAXPATH], message[2 * MAXPATH];
+    struct spoolHdr h;
+    struct stat st;
+    uint64_t last = 0;
+
+    snprintf(name, MAXPATH, "%s/%s", path, SPOOLNAME);
+    Slots = (uint64_t)kbytes * 1024 / SPOOLSLOT;
+    if (Slots < 2 * SPOOLMAX / SPOOLSLOT)
+	Slots = 2 * SPOOLMAX / SPOOLSLOT;
+    if ((SpoolFd = open(name, O_RDWR | O_CREAT, 0644)) < 0 || fstat(SpoolFd, &st) < 0) {
+	sprintf(message, "%s: could not open spool %s, error %s", DaemonName, name, strerror(errno));
+	LOGERR(message);
+	spoolClose();
+	return (-1);
+    }
+
+    if (pread(SpoolFd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, SPOOLMAGIC, sizeof(SPOOLMAGIC))
+	|| h.slots != Slots || st.st_size != (off_t)Slots * SPOOLSLOT) {
+	if (st.st_size > 0) {
+	    sprintf(message, "%s: spool %s has a different size or is damaged, starting anew", DaemonName, name);
+	    LOGERR(message);
+	}
+	memset(&h, 0, sizeof(h));
+	if (ftruncate(SpoolFd, 0) < 0 || ftruncate(SpoolFd, (off_t)Slots * SPOOLSLOT) < 0 || spoolHeader(0) < 0) {
+	    sprintf(message, "%s: could not create spool %s, error %s", DaemonName, name, strerror(errno));
+	    LOGERR(message);
+	    spoolClose();
+	    return (-1);
+	}
+    }
+
+    Wpos = Rpos = 1;
+    Rseq = spoolScan(h.done + 1, &Rpos, &last, &Wpos);
+    Wseq = last + 1;
+    if (Wpos >= Slots)
+	Wpos = 1;
+    if (Rseq == 0) {
+	// nothing left to replay
+	Rseq = Wseq;
+	Rpos = Wpos;
+    }
+    sprintf(message, "%s: spool %s, %u kB, %llu messages to replay", DaemonName, name,
+	    (unsigned)(Slots * SPOOLSLOT / 1024), (unsigned long long)(Wseq - Rseq));
+    LOGIT(message);
+    return (0);
+}
+
+void spoolClose(void) {
+    if (SpoolFd >= 0) {
+	spoolSync();
+	close(SpoolFd);
+    }
+    SpoolFd = -1;
+}
+
+uint32_t spoolPending(void) {
+    return (SpoolFd < 0 ? 0 : (uint32_t)(Wseq - Rseq));
+}
+
+// drop the oldest record, the writer needs its slots. Returns -1 if the
+// record to replay can not be found any more.
+static int spoolDrop(void) {
+    struct spoolRec r;
+
+    if (recRead(Rpos) != Rseq && (Rpos = 1, recRead(Rpos) != Rseq))
+	return (-1);
+    memcpy(&r, Rec, sizeof(r));
+    Rpos += r.slots;
+    if (Rpos >= Slots)
+	Rpos = 1;
+    Rseq++;
+    emsPtr->stat.mqtt.dropped++;
+    return (0);
+}
+
+// append a message (topic and payload of plen bytes) spooled at stamp ns
+int spoolAdd(const char *topic, const void *payload, int plen, int64_t stamp) {
+    struct spoolRec r;
+    uint32_t n;
+    int tlen = strlen(topic);
+
+    if (SpoolFd < 0 || tlen > 255 || sizeof(r) + tlen + plen > SPOOLMAX)
+	return (-1);
+    n = recSlots(tlen, plen);
+
+    // make room: the oldest records are lost, on a wrap all those between
+    // here and the end of the file, then those in [Wpos, Wpos + n)
+    if (Wpos + n > Slots) {
+	while (Rseq < Wseq && Rpos >= Wpos && spoolDrop() == 0)
+	    ;
+	Wpos = 1;
+    }
+    while (Rseq < Wseq && Rpos >= Wpos && Rpos < Wpos + n) {
+	if (spoolDrop() < 0) {
+	    // lost track (damaged record), give up the backlog
+	    emsPtr->stat.mqtt.dropped += Wseq - Rseq;
+	    Rseq = Wseq;
+	    break;
+	}
+    }
+    if (Rseq == Wseq)
+	Rpos = Wpos;
+
+    memset(&r, 0, sizeof(r));
+    r.seq = Wseq;
+    r.stamp = stamp;
+    r.slots = n;
+    r.tlen = tlen;
+    r.plen = plen;
+    memcpy(Rec, &r, sizeof(r));
+    memcpy(Rec + sizeof(r), topic, tlen);
+    memcpy(Rec + sizeof(r) + tlen, payload, plen);
+    r.sum = spoolSum((uint8_t *)&r, sizeof(r)) ^ spoolSum(Rec + sizeof(r), tlen + plen);
+    memcpy(Rec, &r, sizeof(r));
+    if (pwrite(SpoolFd, Rec, sizeof(r) + tlen + plen, (off_t)Wpos * SPOOLSLOT) != (ssize_t)(sizeof(r) + tlen + plen))
+	return (-1);
+
+    Wpos += n;
+    if (Wpos >= Slots)
+	Wpos = 1;
+    Wseq++;
+    Dirty = true;
+    emsPtr->stat.mqtt.spooled++;
+    return (0);
+}
+
+// oldest message not replayed yet, topic and payload point into a static
+// buffer valid until the next call. Returns the payload length or -1.
+int spoolPeek(const char **topic, const void **payload, int64_t *stamp) {
+    static char t[256];
+    struct spoolRec r;
+
+    while (Rseq < Wseq) {
+	if (recRead(Rpos) == Rseq || (Rpos = 1, recRead(Rpos) == Rseq)) {
+	    memcpy(&r, Rec, sizeof(r));
+	    memcpy(t, Rec + sizeof(r), r.tlen);
+	    t[r.tlen] = '\0';
+	    *topic = t;
+	    *payload = Rec + sizeof(r) + r.tlen;
+	    *stamp = r.stamp;
+	    return (r.plen);
+	}
+	// damaged, skip to the next one we can find
+	if ((Rseq = spoolScan(Rseq + 1, &Rpos, NULL, NULL)) == 0)
+	    Rseq = Wseq;
+    }
+    return (-1);
+}
+
+// the message returned by spoolPeek() was sent
+void spoolDone(void) {
+    struct spoolRec r;
+
+    if (Rseq >= Wseq)
+	return;
+    memcpy(&r, Rec, sizeof(r));
+    Rpos += r.slots;
+    if (Rpos >= Slots)
+	Rpos = 1;
+    Rseq++;
+    Dirty = true;
+    emsPtr->stat.mqtt.replayed++;
+}
+
+// make records and the replay mark durable, once per cycle
+int spoolSync(void) {
+    if (SpoolFd < 0 || !Dirty)
+	return (0);
+    Dirty = false;
+    if (fdatasync(SpoolFd) < 0 || spoolHeader(Rseq - 1) < 0 || fdatasync(SpoolFd) < 0)
+	return (-1);
+    return (0);
+}
@@ -0,0 +1,60 @@
+//
+// tgring.c - ring of raw telegrams in shared memory
+//
+// $Id$
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ems.h"
+
+// store a received telegram, called by emsDecode only
+void tgPush(const uint8_t *data, int len, int64_t stamp) {
+    struct emsTelegramRing *r = &emsPtr->tg;
+    struct emsTelegram *t;
+    uint32_t n;
+
+    if (len < 0)
+	return;
+    if (len > TGMAXLEN)
+	len = TGMAXLEN;
+    n = r->head;
+    t = &r->t[n % TGRING];
+    t->stamp = stamp;
+    t->len = len;
+    memcpy(t->data, data, len);
+    __atomic_store_n(&r->head, n + 1, __ATOMIC_RELEASE);
+}
+
+// copy up to max telegrams starting at *pos into buf, oldest first, and
+// advance *pos behind them. A reader that fell behind more than TGRING
+// telegrams continues with the oldest one kept, the advance of *pos minus
+// the return value is the number of telegrams it lost.
+int tgReadFrom(uint32_t *pos, struct emsTelegram *buf, int max) {
+    struct emsTelegramRing *r = &emsPtr->tg;
+    uint32_t head, avail, valid, i;
+    int n, skip = 0;
+
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    avail = head - *pos;
+    if (avail > TGRING) {
+	*pos = head - TGRING;
+	avail = TGRING;
+    }
+    n = (avail > (uint32_t)max) ? max : (int)avail;
+
+    for (i = 0; i < (uint32_t)n; i++)
+	buf[i] = r->t[(*pos + i) % TGRING];
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    // drop what the writer may have overwritten while we copied
+    head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    valid = (head >= TGRING) ? head - TGRING + 1 : 0;
+    if ((int32_t)(valid - *pos) > 0)
+	skip = (valid - *pos > (uint32_t)n) ? n : (int)(valid - *pos);
+    if (skip > 0)
+	memmove(buf, buf + skip, (n - skip) * sizeof(*buf));
+
+    *pos += n;
+    return (n - skip);
+}
@@ -0,0 +1,78 @@
+//
+// tick.c - drift-free periodic wakeups for the publishers
+//
+// $Id$
+//
+// The publishers sleep until absolute deadlines (clock_nanosleep with
+// TIMER_ABSTIME) that advance by exactly one period, so the time spent
+// publishing does not add up. With alignment the deadlines are multiples of
+// the period on the wall clock plus a phase, e.g. period 10 s and phase 0
+// wake at :00, :10, :20, so emsMqtt and emsMsb sample at the same moments.
+// Deadlines missed by more than a period are skipped (counted as overruns)
+// instead of being caught up with a burst.
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ems.h"
+
+#define NS 1000000000LL
+
+static int64_t tickNs(const struct timespec *ts) {
+    return ((int64_t)ts->tv_sec * NS + ts->tv_nsec);
+}
+
+// deadlines every period ns; if phase >= 0 aligned to the wall clock, phase
+// ns after each multiple of period, otherwise one period from now
+void tickInit(struct tick *t, int64_t period, int64_t phase) {
+    struct timespec now;
+    int64_t next;
+
+    if (period <= 0)
+	period = NS;
+    t->period = period;
+    t->clock = (phase >= 0) ? CLOCK_REALTIME : CLOCK_MONOTONIC;
+    clock_gettime(t->clock, &now);
+    next = tickNs(&now) + period;
+    if (phase >= 0) {
+	phase %= period;
+	next = ((tickNs(&now) - phase) / period + 1) * period + phase;
+    }
+    t->next.tv_sec = next / NS;
+    t->next.tv_nsec = next % NS;
+}
+
+// sleep until the next deadline, its lateness goes into the jitter
+// statistics s. Returns the deadline as wall-clock time (now if not aligned).
+time_t tickWait(struct tick *t, struct pubStats *s) {
+    struct timespec now;
+    int64_t late, next, missed;
+    time_t deadline;
+    uint32_t us;
+
+    while (clock_nanosleep(t->clock, TIMER_ABSTIME, &t->next, NULL) == EINTR)
+	;
+    clock_gettime(t->clock, &now);
+    next = tickNs(&t->next);
+    late = tickNs(&now) - next;
+    if (late < 0)
+	late = 0;
+    deadline = (t->clock == CLOCK_REALTIME) ? t->next.tv_sec : time(NULL);
+
+    us = late / 1000;
+    s->jitter = us;
+    if (us > s->maxJitter)
+	s->maxJitter = us;
+    s->totalJitter += us;
+    s->ticks++;
+
+    // woke up a period or more too late (busy system, clock step): skip
+    missed = late / t->period;
+    s->overruns += missed;
+    next += (missed + 1) * t->period;
+    t->next.tv_sec = next / NS;
+    t->next.tv_nsec = next % NS;
+    return (deadline);
+}